@@ -0,0 +1,628 @@
+
+// End-to-end benchmark: generates a synthetic package index and local
+// bare repos, then measures cold, warm and incremental fetches of a
+// workspace depending on them. `reky_bench parse` times the sn.reky
+// parser on its own, `reky_bench stress` has several processes install
+// the same workspace at once. See bench/README.md.
+
+#include <set>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+
+#include "reky.hpp"
+
+using namespace snowball;
+using namespace snowball::reky;
+
+namespace {
+
+struct BenchConfig final {
+  // "chain", "fan", "diamond" or "conflict"
+  std::string shape = "chain";
+  // Each count is generated and measured in turn, e.g. a chain of
+  // growing depth. `packages` is the one being measured.
+  std::vector<size_t> package_counts = {50};
+  size_t packages = 50;
+  // Versions published per package, 1.0.0, 1.1.0, ...
+  size_t versions = 1;
+  // Bytes of sources per package, split over `files` files
+  size_t size = 16 * 1024;
+  size_t files = 4;
+  // Percent of the files each new version changes
+  size_t churn = 100;
+  size_t repeat = 1;
+  // "git" (bare repos) and/or "tarball" (release archives), measured in turn
+  std::vector<std::string> sources = {"git"};
+  std::string source = "git";
+  // Install workers, 0 for reky's default. Every count is measured
+  // in turn for every package count, `jobs` is the current one.
+  std::vector<size_t> job_counts = {0};
+  unsigned int jobs = 0;
+  // Processes installing the workspace at once, for `reky_bench stress`
+  size_t processes = 8;
+  std::filesystem::path work = std::filesystem::temp_directory_path() / "reky-bench";
+  // "-" for stdout
+  std::string output = "-";
+
+  nlohmann::json to_json() const {
+    return {
+      {"shape", shape},
+      {"packages", package_counts},
+      {"versions", versions},
+      {"size", size},
+      {"files", files},
+      {"churn", churn},
+      {"sources", sources},
+      {"repeat", repeat},
+      {"jobs", job_counts}
+    };
+  }
+};
+
+void usage() {
+  std::cerr << "usage: reky_bench [fetch] [--shape chain|fan|diamond|conflict] [--packages N[,N...]] [--versions N]\n"
+               "                  [--size BYTES] [--files N] [--churn PERCENT] [--repeat N] [--jobs N[,N...]]\n"
+               "                  [--source git|tarball[,...]]\n"
+               "                  [--work DIR] [--output FILE]\n"
+               "       reky_bench stress [--processes N] [generate options...]\n"
+               "       reky_bench parse [--lines N] [--repeat N] [--work DIR] [--output FILE]\n";
+  std::exit(1);
+}
+
+// "git,tarball"
+std::vector<std::string> split_list(const std::string& value) {
+  std::vector<std::string> list;
+  size_t start = 0;
+  while (start <= value.size()) {
+    auto end = std::min(value.find(',', start), value.size());
+    list.push_back(value.substr(start, end - start));
+    start = end + 1;
+  }
+  return list;
+}
+
+// "100,200,400"
+std::vector<size_t> parse_list(const std::string& value) {
+  std::vector<size_t> list;
+  for (auto& item : split_list(value)) {
+    list.push_back(std::stoul(item));
+  }
+  return list;
+}
+
+// argv[0] is the command, options follow
+BenchConfig parse_args(int argc, char** argv) {
+  BenchConfig config;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+    }
+    std::string value = argv[++i];
+    if (arg == "--shape") {
+      config.shape = value;
+    } else if (arg == "--packages") {
+      config.package_counts = parse_list(value);
+    } else if (arg == "--versions") {
+      config.versions = std::stoul(value);
+    } else if (arg == "--size") {
+      config.size = std::stoul(value);
+    } else if (arg == "--files") {
+      config.files = std::stoul(value);
+    } else if (arg == "--churn") {
+      config.churn = std::stoul(value);
+    } else if (arg == "--repeat") {
+      config.repeat = std::stoul(value);
+    } else if (arg == "--jobs") {
+      config.job_counts = parse_list(value);
+    } else if (arg == "--processes") {
+      config.processes = std::stoul(value);
+    } else if (arg == "--source") {
+      config.sources = split_list(value);
+    } else if (arg == "--work") {
+      config.work = value;
+    } else if (arg == "--output") {
+      config.output = value;
+    } else {
+      usage();
+    }
+  }
+  for (auto& source : config.sources) {
+    if (source != "git" && source != "tarball") {
+      usage();
+    }
+  }
+  if ((config.shape != "chain" && config.shape != "fan" && config.shape != "diamond" && config.shape != "conflict")
+      || config.versions == 0 || config.files == 0 || config.churn > 100 || config.processes == 0) {
+    usage();
+  }
+  for (auto packages : config.package_counts) {
+    if (packages == 0) {
+      usage();
+    }
+  }
+  return config;
+}
+
+std::string get_name(size_t id) {
+  return fmt::format("p{:05}", id);
+}
+
+// Dependencies of every package. The workspace itself only depends on
+// the first one, everything else is reached through it.
+std::vector<std::vector<size_t>> make_graph(const BenchConfig& config) {
+  auto count = config.packages;
+  std::vector<std::vector<size_t>> deps(count);
+  size_t next = 0;
+  if (config.shape == "fan") {
+    for (size_t id = 1; id < count; id++) {
+      deps[0].push_back(id);
+    }
+    return deps;
+  } else if (config.shape == "conflict") {
+    // root -> picker -> middle -> sink (the last package), for as
+    // many pickers as fit. Leftovers hang off the root.
+    auto sink = count - 1;
+    for (next = 1; next + 2 <= sink; next += 2) {
+      deps[0].push_back(next);
+      deps[next] = {next + 1};
+      deps[next + 1] = {sink};
+    }
+    for (; next < count; next++) {
+      if (next != sink || deps[0].empty()) {
+        deps[0].push_back(next);
+      }
+    }
+    return deps;
+  } else if (config.shape == "diamond") {
+    // top -> left, right -> bottom, and the bottom is the next top
+    for (; next + 3 < count; next += 3) {
+      deps[next] = {next + 1, next + 2};
+      deps[next + 1] = {next + 3};
+      deps[next + 2] = {next + 3};
+    }
+  }
+  for (; next + 1 < count; next++) {
+    deps[next] = {next + 1};
+  }
+  return deps;
+}
+
+// sn.reky of one version of a package. In the conflict shape every
+// version of a picker pins its middle to the same version, and every
+// version of a middle pins the sink to a different one. The newest
+// versions never agree, and a picker only turns out wrong once its
+// middle is decided: the solver has to backtrack until it finds the
+// versions that do agree (there always are some).
+std::string make_requirements(const BenchConfig& config, const std::vector<std::vector<size_t>>& deps,
+                              size_t id, size_t version) {
+  std::string reky;
+  for (auto dep : deps[id]) {
+    if (config.shape != "conflict" || id == 0) {
+      reky += fmt::format("{}==^1\n", get_name(dep));
+      continue;
+    }
+    auto pinned = dep + 1 == config.packages ? (version + id) % config.versions : version;
+    reky += fmt::format("{}==1.{}.0\n", get_name(dep), pinned);
+  }
+  return reky;
+}
+
+void run_git(const std::vector<std::string>& args) {
+  std::vector<std::string> argv = {"git", "-c", "user.name=reky-bench", "-c", "user.email=bench@localhost"};
+  argv.insert(argv.end(), args.begin(), args.end());
+  auto result = Process::spawn(argv, true).wait();
+  if (!result.ok()) {
+    throw std::runtime_error(fmt::format("git {} failed: {}", args.empty() ? "" : args.front(), result.err));
+  }
+}
+
+void write_file(const std::filesystem::path& path, const std::string& content) {
+  std::filesystem::create_directories(path.parent_path());
+  std::ofstream(path, std::ios::binary) << content;
+}
+
+// "-" for stdout
+void write_output(const std::string& output, const nlohmann::json& result) {
+  if (output == "-") {
+    std::cout << result.dump(2) << "\n";
+  } else {
+    std::ofstream(output) << result.dump(2) << "\n";
+  }
+}
+
+// Deterministic, so runs of different commits fetch the same bytes
+std::string make_source(size_t size, uint64_t seed) {
+  std::string content;
+  content.reserve(size);
+  uint64_t state = seed * 6364136223846793005ull + 1442695040888963407ull;
+  while (content.size() < size) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    auto c = static_cast<char>('a' + (state >> 33) % 26);
+    content += content.size() % 64 == 63 ? '\n' : c;
+  }
+  return content;
+}
+
+bool has_source(const BenchConfig& config, const std::string& source) {
+  return std::find(config.sources.begin(), config.sources.end(), source) != config.sources.end();
+}
+
+std::filesystem::path get_index(const BenchConfig& config, const std::string& source) {
+  return config.work / fmt::format("index-{}.git", source);
+}
+
+// For every source asked for: one bare repo per package under
+// <work>/repos, or one release tarball per version under
+// <work>/tarballs, with an index pointing at them as
+// <work>/index-<source>.git. The workspace is <work>/workspace.
+void generate(const BenchConfig& config, const std::vector<std::vector<size_t>>& deps) {
+  std::filesystem::remove_all(config.work);
+  auto scratch = config.work / "scratch";
+  for (size_t id = 0; id < config.packages; id++) {
+    auto name = get_name(id);
+    auto src = scratch / name;
+    run_git({"init", "-q", src.string()});
+    nlohmann::json versions = nlohmann::json::array();
+    for (size_t version = 0; version < config.versions; version++) {
+      write_file(src / REKY_DEFAULT_FILE, make_requirements(config, deps, id, version));
+      for (size_t file = 0; file < config.files; file++) {
+        if (version > 0 && file * 100 >= config.churn * config.files) {
+          // Same as in the previous version
+          continue;
+        }
+        auto seed = (id * config.versions + version) * config.files + file;
+        write_file(src / "src" / fmt::format("{}.sn", file), make_source(config.size / config.files, seed));
+      }
+      auto tag = fmt::format("1.{}.0", version);
+      run_git({"-C", src.string(), "add", "-A"});
+      run_git({"-C", src.string(), "commit", "-q", "-m", tag});
+      run_git({"-C", src.string(), "tag", tag});
+      versions.push_back(tag);
+      if (has_source(config, "tarball")) {
+        // Wrapped in a <name>-<version>/ folder, like most releases
+        auto prefix = fmt::format("{}-{}", name, tag);
+        auto tarball = config.work / "tarballs" / (prefix + ".tar.gz");
+        std::filesystem::create_directories(tarball.parent_path());
+        run_git({"-C", src.string(), "archive", "--format=tar.gz", "--prefix=" + prefix + "/", "-o", tarball.string(), tag});
+      }
+    }
+    if (has_source(config, "git")) {
+      auto repo = config.work / "repos" / (name + ".git");
+      run_git({"clone", "-q", "--bare", src.string(), repo.string()});
+      nlohmann::json package = {{"versions", versions}, {"download_url", "file://" + repo.string()}};
+      write_file(scratch / "index-git" / "pkgs" / (name + ".json"), package.dump());
+    }
+    if (has_source(config, "tarball")) {
+      auto url = "file://" + (config.work / "tarballs" / (name + "-{version}.tar.gz")).string();
+      nlohmann::json package = {{"versions", versions}, {"download_url", url}};
+      write_file(scratch / "index-tarball" / "pkgs" / (name + ".json"), package.dump());
+    }
+    std::filesystem::remove_all(src);
+  }
+  for (auto& source : config.sources) {
+    auto index_src = scratch / ("index-" + source);
+    run_git({"init", "-q", index_src.string()});
+    run_git({"-C", index_src.string(), "add", "-A"});
+    run_git({"-C", index_src.string(), "commit", "-q", "-m", "index"});
+    run_git({"clone", "-q", "--bare", index_src.string(), get_index(config, source).string()});
+  }
+  std::filesystem::remove_all(scratch);
+}
+
+// Fetches the workspace the process is in, like the compiler does
+nlohmann::json fetch(const Ctx& ctx, const BenchConfig& config, const std::string& phase, size_t iteration) {
+  RekyManager manager(ctx);
+  if (config.jobs > 0) {
+    manager.set_jobs(config.jobs);
+  }
+  std::vector<std::filesystem::path> paths = {std::filesystem::current_path()};
+  auto& cache = manager.fetch_dependencies(paths);
+  cache.save_cache(driver::get_workspace_path(ctx, driver::WorkSpaceType::Reky));
+  manager.save_lock();
+  auto data = manager.get_stats().to_json();
+  data["generated"] = config.packages;
+  data["jobs"] = config.jobs;
+  data["source"] = config.source;
+  data["phase"] = phase;
+  data["iteration"] = iteration;
+  return data;
+}
+
+// Forks `processes` builds of a cold workspace at once. Between them
+// every version that ends up in the store must be downloaded exactly
+// once (the solver may fetch more versions than it installs), and the
+// manifest they all save into must list every package.
+int run_stress(const Ctx& ctx, BenchConfig config, const std::filesystem::path& root) {
+  config.packages = config.package_counts.front();
+  config.source = config.sources.front();
+  auto deps = make_graph(config);
+  generate(config, deps);
+  setenv(REKY_INDEX_ENV, get_index(config, config.source).c_str(), 1);
+  auto stress = config.work / "stress";
+  std::filesystem::remove_all(config.work / "home");
+  std::filesystem::remove_all(root);
+  std::filesystem::remove_all(stress);
+  std::filesystem::create_directories(stress);
+  write_file(root / REKY_DEFAULT_FILE, fmt::format("{}==^1\n", get_name(0)));
+  std::filesystem::current_path(root);
+
+  auto started = std::chrono::steady_clock::now();
+  std::vector<pid_t> children;
+  for (size_t i = 0; i < config.processes; i++) {
+    auto pid = fork();
+    if (pid < 0) {
+      throw std::runtime_error("fork failed");
+    }
+    if (pid == 0) {
+      int status = 0;
+      try {
+        write_file(stress / fmt::format("{}.json", i), fetch(ctx, config, "stress", i).dump());
+      } catch (const std::exception& e) {
+        std::cerr << "process " << i << ": " << e.what() << "\n";
+        status = 1;
+      }
+      std::cout.flush();
+      _exit(status);
+    }
+    children.push_back(pid);
+  }
+  size_t failed = 0;
+  for (auto pid : children) {
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+  auto wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  nlohmann::json runs = nlohmann::json::array();
+  size_t downloaded = 0;
+  for (size_t i = 0; i < config.processes; i++) {
+    std::ifstream file(stress / fmt::format("{}.json", i));
+    if (!file) {
+      continue;
+    }
+    auto data = nlohmann::json::parse(file);
+    downloaded += data["downloaded"].get<size_t>();
+    runs.push_back(data);
+  }
+
+  size_t stored = 0;
+  for (auto& package : std::filesystem::directory_iterator(config.work / "home" / REKY_STORE_DIR)) {
+    if (!package.is_directory()) {
+      continue;
+    }
+    for (auto& version : std::filesystem::directory_iterator(package.path())) {
+      stored += version.is_directory();
+    }
+  }
+
+  // Every package has an entry, and the folder it points to exists
+  auto deps_path = driver::get_workspace_path(ctx, driver::WorkSpaceType::Deps);
+  std::set<std::string> installed;
+  std::ifstream manifest(deps_path / REKY_MANIFEST_FILE);
+  std::string line;
+  while (std::getline(manifest, line)) {
+    auto entry = DepsManifest::parse_line(line);
+    if (entry && std::filesystem::exists(deps_path / entry->first)) {
+      installed.insert(entry->second.name);
+    }
+  }
+  nlohmann::json missing = nlohmann::json::array();
+  for (size_t id = 0; id < config.packages; id++) {
+    if (installed.count(get_name(id)) == 0) {
+      missing.push_back(get_name(id));
+    }
+  }
+
+  bool ok = failed == 0 && downloaded == stored && missing.empty();
+  auto to_json = config.to_json();
+  to_json["processes"] = config.processes;
+  write_output(config.output, {
+    {"config", to_json},
+    {"ok", ok},
+    {"failed", failed},
+    {"downloaded", downloaded},
+    {"stored", stored},
+    {"missing", missing},
+    {"wall_time", wall_time},
+    {"runs", runs}
+  });
+  return ok ? 0 : 1;
+}
+
+struct ParseConfig final {
+  size_t lines = 100000;
+  size_t repeat = 5;
+  std::filesystem::path work = std::filesystem::temp_directory_path() / "reky-bench";
+  std::string output = "-";
+};
+
+ParseConfig parse_parse_args(int argc, char** argv) {
+  ParseConfig config;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+    }
+    std::string value = argv[++i];
+    if (arg == "--lines") {
+      config.lines = std::stoul(value);
+    } else if (arg == "--repeat") {
+      config.repeat = std::stoul(value);
+    } else if (arg == "--work") {
+      config.work = value;
+    } else if (arg == "--output") {
+      config.output = value;
+    } else {
+      usage();
+    }
+  }
+  return config;
+}
+
+// What a large, hand-written sn.reky has: requirements of every kind,
+// some with paths, comments and blank lines
+std::string make_config(size_t lines) {
+  static const char* requirements[] = {"^1.2", "~2.0.1", ">=1.0, <3", "1.4.2", "*"};
+  std::string content;
+  for (size_t line = 0; line < lines; line++) {
+    if (line % 50 == 0) {
+      content += "# group " + std::to_string(line / 50) + "\n";
+    } else if (line % 50 == 25) {
+      content += "\n";
+    } else if (line % 10 == 0) {
+      content += fmt::format("{} == {}; paths=src, include/{}\n", get_name(line), requirements[line % 5], line % 7);
+    } else {
+      content += fmt::format("{}=={}\n", get_name(line), requirements[line % 5]);
+    }
+  }
+  return content;
+}
+
+template<typename F>
+double time_seconds(F&& run) {
+  auto started = std::chrono::steady_clock::now();
+  run();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+// Parsing alone, and the two ways reky reads a sn.reky from disk
+int run_parse(int argc, char** argv) {
+  auto config = parse_parse_args(argc, argv);
+  auto folder = config.work / "parse";
+  std::filesystem::remove_all(folder);
+  auto content = make_config(config.lines);
+  write_file(folder / REKY_DEFAULT_FILE, content);
+
+  nlohmann::json runs = nlohmann::json::array();
+  auto record = [&](const std::string& phase, size_t iteration, size_t entries, double seconds) {
+    runs.push_back({
+      {"phase", phase},
+      {"iteration", iteration},
+      {"entries", entries},
+      {"wall_time", seconds},
+      {"lines_per_second", config.lines / seconds},
+      {"bytes_per_second", content.size() / seconds}
+    });
+  };
+  for (size_t iteration = 0; iteration < config.repeat; iteration++) {
+    RekyConfig entries;
+    auto seconds = time_seconds([&] {
+      ConfigParser::parse(content, entries, [](const std::string&, unsigned int) {});
+    });
+    record("parse", iteration, entries.size(), seconds);
+    ConfigArena arena;
+    seconds = time_seconds([&] {
+      entries = parse_config(folder, arena);
+    });
+    record("parse_config", iteration, entries.size(), seconds);
+    std::unordered_map<std::string, std::string> map;
+    seconds = time_seconds([&] {
+      map = parse_config(folder);
+    });
+    record("parse_config_map", iteration, map.size(), seconds);
+  }
+  std::filesystem::remove_all(folder);
+
+  write_output(config.output, {
+    {"config", {{"lines", config.lines}, {"bytes", content.size()}, {"repeat", config.repeat}}},
+    {"runs", runs}
+  });
+  return 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && std::string(argv[1]) == "parse") {
+    return run_parse(argc - 1, argv + 1);
+  }
+  bool stress = argc > 1 && std::string(argv[1]) == "stress";
+  if (argc > 1 && (stress || std::string(argv[1]) == "fetch")) {
+    argc--;
+    argv++;
+  }
+  auto config = parse_args(argc, argv);
+  // Runs happen inside the workspace
+  config.work = std::filesystem::absolute(config.work);
+  if (config.output != "-") {
+    config.output = std::filesystem::absolute(config.output).string();
+  }
+  // Nothing the benchmark does touches the user's own home
+  auto home = config.work / "home";
+  auto root = config.work / "workspace";
+  setenv(REKY_HOME_ENV, home.c_str(), 1);
+  // A running daemon would answer for us and skew the numbers
+  setenv(REKY_DAEMON_ENV, "0", 1);
+
+  Ctx ctx;
+  if (stress) {
+    return run_stress(ctx, config, root);
+  }
+  nlohmann::json generated = nlohmann::json::array();
+  nlohmann::json runs = nlohmann::json::array();
+  for (auto packages : config.package_counts) {
+    config.packages = packages;
+    auto deps = make_graph(config);
+    auto started = std::chrono::steady_clock::now();
+    generate(config, deps);
+    auto generate_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    generated.push_back({{"packages", packages}, {"time", generate_time}});
+    auto requirements = fmt::format("{}==^1\n", get_name(0));
+    // Pinning the last package downgrades it when there are older versions
+    auto pinned = requirements + fmt::format("{}==1.0.0\n", get_name(packages - 1));
+    for (auto& source : config.sources) {
+      config.source = source;
+      // Cold runs start without the index, it's cloned from this one
+      setenv(REKY_INDEX_ENV, get_index(config, source).c_str(), 1);
+      for (auto jobs : config.job_counts) {
+        config.jobs = jobs;
+        for (size_t iteration = 0; iteration < config.repeat; iteration++) {
+          // Nothing downloaded, not even the index
+          std::filesystem::remove_all(home);
+          std::filesystem::remove_all(root);
+          write_file(root / REKY_DEFAULT_FILE, requirements);
+          std::filesystem::current_path(root);
+          runs.push_back(fetch(ctx, config, "cold", iteration));
+          // The lockfile is fresh, Deps is complete
+          runs.push_back(fetch(ctx, config, "warm", iteration));
+          // One requirement changed
+          write_file(root / REKY_DEFAULT_FILE, pinned);
+          runs.push_back(fetch(ctx, config, "incremental", iteration));
+          // Another checkout of the project: everything is in the store
+          std::filesystem::remove_all(driver::get_workspace_path(ctx, driver::WorkSpaceType::Deps));
+          std::filesystem::remove_all(driver::get_workspace_path(ctx, driver::WorkSpaceType::Reky));
+          write_file(root / REKY_DEFAULT_FILE, requirements);
+          runs.push_back(fetch(ctx, config, "workspace", iteration));
+        }
+      }
+    }
+    // Out of the work directory before it's generated again
+    std::filesystem::current_path(config.work.parent_path());
+  }
+
+  nlohmann::json result = {
+    {"config", config.to_json()},
+    {"generated", generated},
+    {"runs", runs}
+  };
+  write_output(config.output, result);
+  return 0;
+}
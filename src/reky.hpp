@@ -4,9 +4,21 @@
 
 #include <vector>
 #include <string>
+#include <optional>
+#include <algorithm>
+#include <string_view>
 #include <filesystem>
 #include <unordered_map>
+#include <set>
 #include <fstream>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <functional>
+#include <stdexcept>
 
 #include <fmt/format.h>
 #include <nlohmann/json.hpp>
@@ -18,6 +30,26 @@
 #include "compiler/utils/logger.h"
 #include "compiler/backend/drivers.h"
 
+#include "reky/pool.hpp"
+#include "reky/file.hpp"
+#include "reky/config.hpp"
+#include "reky/graph.hpp"
+#include "reky/store.hpp"
+#include "reky/index.hpp"
+#include "reky/process.hpp"
+#include "reky/archive.hpp"
+#include "reky/mirror.hpp"
+#include "reky/lock.hpp"
+#include "reky/manifest.hpp"
+#include "reky/semver.hpp"
+#include "reky/solver.hpp"
+#include "reky/stats.hpp"
+#include "reky/trace.hpp"
+#include "reky/channel.hpp"
+#include "reky/bundle.hpp"
+#include "reky/daemon.hpp"
+#include "reky/watch.hpp"
+
 #ifndef REKY_PACKAGE_INDEX 
 #define REKY_PACKAGE_INDEX "https://github.com/snowball-lang/packages.git"
 #endif
@@ -30,6 +62,25 @@
 #define REKY_DEFAULT_FILE "sn.reky"
 #endif
 
+#ifndef REKY_INDEX_STAMP
+#define REKY_INDEX_STAMP "reky_stamp"
+#endif
+
+#ifndef REKY_INDEX_TTL
+// Seconds a fetched package index is considered fresh
+#define REKY_INDEX_TTL 300
+#endif
+
+#ifndef REKY_HOME_ENV
+// Moves everything reky keeps in the Snowball home somewhere else
+#define REKY_HOME_ENV "REKY_HOME"
+#endif
+
+#ifndef REKY_INDEX_ENV
+// Clones the package index from somewhere else than REKY_PACKAGE_INDEX
+#define REKY_INDEX_ENV "REKY_INDEX"
+#endif
+
 using json = nlohmann::json;
 
 namespace snowball {
@@ -44,284 +95,2323 @@ struct RequiredPackage final {
   std::string download_url;
 };
 
+// A package that has been validated against the index
+// and is ready to be downloaded
+struct InstallJob final {
+  std::string name;
+  std::string version;
+  std::string download_url;
+  std::filesystem::path package_path;
+  // Only these subpaths (and the sn.reky) are fetched, if any
+  std::vector<std::string> paths;
+};
+
+// A package that is fully in Deps and can be compiled
+struct PackageReady final {
+  std::string name;
+  std::string version;
+  std::filesystem::path path;
+};
+
 struct RekyContext final {
+  // Looked up the first time git is needed, see get_git_args
   std::string git_cmd;
+  std::once_flag git_lookup;
+  // Only set for workspaces of other processes (see set_workspace),
+  // otherwise they come from the compiler context
+  std::filesystem::path deps_path;
+  std::filesystem::path reky_path;
   bool first_run = true;
   bool index_fetched = false;
+  // Max number of packages installed at the same time
+  unsigned int jobs = REKY_DEFAULT_JOBS;
+  // The index is not pulled again until it is older than this
+  std::chrono::seconds index_ttl = std::chrono::seconds(REKY_INDEX_TTL);
+  // Serve a stale index right away and pull it on another thread
+  bool background_index_refresh = false;
+};
+
+struct ReckyCache;
+
+// Read-only view of a ReckyCache that looks like the
+// std::unordered_map<name, version> it used to be.
+class CacheView final {
+  const ReckyCache* owner;
+public:
+  using value_type = std::pair<const std::string&, const std::string&>;
+
+  class iterator final {
+    const ReckyCache* owner;
+    const PackageId* current;
+    mutable std::optional<value_type> value;
+  public:
+    iterator(const ReckyCache* owner, const PackageId* current) : owner(owner), current(current) {}
+    const value_type& operator*() const;
+    const value_type* operator->() const { return &**this; }
+    iterator& operator++() { ++current; return *this; }
+    bool operator!=(const iterator& other) const { return current != other.current; }
+    bool operator==(const iterator& other) const { return current == other.current; }
+  };
+
+  explicit CacheView(const ReckyCache* owner) : owner(owner) {}
+
+  iterator begin() const;
+  iterator end() const;
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+  size_t count(std::string_view name) const;
+  const std::string& at(std::string_view name) const;
+  const std::string& operator[](std::string_view name) const { return at(name); }
 };
 
+// Installed packages and their versions, keyed by interned id
 struct ReckyCache final {
-  std::unordered_map<std::string, std::string> cache;
+  std::shared_ptr<NameTable> names;
+  // Indexed by id, only meaningful for ids in `packages`
+  std::vector<std::string> versions;
+  std::vector<char> present;
+  // Ids of every cached package, in insertion order
+  std::vector<PackageId> packages;
+  // Kept for code that still reads the cache as a map of names
+  CacheView cache{this};
   bool has_changed = false;
 
-  void save(std::ostream& file) {
+  explicit ReckyCache(std::shared_ptr<NameTable> names = std::make_shared<NameTable>())
+    : names(std::move(names)) {}
+
+  ReckyCache(const ReckyCache& other)
+    : names(other.names), versions(other.versions), present(other.present), packages(other.packages),
+      has_changed(other.has_changed) {}
+
+  ReckyCache& operator=(const ReckyCache& other) {
+    names = other.names;
+    versions = other.versions;
+    present = other.present;
+    packages = other.packages;
+    has_changed = other.has_changed;
+    return *this;
+  }
+
+  // Entries are sorted so unchanged caches serialize to the same bytes
+  std::vector<std::pair<std::string_view, std::string_view>> get_sorted_entries() const {
+    std::vector<std::pair<std::string_view, std::string_view>> entries;
+    entries.reserve(packages.size());
+    for (auto id : packages) {
+      entries.emplace_back(names->get_name(id), versions[id]);
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+  }
+
+  std::string serialize() const {
+    auto entries = get_sorted_entries();
     // Get the largest key size
     size_t max_key_size = 0;
-    for (auto& [key, value] : cache) {
+    size_t total_size = 0;
+    for (auto& [key, value] : entries) {
       max_key_size = std::max(max_key_size, key.size());
+      total_size += value.size();
     }
-    // Write the cache to the file
-    for (auto& [key, value] : cache) {
-      file << key;
-      for (size_t i = 0; i < max_key_size - key.size(); i++) {
-        file << " ";
-      }
-      file << " == " << value << std::endl;
+    std::string buffer;
+    buffer.reserve(total_size + entries.size() * (max_key_size + 5));
+    for (auto& [key, value] : entries) {
+      buffer += key;
+      buffer.append(max_key_size - key.size(), ' ');
+      buffer += " == ";
+      buffer += value;
+      buffer += '\n';
     }
+    return buffer;
+  }
+
+  void save(std::ostream& file) {
+    file << serialize();
   }
 
+  // Only touches the file if its content would change, and replaces
+  // it atomically so concurrent builds never read a torn cache.
   void save_cache(const std::filesystem::path& root) {
-    std::ofstream file(root / REKY_CACHE_FILE);
-    save(file);
+    TraceSpan span("save_cache");
+    AtomicFile::write_if_changed(root / REKY_CACHE_FILE, serialize());
+  }
+
+  bool has_package(PackageId id) const {
+    return id < present.size() && present[id];
+  }
+
+  bool has_package(std::string_view name) const {
+    auto id = names->find(name);
+    return id.has_value() && has_package(id.value());
+  }
+
+  const std::string& get_version(PackageId id) const {
+    return versions[id];
+  }
+
+  PackageId add_package(std::string_view name, std::string_view version) {
+    auto id = names->intern(name);
+    add_package(id, version);
+    return id;
   }
 
-  bool has_package(const std::string& name) {
-    return cache.find(name) != cache.end();
+  void add_package(PackageId id, std::string_view version) {
+    if (id >= present.size()) {
+      present.resize(id + 1, false);
+      versions.resize(id + 1);
+    }
+    if (!present[id]) {
+      present[id] = true;
+      packages.push_back(id);
+    }
+    versions[id] = version;
+    has_changed = true;
   }
 
-  void add_package(const std::string& name, const std::string& version) {
-    cache[name] = version;
+  void remove_package(PackageId id) {
+    if (!has_package(id)) {
+      return;
+    }
+    present[id] = false;
+    packages.erase(std::find(packages.begin(), packages.end(), id));
     has_changed = true;
   }
 
+  void reserve(size_t count) {
+    packages.reserve(count);
+  }
+
   void reset_changed() {
     has_changed = false;
   }
 };
 
+inline const CacheView::value_type& CacheView::iterator::operator*() const {
+  value.emplace(owner->names->get_name(*current), owner->versions[*current]);
+  return *value;
+}
+
+inline CacheView::iterator CacheView::begin() const {
+  return iterator(owner, owner->packages.data());
+}
+
+inline CacheView::iterator CacheView::end() const {
+  return iterator(owner, owner->packages.data() + owner->packages.size());
+}
+
+inline size_t CacheView::size() const {
+  return owner->packages.size();
+}
+
+inline size_t CacheView::count(std::string_view name) const {
+  return owner->has_package(name) ? 1 : 0;
+}
+
+inline const std::string& CacheView::at(std::string_view name) const {
+  static const std::string empty;
+  auto id = owner->names->find(name);
+  return id.has_value() && owner->has_package(id.value()) ? owner->versions[id.value()] : empty;
+}
+
+// Thrown instead of exiting while the daemon serves a request,
+// so a broken workspace can't take it down
+struct RekyError final : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Set on daemon request threads: errors are collected in
+// `messages` and thrown as a RekyError instead of printed
+struct ErrorCapture final {
+  bool active = false;
+  std::string messages;
+};
+inline thread_local ErrorCapture error_capture;
+
 void error(const std::string& message, unsigned int line, std::string file) {
+  if (error_capture.active) {
+    error_capture.messages += fmt::format("{}:{}: {}\n", file, line, message);
+    return;
+  }
   auto efile = std::make_shared<frontend::SourceFile>(file);
   auto err = E(message, frontend::SourceLocation(line, 1, 1, efile));
   err.print();
 }
 
+// Give up after the errors reported with a location
+[[noreturn]] void exit_with_errors() {
+  if (error_capture.active) {
+    throw RekyError(error_capture.messages);
+  }
+  exit(1);
+}
+
 [[noreturn]] void error(const std::string& message) {
+  if (error_capture.active) {
+    throw RekyError(error_capture.messages + message);
+  }
   auto ef = std::make_shared<frontend::SourceFile>();
   auto err = E(message, frontend::SourceLocation(0,0,0, ef));
   err.print();
   exit(1);
 }
 
-std::unordered_map<std::string, std::string> parse_config(const std::filesystem::path& path, bool for_cache = false) {
-  std::unordered_map<std::string, std::string> config;
+// Parsed entries point into `arena` and stay valid until it is cleared
+RekyConfig parse_config(const std::filesystem::path& path, ConfigArena& arena, bool for_cache = false) {
+  TraceSpan span("parse_config", path.native());
+  RekyConfig config;
   auto reky_config = path / (!for_cache ? REKY_DEFAULT_FILE : REKY_CACHE_FILE);
-  if (!std::filesystem::exists(reky_config)) {
+  auto content = arena.load(reky_config);
+  if (!content.has_value()) {
     return config;
   }
-  std::ifstream file(reky_config);
-  std::string line;
-  unsigned int line_number = 1;
-  bool has_error = false;
-  // Classic requirements.txt like format
-  while (std::getline(file, line)) {
-    utils::strip(line);
-    if (utils::sw(line, "#") || line.empty()) {
-      continue;
-    }
-    auto pos = line.find("==");
-    if (pos == std::string::npos) {
-      error("Invalid package format. Must be 'name==version'", line_number, reky_config.string());
-      has_error = true;
-      continue;
-    }
-    auto name = line.substr(0, pos);
-    auto version = line.substr(pos + 2);
-    config[name] = version;
-    if (version.empty()) {
-      error("Invalid version format. Must be 'name==version'", line_number, reky_config.string());
-      has_error = true;
-      continue;
-    } else if (name.empty()) {
-      error("Invalid name format. Must be 'name==version'", line_number, reky_config.string());
-      has_error = true;
-      continue;
-    }
-    line_number++;
-  }
-  if (has_error) {
-    exit(1);
+  auto valid = ConfigParser::parse(content.value(), config, [&](const std::string& message, unsigned int line) {
+    error(message, line, reky_config.string());
+  });
+  if (!valid) {
+    exit_with_errors();
   }
   return config;
 }
 
-struct DepsGraph final {
-  std::map<std::string, std::vector<std::string>> graph;
-};
+std::unordered_map<std::string, std::string> parse_config(const std::filesystem::path& path, bool for_cache = false) {
+  ConfigArena arena;
+  std::unordered_map<std::string, std::string> config;
+  for (auto& entry : parse_config(path, arena, for_cache)) {
+    config.emplace(entry.name, entry.version);
+  }
+  return config;
+}
+
+// Shared by every workspace of the user, e.g. benchmarks use a
+// home of their own so they start cold without touching the real one
+std::filesystem::path get_reky_home() {
+  if (auto home = getenv(REKY_HOME_ENV)) {
+    return home;
+  }
+  return driver::get_snowball_home();
+}
+
+std::string get_package_index_url() {
+  if (auto url = getenv(REKY_INDEX_ENV)) {
+    return url;
+  }
+  return REKY_PACKAGE_INDEX;
+}
 
 class RekyManager final {
   RekyContext ctx;
+  // Shared by the cache and the graph
+  std::shared_ptr<NameTable> names;
   ReckyCache cache;
   DepsGraph graph;
   const Ctx& compiler_ctx;
+  std::mutex output_mutex;
+  // Pulls the index in the background, see refresh_index_in_background
+  std::thread index_refresh;
+  ProcessLog processes;
+  PackageStore store;
+  MirrorCache mirrors;
+  PackageIndex index;
+  // Backs every config parsed during a resolve
+  ConfigArena arena;
+  // Paths the resolution started from and every sn.reky it read
+  std::vector<std::string> roots;
+  std::vector<std::filesystem::path> contributing_configs;
+  std::optional<Lockfile> lock;
+  bool restored_from_lock = false;
+  // Dependencies are served from this instead of Deps, if it's open
+  VendorBundle bundle;
+  std::unordered_map<std::string, const VendorBundle::Package*> bundle_folders;
+  bool restored_from_bundle = false;
+  // The daemon did the fetch, this process only has its result
+  bool restored_from_daemon = false;
+  // Only the edges of changed packages moved, see refresh_dependencies
+  bool refreshed = false;
+  // hash -> name, version and commit of everything in Deps
+  DepsManifest manifest;
+  // Versions of every package seen while solving, indexed by id
+  std::vector<std::optional<VersionCatalog>> catalogs;
+  // Subpaths sn.reky entries asked for, by package name
+  std::mutex paths_mutex;
+  std::unordered_map<std::string, std::vector<std::string>> declared_paths;
+  // Sources of a package version, fetched by whoever needs them first:
+  // a prefetch worker or the solver
+  struct Prefetch final {
+    std::once_flag once;
+    std::optional<std::filesystem::path> sources;
+  };
+  std::mutex prefetch_mutex;
+  std::unordered_map<std::string, std::shared_ptr<Prefetch>> prefetches;
+  // Workers don't share the solver's index, it may be reloaded under them
+  PackageIndex prefetch_index;
+  std::filesystem::path prefetch_deps_path;
+  // Counted for get_stats, installs run on worker threads
+  ResourceUsage started = ResourceUsage::now();
+  std::atomic<size_t> installed_count = 0;
+  std::atomic<size_t> upgraded_count = 0;
+  std::atomic<size_t> downloaded_count = 0;
+  std::atomic<uint64_t> downloaded_bytes = 0;
+  std::atomic<uint64_t> written_bytes = 0;
+  // Summed over every in-place upgrade
+  std::atomic<size_t> upgrade_written = 0;
+  std::atomic<size_t> upgrade_removed = 0;
+  std::atomic<size_t> upgrade_kept = 0;
+  size_t solver_decisions = 0;
+  size_t solver_conflicts = 0;
+  // Where the trace is written, empty if tracing is off
+  std::filesystem::path trace_output;
+  // Called from install workers too, so it has to be thread safe
+  std::function<void(const PackageReady&)> on_ready;
+  // Declared last: its workers use most of the above, so it has
+  // to go first
+  std::unique_ptr<WorkerPool> prefetch_pool;
 public:
-  RekyManager(const Ctx& compiler_ctx) : compiler_ctx(compiler_ctx) {
-    ctx.git_cmd = driver::get_git(compiler_ctx);
+  RekyManager(const Ctx& compiler_ctx)
+    : names(std::make_shared<NameTable>()), cache(names), graph(names), compiler_ctx(compiler_ctx),
+      store(get_reky_home() / REKY_STORE_DIR),
+      mirrors(get_reky_home() / REKY_MIRRORS_DIR) {
+    manifest.load(get_deps_path() / REKY_MANIFEST_FILE);
+    if (auto path = getenv(REKY_TRACE_ENV)) {
+      set_trace_output(path);
+    }
+    if (auto path = getenv(REKY_VENDOR_ENV)) {
+      if (!set_vendor_bundle(path)) {
+        error(fmt::format("Could not open the vendor bundle '{}'", path));
+      }
+    }
+  }
+
+  ~RekyManager() {
+    stop_prefetching();
+    // A long running process (the daemon, a session) would
+    // otherwise collect git zombies
+    if (index_refresh.joinable()) {
+      index_refresh.join();
+    }
+  }
+
+  // Work on a workspace other than the one of the compiler context,
+  // e.g. the daemon serving a compiler process
+  void set_workspace(const std::filesystem::path& deps_path, const std::filesystem::path& reky_path) {
+    ctx.deps_path = deps_path;
+    ctx.reky_path = reky_path;
+    std::filesystem::create_directories(deps_path);
+    std::filesystem::create_directories(reky_path);
+    manifest.load(deps_path / REKY_MANIFEST_FILE);
+  }
+
+  std::filesystem::path get_deps_path() const {
+    return ctx.deps_path.empty() ? driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Deps) : ctx.deps_path;
+  }
+
+  std::filesystem::path get_reky_path() const {
+    return ctx.reky_path.empty() ? driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Reky) : ctx.reky_path;
+  }
+
+  bool set_vendor_bundle(const std::filesystem::path& path) {
+    return bundle.open(path);
+  }
+
+  bool uses_vendor_bundle() const {
+    return bundle.is_open();
+  }
+
+  void set_trace_output(const std::filesystem::path& path) {
+    trace_output = path;
+    Tracer::get().enable();
+  }
+
+  bool write_trace() {
+    return !trace_output.empty() && Tracer::get().write(trace_output);
+  }
+
+  // Be told about every package as soon as it lands in Deps, instead
+  // of only when fetch_dependencies returns
+  void set_ready_handler(std::function<void(const PackageReady&)> handler) {
+    on_ready = std::move(handler);
+  }
+
+  void notify_ready(const std::string& name, const std::string& version) {
+    if (on_ready) {
+      auto deps_path = std::filesystem::absolute(get_deps_path());
+      on_ready(PackageReady{name, version, deps_path / get_dep_folder(name)});
+    }
   }
 
   ReckyCache& fetch_dependencies(std::vector<std::filesystem::path>& allowed_paths) {
-    if (ctx.first_run) {
-      cache = fetch_cache(allowed_paths);
-      ctx.first_run = false;
+    if (!ctx.first_run) {
+      return cache;
     }
+    ctx.first_run = false;
+    started = ResourceUsage::now();
+    TraceSpan span("fetch_dependencies");
     for (auto& path : allowed_paths) {
-      auto path_filename = path.filename().string();
-      if (path_filename.empty()) {
-        // The main crate path is empty
-        path_filename = path.parent_path().filename().string();
-      }
-      path_filename = get_name_from_hash(path_filename);
-      auto config = parse_config(path);
-      graph.graph[path_filename] = std::vector<std::string>();
-      for (auto& [name, version] : config) {
-        graph.graph[path_filename].push_back(name);
-        if (!cache.has_package(name)) {
-          auto path = driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Deps);
-          path = std::filesystem::absolute(path);
-          allowed_paths.push_back(path / get_dep_folder(name));
-          cache.add_package(name, version);
-        } else {
-          auto installed_version = cache.cache[name];
-          if (installed_version != version) {
-            error(fmt::format("Package '{}' has conflicting versions '{}' and '{}'", name, installed_version, version));
-          }
+      roots.push_back(path.string());
+    }
+    if (bundle.is_open() && restore_from_bundle(allowed_paths)) {
+      return cache;
+    }
+    lock = Lockfile::load(get_lock_path());
+    if (restore_from_lock(allowed_paths)) {
+      return cache;
+    }
+    // Resolved from scratch: the cache of the last run only says what
+    // was installed, which the manifest already tracks, and seeding the
+    // resolution with it would turn every version bump into a conflict.
+    cache = ReckyCache(names);
+    resolve(allowed_paths);
+    arena.clear();
+    return cache;
+  }
+
+  // Fetch again after some sn.reky files changed, on a manager that has
+  // fetched before (see RekySession). `changed` are the roots and Deps
+  // folders whose sn.reky did. If every requirement they have now is
+  // met by what is already selected, only their edges move and whatever
+  // isn't reachable anymore is dropped. Otherwise it's all solved again,
+  // with the index and catalogs already loaded, and the lock written by
+  // the last fetch makes the solver keep every version it still can.
+  // `allowed_paths` comes in with the roots and leaves as it would from
+  // fetch_dependencies. False if there's nothing to refresh (first run,
+  // or the result came from a bundle or the daemon).
+  bool refresh_dependencies(std::vector<std::filesystem::path>& allowed_paths,
+                            const std::vector<std::filesystem::path>& changed) {
+    if (ctx.first_run || restored_from_bundle || restored_from_daemon) {
+      return false;
+    }
+    TraceSpan span("refresh_dependencies");
+    started = ResourceUsage::now();
+    installed_count = 0;
+    upgraded_count = 0;
+    downloaded_count = 0;
+    downloaded_bytes = 0;
+    written_bytes = 0;
+    upgrade_written = 0;
+    upgrade_removed = 0;
+    upgrade_kept = 0;
+    // Saved again either way, with what the configs have now
+    restored_from_lock = false;
+    manifest.refresh();
+    std::vector<PackageId> recheck;
+    bool relinked = true;
+    for (auto& folder : changed) {
+      if (!relink(folder, recheck)) {
+        relinked = false;
+        break;
+      }
+    }
+    arena.clear();
+    refreshed = relinked;
+    contributing_configs.clear();
+    if (!relinked) {
+      Tracer::get().count("refresh_solves", 1);
+      cache = ReckyCache(names);
+      graph.clear();
+      resolve(allowed_paths);
+      arena.clear();
+      return true;
+    }
+    drop_unreachable();
+    auto deps_path = std::filesystem::absolute(get_deps_path());
+    for (auto& path : allowed_paths) {
+      contributing_configs.push_back(path / REKY_DEFAULT_FILE);
+    }
+    for (auto id : cache.packages) {
+      auto folder = deps_path / get_dep_folder(names->get_name(id));
+      if (!std::filesystem::exists(folder)) {
+        // Deleted from Deps since
+        recheck.push_back(id);
+      }
+      allowed_paths.push_back(folder);
+      contributing_configs.push_back(folder / REKY_DEFAULT_FILE);
+    }
+    if (!recheck.empty()) {
+      installed_if_needed(recheck);
+    }
+    cache.reset_changed();
+    return true;
+  }
+
+  // Point the package `folder` belongs to at what its sn.reky requires
+  // now. False if the current selection doesn't meet all of it. Packages
+  // that had subpaths declared are added to `recheck`.
+  bool relink(const std::filesystem::path& folder, std::vector<PackageId>& recheck) {
+    auto owner = names->intern(get_root_name(folder));
+    auto config = parse_config(folder, arena);
+    std::vector<PackageId> deps;
+    for (auto& entry : config) {
+      auto id = names->find(entry.name);
+      auto requirement = Requirement::parse(entry.version);
+      if (!id.has_value() || !cache.has_package(id.value()) || !requirement.has_value()) {
+        // Invalid requirements are reported by the solver
+        return false;
+      }
+      auto& catalog = get_catalog(id.value());
+      auto version = catalog.find(cache.get_version(id.value()));
+      if (!version.has_value() || !catalog.query(requirement.value(), catalog.size() + 1).test(version.value())) {
+        return false;
+      }
+      if (!entry.paths.empty()) {
+        declare_paths(entry.name, entry.paths);
+        recheck.push_back(id.value());
+      }
+      deps.push_back(id.value());
+    }
+    graph.set_edges(owner, deps);
+    return true;
+  }
+
+  // Nothing depends on these anymore. Their Deps folders stay, as they
+  // do after any other resolve.
+  void drop_unreachable() {
+    std::vector<char> reached(names->size(), false);
+    std::vector<PackageId> stack;
+    for (auto& root : roots) {
+      auto id = names->intern(get_root_name(root));
+      reached.resize(names->size(), false);
+      reached[id] = true;
+      stack.push_back(id);
+    }
+    while (!stack.empty()) {
+      auto id = stack.back();
+      stack.pop_back();
+      for (auto dep = graph.edges_begin(id); dep != graph.edges_end(id); ++dep) {
+        if (!reached[*dep]) {
+          reached[*dep] = true;
+          stack.push_back(*dep);
         }
       }
     }
-    if (cache.has_changed) {
-      installed_if_needed();
-      cache.reset_changed();
-      return fetch_dependencies(allowed_paths);
+    for (auto id : std::vector<PackageId>(cache.packages)) {
+      if (!reached[id]) {
+        cache.remove_package(id);
+        graph.remove_node(id);
+      }
     }
+    graph.compact();
+  }
+
+  ReckyCache& get_cache() {
     return cache;
   }
 
-  std::string get_name_from_hash(const std::string& hash) {
-    auto path = driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Deps);
-    path /= hash;
-    std::ifstream ifs(path.string() + ".name");
-    if (ifs.is_open()) {
-      std::string content((std::istreambuf_iterator<char>(ifs)),
-                          (std::istreambuf_iterator<char>()));
-      return content;
-    }
-    return hash;
+  const DepsManifest& get_manifest() const {
+    return manifest;
   }
 
-  void installed_if_needed() {
+  // Pick a version of every package reachable from the roots so that
+  // every requirement is met, then install whatever isn't yet.
+  void resolve(std::vector<std::filesystem::path>& allowed_paths) {
+    if (allowed_paths.empty()) {
+      // No crate to read requirements from, nothing to install
+      return;
+    }
+    TraceSpan span("resolve");
     get_package_index();
-    for (auto& [name, version] : cache.cache) {
-      if (!is_installed(name, version)) {
-        install(name, version);
+    // error() throws instead of exiting in the daemon and async
+    // fetches, the workers mustn't outlive this call then either
+    struct StopPrefetching final {
+      RekyManager& manager;
+      ~StopPrefetching() {
+        manager.stop_prefetching();
+      }
+    } stop_prefetching_guard{*this};
+    start_prefetching(allowed_paths);
+    auto root = names->intern(get_root_name(allowed_paths.front()));
+    std::vector<Dependency> root_dependencies;
+    for (auto& path : std::vector<std::filesystem::path>(allowed_paths)) {
+      contributing_configs.push_back(path / REKY_DEFAULT_FILE);
+      std::string missing;
+      auto dependencies = read_dependencies(path, missing);
+      if (!dependencies.has_value()) {
+        error(fmt::format("Package '{}' not found in the package index", missing));
+      }
+      std::vector<PackageId> deps;
+      for (auto& dependency : dependencies.value()) {
+        deps.push_back(dependency.id);
+        root_dependencies.push_back(std::move(dependency));
+      }
+      graph.set_edges(names->intern(get_root_name(path)), deps);
+    }
+    Solver::Provider provider;
+    provider.get_name = [this](PackageId id) -> const std::string& { return names->get_name(id); };
+    provider.get_version_count = [this](PackageId id) { return get_catalog(id).size(); };
+    provider.get_version_name = [this](PackageId id, size_t version) { return get_catalog(id).get_name(version); };
+    provider.get_dependencies = [this](PackageId id, size_t version, std::string& reason) {
+      return get_dependencies(id, get_catalog(id).get_name(version), reason);
+    };
+    provider.get_preferred = [this](PackageId id) { return get_preferred_version(id); };
+    Solver solver(provider, root, std::move(root_dependencies));
+    auto result = [&] {
+      TraceSpan solve_span("solve");
+      return solver.solve();
+    }();
+    stop_prefetching();
+    solver_decisions = result.decisions;
+    solver_conflicts = result.conflicts;
+    if (!result.ok) {
+      error(fmt::format("Could not find versions for every dependency:{}", result.explanation));
+    }
+    auto deps_path = std::filesystem::absolute(get_deps_path());
+    std::vector<PackageId> selected;
+    selected.reserve(result.packages.size());
+    cache.reserve(result.packages.size());
+    for (auto& [id, version] : result.packages) {
+      auto& name = names->get_name(id);
+      cache.add_package(id, get_catalog(id).get_name(version));
+      allowed_paths.push_back(deps_path / get_dep_folder(name));
+      contributing_configs.push_back(deps_path / get_dep_folder(name) / REKY_DEFAULT_FILE);
+      std::vector<PackageId> deps;
+      for (auto& dependency : result.dependencies[id]) {
+        deps.push_back(dependency.id);
       }
+      graph.set_edges(id, deps);
+      selected.push_back(id);
     }
+    installed_if_needed(selected);
+    cache.reset_changed();
   }
 
-  void get_package_index() {
-    if (ctx.index_fetched) {
-      return;
+  std::string get_root_name(const std::filesystem::path& path) {
+    auto name = path.filename().string();
+    if (name.empty()) {
+      // The main crate path is empty
+      name = path.parent_path().filename().string();
     }
-    auto index_path = driver::get_snowball_home() / "packages";
-    ctx.index_fetched = true;
-    if (!std::filesystem::exists(index_path)) {
-      utils::Logger::status("Fetching", "Reky package index");
-      run_git({"clone", REKY_PACKAGE_INDEX, index_path.string()});
-    } else {
-      update_package_index(index_path);
+    return get_name_from_hash(name);
+  }
+
+  const VersionCatalog& get_catalog(PackageId id) {
+    if (id >= catalogs.size()) {
+      catalogs.resize(id + 1);
     }
+    if (!catalogs[id].has_value()) {
+      auto package = get_package_data(names->get_name(id), "");
+      if (!package.has_value() && index_refresh.joinable()) {
+        // It might have been published after our (stale) copy of the index
+        wait_for_index_refresh();
+        package = get_package_data(names->get_name(id), "");
+      }
+      catalogs[id] = package.has_value() ? VersionCatalog(package->get_versions()) : VersionCatalog();
+    }
+    return catalogs[id].value();
   }
 
-  void update_package_index(const std::filesystem::path& index_path) {
-    utils::Logger::status("Updating", "Reky package index");
-    run_git({"-C", index_path.string(), "pull"});
+  // Try what the lockfile says first and then what is already
+  // installed, so nothing moves unless a requirement forces it.
+  std::optional<size_t> get_preferred_version(PackageId id) {
+    return get_preferred_version(names->get_name(id), get_catalog(id));
   }
 
-  int run_git(const std::vector<std::string>& args) {
-    std::string cmd = ctx.git_cmd;
-    for (auto& arg : args) {
-      cmd += " " + arg;
+  // Safe to call from prefetch workers: the lock isn't
+  // modified while resolving and the manifest is locked
+  std::optional<size_t> get_preferred_version(const std::string& name, const VersionCatalog& catalog) {
+    if (lock.has_value()) {
+      auto locked = lock->packages.find(name);
+      if (locked != lock->packages.end()) {
+        return catalog.find(locked->second.version);
+      }
     }
-    // Silently run the command
-    cmd += " -q";
-    return std::system(cmd.c_str());
+    auto installed = manifest.get(get_dep_folder(name));
+    if (installed.has_value()) {
+      return catalog.find(installed->version);
+    }
+    return std::nullopt;
   }
-  
-  static std::string get_dep_folder(const std::string& name) {
-    return utils::hash::hashString(name);
+
+  // Requirements of the sn.reky in `path`, nullopt (and the name in
+  // `missing`) if one of them is a package the index doesn't have
+  std::optional<std::vector<Dependency>> read_dependencies(const std::filesystem::path& path, std::string& missing) {
+    auto config = parse_config(path, arena);
+    auto file = (path / REKY_DEFAULT_FILE).string();
+    std::vector<Dependency> dependencies;
+    dependencies.reserve(config.size());
+    for (auto& entry : config) {
+      auto requirement = Requirement::parse(entry.version);
+      if (!requirement.has_value()) {
+        error(fmt::format("Invalid version requirement '{}'", entry.version), entry.line, file);
+        exit_with_errors();
+      }
+      auto id = names->intern(entry.name);
+      auto& catalog = get_catalog(id);
+      if (catalog.size() == 0) {
+        missing = std::string(entry.name);
+        return std::nullopt;
+      }
+      declare_paths(entry.name, entry.paths);
+      dependencies.push_back({id, catalog.query(requirement.value(), catalog.size() + 1), requirement->get_text()});
+    }
+    return dependencies;
+  }
+
+  void declare_paths(std::string_view name, std::string_view paths) {
+    if (paths.empty()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(paths_mutex);
+    auto& declared = declared_paths[std::string(name)];
+    for (auto& path : ConfigParser::split_paths(paths)) {
+      declared.push_back(std::move(path));
+    }
+  }
+
+  // Everything the index and the sn.reky files read so far declare for
+  // the package, empty if it's installed whole. Archives always are:
+  // a tarball can't be fetched in parts.
+  std::vector<std::string> get_paths(const std::string& name, const PackageIndex::Package& package) {
+    if (Archive::is_archive(std::string(package.get_download_url()))) {
+      return {};
+    }
+    std::vector<std::string> paths;
+    for (auto& path : package.get_paths()) {
+      auto normalized = ConfigParser::normalize_path(path);
+      if (!normalized.empty()) {
+        paths.emplace_back(normalized);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(paths_mutex);
+      auto declared = declared_paths.find(name);
+      if (declared != declared_paths.end()) {
+        paths.insert(paths.end(), declared->second.begin(), declared->second.end());
+      }
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    // "src/lib" is already part of "src"
+    std::vector<std::string> result;
+    for (auto& path : paths) {
+      bool covered = false;
+      for (auto& other : paths) {
+        covered |= path.size() > other.size() && path[other.size()] == '/' && path.compare(0, other.size(), other) == 0;
+      }
+      if (!covered) {
+        result.push_back(path);
+      }
+    }
+    return result;
   }
 
-  bool is_installed(const std::string& name, const std::string& version) {
-    auto deps_path = driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Deps);
-    return std::filesystem::exists(deps_path / get_dep_folder(name));
+  // Identifies a set of subpaths, so sparse installs are stored
+  // apart from full ones. Empty for the whole tree.
+  static std::string get_paths_key(const std::vector<std::string>& paths) {
+    if (paths.empty()) {
+      return "";
+    }
+    std::string joined;
+    for (auto& path : paths) {
+      joined += path + "\n";
+    }
+    return utils::hash::hashString(joined);
+  }
+
+  static std::string get_store_version(const std::string& version, const std::string& paths_key) {
+    return paths_key.empty() ? version : fmt::format("{}#{}", version, paths_key);
   }
 
-  std::optional<json> get_package_data(const std::string& name, const std::string& version) {
-    auto index_path = driver::get_snowball_home() / "packages" / "pkgs";
-    auto package_path = (index_path / name).string() + ".json";
-    if (!std::filesystem::exists(package_path)) {
+  // The sources have usually been prefetched by the time the solver
+  // asks, if not they are fetched right here, ahead of the queue.
+  std::optional<std::vector<Dependency>> get_dependencies(PackageId id, const std::string& version, std::string& reason) {
+    auto& name = names->get_name(id);
+    auto prefetch = get_prefetch(name, version);
+    run_prefetch(*prefetch, name, version);
+    auto sources = prefetch->sources;
+    if (!sources.has_value()) {
+      // Workers only see the index as it was when resolving started
+      sources = fetch_sources(name, version, index);
+    }
+    if (!sources.has_value()) {
+      reason = "it could not be downloaded";
       return std::nullopt;
     }
-    std::ifstream f(package_path);
-    return json::parse(f);
+    std::string missing;
+    auto dependencies = read_dependencies(sources.value(), missing);
+    if (!dependencies.has_value()) {
+      reason = fmt::format("it depends on '{}', which isn't in the package index", missing);
+    }
+    return dependencies;
   }
 
-  void install(const std::string& name, const std::string& version) {
-    auto package_data = get_package_data(name, version);
-    if (!package_data.has_value()) {
-      error(fmt::format("Package '{}' not found in the package index", name));
+  // Resolve-while-downloading: as soon as the sources of a package land,
+  // its sn.reky is read and the version the solver is most likely to
+  // pick for each dependency is queued, so downloads of the next depth
+  // start while the current one is still finishing. Guesses that turn
+  // out wrong only cost a download, which stays in the store.
+  void start_prefetching(const std::vector<std::filesystem::path>& roots) {
+    {
+      // Sources found by an earlier resolve may be Deps folders that
+      // were upgraded since, their sn.reky isn't that version's anymore
+      std::lock_guard<std::mutex> lock(prefetch_mutex);
+      prefetches.clear();
     }
-    std::string install_version;
-    for (auto& v : package_data.value()["versions"]) {
-      if (v == version) {
-        install_version = v;
-        break;
+    auto jobs = WorkerPool::resolve_jobs(ctx.jobs);
+    prefetch_deps_path = get_deps_path();
+    if (jobs == 1 || !prefetch_index.open(get_index_path() / ".git" / REKY_COMPILED_INDEX)) {
+      return;
+    }
+    prefetch_pool = std::make_unique<WorkerPool>(jobs);
+    for (auto& path : roots) {
+      prefetch_dependencies(path);
+    }
+  }
+
+  void stop_prefetching() {
+    if (prefetch_pool) {
+      // Guesses nobody asked for yet aren't worth waiting for
+      prefetch_pool->cancel();
+      try {
+        prefetch_pool->wait();
+      } catch (const std::exception&) {
+        // call_once didn't complete, whoever needs that package
+        // runs it again and reports the error from there
       }
+      prefetch_pool.reset();
     }
-    if (install_version.empty()) {
-      error(fmt::format("Version '{}' not found for package '{}'", version, name));
+    prefetch_index.close();
+  }
+
+  std::shared_ptr<Prefetch> get_prefetch(const std::string& name, const std::string& version) {
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+    auto& prefetch = prefetches[fmt::format("{}@{}", name, version)];
+    if (!prefetch) {
+      prefetch = std::make_shared<Prefetch>();
+      if (prefetch_pool) {
+        prefetch_pool->submit([this, prefetch, name, version] { run_prefetch(*prefetch, name, version); });
+      }
     }
-    auto deps_path = driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Deps);
-    auto package_path = deps_path / get_dep_folder(name);
-    std::ofstream f(package_path.string() + ".name");
-    f << name;
-    f.close();
-    utils::Logger::status("Download", fmt::format("{}@{}", name, install_version));
-    run_git({"clone", "-c", "advice.detachedHead=false", package_data.value()["download_url"], package_path.string(), "--branch", install_version, "--depth", "1"});
-    std::filesystem::remove_all(package_path / ".git");
-  }
-
-  ReckyCache fetch_cache(std::vector<std::filesystem::path>& allowed_paths) {
-    auto reky_path = driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Reky);
-    auto deps_path = driver::get_workspace_path(compiler_ctx, driver::WorkSpaceType::Deps);
-    auto config = parse_config(reky_path, true);
-    ReckyCache cache;
-    for (auto& [name, version] : config) {
-      auto dep_path = std::filesystem::absolute(deps_path / get_dep_folder(name));
-      allowed_paths.push_back(dep_path);
-      cache.add_package(name, version);
+    return prefetch;
+  }
+
+  void run_prefetch(Prefetch& prefetch, const std::string& name, const std::string& version) {
+    std::call_once(prefetch.once, [&] {
+      prefetch.sources = fetch_sources(name, version, prefetch_index.is_open() ? prefetch_index : index);
+      if (prefetch.sources.has_value() && prefetch_pool) {
+        prefetch_dependencies(prefetch.sources.value());
+      }
+    });
+  }
+
+  // The workspace copy if it's that version, else the store,
+  // downloading it there first if needed
+  std::optional<std::filesystem::path> fetch_sources(const std::string& name, const std::string& version,
+                                                     const PackageIndex& index_used) {
+    auto folder = get_dep_folder(name);
+    auto installed = manifest.get(folder);
+    auto sources = prefetch_deps_path / folder;
+    if (installed.has_value() && installed->version == version && std::filesystem::exists(sources)) {
+      return sources;
     }
-    cache.reset_changed();
-    return cache;
+    auto package = index_used.find(name);
+    if (!package.has_value()) {
+      return std::nullopt;
+    }
+    auto paths = get_paths(name, package.value());
+    auto entry = store.find(name, get_store_version(version, get_paths_key(paths)));
+    if (entry.has_value()) {
+      Tracer::get().count("store_hits", 1);
+      return entry;
+    }
+    auto url = get_download_url(package.value(), version);
+    return download_to_store(InstallJob{name, version, url, sources, std::move(paths)});
   }
 
-  void export_dot(std::ofstream& file) {
-    file << "digraph G {" << std::endl;
-    file << "  label = \"Reky Dependencies\";" << std::endl;
-    for (auto& [name, deps] : graph.graph) {
-      for (auto& dep : deps) {
-        file << fmt::format("  \"{}\" -> \"{}\" [arrowhead = diamond];", name, dep) << std::endl;
+  // Queue the likely pick for every requirement of the sn.reky in `path`.
+  // Invalid entries are skipped, the solver reports them when it gets there.
+  void prefetch_dependencies(const std::filesystem::path& path) {
+    auto content = AtomicFile::read(path / REKY_DEFAULT_FILE);
+    if (!content.has_value()) {
+      return;
+    }
+    RekyConfig config;
+    ConfigParser::parse(content.value(), config, [](const std::string&, unsigned int) {});
+    for (auto& entry : config) {
+      auto package = prefetch_index.find(entry.name);
+      auto requirement = Requirement::parse(entry.version);
+      if (!package.has_value() || !requirement.has_value()) {
+        continue;
+      }
+      declare_paths(entry.name, entry.paths);
+      std::string name(entry.name);
+      VersionCatalog catalog(package->get_versions());
+      auto candidates = catalog.query(requirement.value(), catalog.size());
+      auto preferred = get_preferred_version(name, catalog);
+      auto version = preferred.has_value() && candidates.test(preferred.value())
+        ? preferred.value()
+        : candidates.highest();
+      if (version != VersionSet::npos) {
+        get_prefetch(name, catalog.get_name(version));
       }
     }
-    file << "}" << std::endl;
-    file.close();
   }
-};
 
-RekyManager* fetch_dependencies(const Ctx& ctx, std::vector<std::filesystem::path>& allowed_paths) {
-  auto manager = new RekyManager(ctx);
-  auto cache = manager->fetch_dependencies(allowed_paths);
-  cache.save_cache(driver::get_workspace_path(ctx, driver::WorkSpaceType::Reky));
-  return manager;
-}
+  std::filesystem::path get_lock_path() {
+    return get_reky_path() / REKY_LOCK_FILE;
+  }
+
+  // Fast path: if no sn.reky that took part in the last resolution has
+  // changed, the result can be rebuilt from the lockfile without parsing
+  // any config or looking anything up in the index.
+  bool restore_from_lock(std::vector<std::filesystem::path>& allowed_paths) {
+    TraceSpan span("restore_from_lock");
+    if (!lock.has_value() || lock->roots != roots || !lock->is_fresh()) {
+      return false;
+    }
+    Tracer::get().count("lock_hits", 1);
+    for (auto& [name, package] : lock->packages) {
+      if (!is_installed(name, package.version)) {
+        return false;
+      }
+    }
+    auto deps_path = std::filesystem::absolute(get_deps_path());
+    for (auto& [name, package] : lock->packages) {
+      allowed_paths.push_back(deps_path / get_dep_folder(name));
+      cache.add_package(name, package.version);
+      notify_ready(name, package.version);
+    }
+    cache.reset_changed();
+    graph.assign(lock->graph);
+    restored_from_lock = true;
+    return true;
+  }
+
+  // Everything comes from the bundle: nothing is resolved, downloaded
+  // or written to Deps. The folders added to `allowed_paths` don't
+  // exist, their files are read with read_source.
+  bool restore_from_bundle(std::vector<std::filesystem::path>& allowed_paths) {
+    TraceSpan span("restore_from_bundle");
+    auto bundle_graph = bundle.get_graph();
+    for (auto& path : allowed_paths) {
+      if (!bundle_graph.count(get_root_name(path))) {
+        // Vendored for a different project
+        return false;
+      }
+    }
+    auto deps_path = std::filesystem::absolute(get_deps_path());
+    auto roots_count = allowed_paths.size();
+    for (size_t i = 0; i < bundle.get_package_count(); i++) {
+      auto& package = bundle.get_package(i);
+      std::string name(bundle.get_string(package.name));
+      std::string version(bundle.get_string(package.version));
+      auto folder = get_dep_folder(name);
+      allowed_paths.push_back(deps_path / folder);
+      cache.add_package(name, version);
+      bundle_folders[folder] = &package;
+    }
+    cache.reset_changed();
+    graph.assign(bundle_graph);
+    restored_from_bundle = true;
+    for (size_t i = roots_count; i < allowed_paths.size(); i++) {
+      auto& package = *bundle_folders[allowed_paths[i].filename().string()];
+      notify_ready(std::string(bundle.get_string(package.name)), std::string(bundle.get_string(package.version)));
+    }
+    return true;
+  }
+
+  // What the daemon answered for this workspace (see RekyService), the
+  // fetch itself and saving the cache and lock already happened there
+  void restore_from_daemon(const nlohmann::json& response, std::vector<std::filesystem::path>& allowed_paths) {
+    ctx.first_run = false;
+    for (auto& [name, version] : response["packages"].items()) {
+      cache.add_package(name, version.get<std::string>());
+    }
+    for (auto& path : response["dependencies"]) {
+      allowed_paths.push_back(path.get<std::string>());
+    }
+    cache.reset_changed();
+    graph.assign(response["graph"].get<std::map<std::string, std::vector<std::string>>>());
+    restored_from_daemon = true;
+    for (auto& [name, version] : response["packages"].items()) {
+      notify_ready(name, version.get<std::string>());
+    }
+  }
+
+  // Every sn.reky that took part in the last fetch, plus the manifest,
+  // with the fingerprints they had; see RekyService::is_fresh
+  std::map<std::string, std::string> get_fingerprints() const {
+    std::map<std::string, std::string> fingerprints;
+    if (lock.has_value()) {
+      fingerprints = lock->fingerprints;
+    }
+    auto manifest_path = (get_deps_path() / REKY_MANIFEST_FILE).string();
+    fingerprints[manifest_path] = Lockfile::get_fingerprint(manifest_path);
+    return fingerprints;
+  }
+
+  // A dependency source file from the vendor bundle, without extracting
+  // anything. nullopt if no bundle is used or it doesn't have the file,
+  // the caller should then read it from disk as usual.
+  std::optional<std::string_view> read_source(const std::filesystem::path& file) {
+    if (!restored_from_bundle) {
+      return std::nullopt;
+    }
+    auto deps_path = std::filesystem::absolute(get_deps_path());
+    auto relative = std::filesystem::absolute(file).lexically_relative(deps_path);
+    auto it = relative.begin();
+    if (relative.empty() || it == relative.end() || *it == "..") {
+      return std::nullopt;
+    }
+    auto package = bundle_folders.find(it->string());
+    if (package == bundle_folders.end()) {
+      return std::nullopt;
+    }
+    std::filesystem::path inside;
+    for (++it; it != relative.end(); ++it) {
+      inside /= *it;
+    }
+    return bundle.read(*package->second, inside.generic_string());
+  }
+
+  // Pack the resolved closure into a single file, see VendorBundle
+  bool vendor(const std::filesystem::path& output, bool compress) {
+    TraceSpan span("vendor");
+    auto deps_path = get_deps_path();
+    std::vector<VendorBundle::Source> sources;
+    for (auto& [name, version] : cache.cache) {
+      VendorBundle::Source source{name, version, "", "", deps_path / get_dep_folder(name)};
+      auto installed = manifest.get(get_dep_folder(name));
+      if (installed.has_value() && installed->version == version) {
+        source.commit = installed->commit;
+      }
+      if (lock.has_value()) {
+        auto locked = lock->packages.find(name);
+        if (locked != lock->packages.end() && locked->second.version == version) {
+          source.digest = locked->second.digest;
+        }
+      }
+      if (source.digest.empty()) {
+        source.digest = Lockfile::get_tree_digest(source.root);
+      }
+      sources.push_back(std::move(source));
+    }
+    if (!VendorBundle::write(output, std::move(sources), graph.graph, compress)) {
+      return false;
+    }
+    status("Vendored", fmt::format("{} packages into {}", cache.cache.size(), output.string()));
+    return true;
+  }
+
+  void save_lock() {
+    if (restored_from_lock || restored_from_bundle || restored_from_daemon) {
+      return;
+    }
+    TraceSpan span("save_lock");
+    Lockfile new_lock;
+    new_lock.roots = roots;
+    new_lock.graph = graph.graph;
+    for (auto& config : contributing_configs) {
+      new_lock.fingerprints[config.string()] = Lockfile::get_fingerprint(config);
+    }
+    auto deps_path = get_deps_path();
+    for (auto& [name, version] : cache.cache) {
+      LockedPackage package{version, "", ""};
+      auto installed = manifest.get(get_dep_folder(name));
+      if (installed.has_value() && installed->version == version) {
+        package.commit = installed->commit;
+      }
+      if (lock.has_value()) {
+        // Digests are only computed again when the install changed
+        auto locked = lock->packages.find(name);
+        if (locked != lock->packages.end() && locked->second.version == version
+            && locked->second.commit == package.commit) {
+          package.digest = locked->second.digest;
+        }
+      }
+      if (package.digest.empty()) {
+        package.digest = Lockfile::get_tree_digest(deps_path / get_dep_folder(name));
+      }
+      new_lock.packages[name] = package;
+    }
+    AtomicFile::write_if_changed(get_lock_path(), new_lock.dump());
+    lock = std::move(new_lock);
+  }
+
+  std::string get_name_from_hash(const std::string& hash) {
+    auto installed = manifest.get(hash);
+    if (installed.has_value()) {
+      return installed->name;
+    }
+    // Installed before the manifest existed
+    auto path = get_deps_path();
+    path /= hash;
+    std::ifstream ifs(path.string() + ".name");
+    if (ifs.is_open()) {
+      std::string content((std::istreambuf_iterator<char>(ifs)),
+                          (std::istreambuf_iterator<char>()));
+      return content;
+    }
+    return hash;
+  }
+
+  void set_jobs(unsigned int jobs) {
+    ctx.jobs = jobs;
+  }
+
+  void installed_if_needed() {
+    installed_if_needed(cache.packages);
+  }
+
+  void installed_if_needed(const std::vector<PackageId>& packages) {
+    TraceSpan span("installed_if_needed");
+    get_package_index();
+    // Everything that can fail is checked here, on the calling thread,
+    // so workers only have to run the downloads.
+    std::vector<InstallJob> pending;
+    for (auto id : packages) {
+      auto& name = names->get_name(id);
+      auto& version = cache.get_version(id);
+      auto job = prepare_install(name, version);
+      if (is_installed(name, version, get_paths_key(job.paths))) {
+        notify_ready(name, version);
+      } else {
+        pending.push_back(std::move(job));
+      }
+    }
+    if (pending.empty()) {
+      return;
+    }
+    auto jobs = std::min<size_t>(WorkerPool::resolve_jobs(ctx.jobs), pending.size());
+    // One flag per job, so workers never write to the same memory
+    std::vector<char> installed(pending.size(), false);
+    // e.g. Deps isn't writable. Reported here, workers can't report it.
+    std::string failure;
+    {
+      // Installs that finished are recorded whatever the others threw.
+      // Saved before reporting anything, error() may exit.
+      struct SaveManifest final {
+        DepsManifest& manifest;
+        ~SaveManifest() {
+          manifest.save();
+        }
+      } save_manifest{manifest};
+      try {
+        if (jobs == 1) {
+          for (size_t i = 0; i < pending.size(); i++) {
+            installed[i] = install(pending[i]);
+          }
+        } else {
+          WorkerPool pool(jobs);
+          for (size_t i = 0; i < pending.size(); i++) {
+            pool.submit([this, &pending, &installed, i] { installed[i] = install(pending[i]); });
+          }
+          pool.wait();
+        }
+      } catch (const std::filesystem::filesystem_error& e) {
+        failure = e.what();
+      }
+    }
+    if (!failure.empty()) {
+      error(fmt::format("Failed to install packages: {}", failure));
+    }
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (!installed[i]) {
+        error(fmt::format("Failed to download package '{}@{}'", pending[i].name, pending[i].version));
+      }
+    }
+  }
+
+  // Logger output is shared between install workers
+  void status(const std::string& action, const std::string& message) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    utils::Logger::status(action, message);
+  }
+
+  void set_index_ttl(std::chrono::seconds ttl) {
+    ctx.index_ttl = ttl;
+  }
+
+  void set_background_index_refresh(bool enabled) {
+    ctx.background_index_refresh = enabled;
+  }
+
+  static std::filesystem::path get_index_path() {
+    return get_reky_home() / "packages";
+  }
+
+  void get_package_index() {
+    if (ctx.index_fetched) {
+      return;
+    }
+    TraceSpan span("get_package_index");
+    // Managers in the same process (the daemon's) share the checkout,
+    // and so do other processes
+    static std::mutex index_mutex;
+    std::lock_guard<std::mutex> lock(index_mutex);
+    auto index_lock = wait_for_lock(get_index_lock_path(), "index");
+    auto index_path = get_index_path();
+    ctx.index_fetched = true;
+    if (!std::filesystem::exists(index_path)) {
+      status("Fetching", "Reky package index");
+      // Renamed into place once complete, an interrupted clone
+      // doesn't leave a broken index behind
+      auto staging = index_path.string() + fmt::format(".staging-{}", getpid());
+      std::error_code ec;
+      std::filesystem::remove_all(staging, ec);
+      if (run_git({"clone", get_package_index_url(), staging}) == 0) {
+        std::filesystem::rename(staging, index_path, ec);
+      }
+      std::filesystem::remove_all(staging, ec);
+      touch_index_stamp(index_path);
+    } else if (is_index_fresh(index_path)) {
+      // Nothing to pull
+      Tracer::get().count("index_hits", 1);
+    } else if (ctx.background_index_refresh) {
+      refresh_index_in_background(index_path);
+    } else {
+      update_package_index(index_path);
+    }
+    load_package_index();
+  }
+
+  // Map the compiled index, recompiling it first if it doesn't
+  // match the commit the index checkout is currently at.
+  void load_package_index() {
+    auto index_path = get_index_path();
+    auto compiled = index_path / ".git" / REKY_COMPILED_INDEX;
+    auto commit = PackageIndex::get_checkout_commit(index_path);
+    if (index.open(compiled) && index.get_source_commit() == commit) {
+      return;
+    }
+    index.close();
+    PackageIndex::compile(index_path / "pkgs", compiled, commit);
+    index.open(compiled);
+  }
+
+  void update_package_index(const std::filesystem::path& index_path) {
+    status("Updating", "Reky package index");
+    run_git({"-C", index_path.string(), "pull"});
+    touch_index_stamp(index_path);
+  }
+
+  // Stale-while-revalidate: the current index keeps being used
+  // while it gets pulled. Lookups that miss wait for the pull.
+  void refresh_index_in_background(const std::filesystem::path& index_path) {
+    // Stamp it first so other processes don't start a pull of their own
+    touch_index_stamp(index_path);
+    auto args = get_git_args({"-C", index_path.string(), "pull"});
+    index_refresh = std::thread([this, args] {
+      // Starts once get_package_index lets go of the index, nobody
+      // else clones, pulls or compiles it until the pull is done
+      FileLock lock;
+      lock.lock(get_index_lock_path());
+      processes.record({"git", "pull"}, Process::spawn(args).wait());
+    });
+  }
+
+  void wait_for_index_refresh() {
+    if (index_refresh.joinable()) {
+      index_refresh.join();
+      load_package_index();
+    }
+  }
+
+  static std::filesystem::path get_index_lock_path() {
+    return get_reky_home() / REKY_LOCKS_DIR / "packages.lock";
+  }
+
+  static std::filesystem::path get_index_stamp(const std::filesystem::path& index_path) {
+    // Kept inside .git so it never shows up as an untracked file
+    return index_path / ".git" / REKY_INDEX_STAMP;
+  }
+
+  bool is_index_fresh(const std::filesystem::path& index_path) {
+    std::error_code ec;
+    auto stamp = std::filesystem::last_write_time(get_index_stamp(index_path), ec);
+    if (ec) {
+      return false;
+    }
+    auto age = std::filesystem::file_time_type::clock::now() - stamp;
+    return age < ctx.index_ttl;
+  }
+
+  static void touch_index_stamp(const std::filesystem::path& index_path) {
+    auto stamp = get_index_stamp(index_path);
+    if (!std::filesystem::exists(stamp.parent_path())) {
+      return;
+    }
+    std::ofstream(stamp).close();
+    std::error_code ec;
+    std::filesystem::last_write_time(stamp, std::filesystem::file_time_type::clock::now(), ec);
+  }
+
+  std::vector<std::string> get_git_args(const std::vector<std::string>& args, bool quiet = true) {
+    // Runs that never need git (e.g. a fresh lockfile) don't look it up
+    std::call_once(ctx.git_lookup, [this] { ctx.git_cmd = driver::get_git(compiler_ctx); });
+    std::vector<std::string> argv = {ctx.git_cmd};
+    argv.insert(argv.end(), args.begin(), args.end());
+    if (quiet) {
+      // Silently run the command
+      argv.push_back("-q");
+    }
+    return argv;
+  }
+
+  ProcessResult run_process(const std::vector<std::string>& args, bool capture = false) {
+    std::string command;
+    if (Tracer::get().is_enabled()) {
+      for (auto& arg : args) {
+        command += (command.empty() ? "" : " ") + arg;
+      }
+    }
+    TraceSpan span("run_process", command);
+    auto process = Process::spawn(args, capture);
+    auto result = std::move(process.wait());
+    processes.record(args, result);
+    return result;
+  }
+
+  // Run git and return the first line it prints
+  std::optional<std::string> get_git_output(const std::vector<std::string>& args) {
+    auto result = run_process(get_git_args(args, false), true);
+    if (!result.ok()) {
+      return std::nullopt;
+    }
+    auto output = result.out.substr(0, result.out.find('\n'));
+    utils::strip(output);
+    return output;
+  }
+
+  int run_git(const std::vector<std::string>& args) {
+    return run_process(get_git_args(args)).exit_code;
+  }
+
+  // Run independent git commands at the same time
+  std::vector<ProcessResult> run_git_all(const std::vector<std::vector<std::string>>& commands) {
+    std::vector<std::vector<std::string>> argvs;
+    for (auto& args : commands) {
+      argvs.push_back(get_git_args(args));
+    }
+    auto results = Process::run_all(argvs, WorkerPool::resolve_jobs(ctx.jobs));
+    for (size_t i = 0; i < argvs.size(); i++) {
+      processes.record(argvs[i], results[i]);
+    }
+    return results;
+  }
+
+  // Wall time and exit code of every process started so far
+  std::vector<ProcessTiming> get_process_timings() {
+    return processes.get_timings();
+  }
+
+  static std::string get_dep_folder(const std::string& name) {
+    return utils::hash::hashString(name);
+  }
+
+  // Installed at exactly this version. Folders the manifest doesn't
+  // know about are installed again, which only rewrites what differs.
+  // With `paths_key`, the install also has to be of those subpaths
+  bool is_installed(const std::string& name, const std::string& version,
+                    const std::optional<std::string>& paths_key = std::nullopt) {
+    auto folder = get_dep_folder(name);
+    auto installed = manifest.get(folder);
+    if (!installed.has_value() || installed->version != version) {
+      return false;
+    }
+    if (paths_key.has_value() && installed->paths != paths_key.value()) {
+      return false;
+    }
+    auto deps_path = get_deps_path();
+    return std::filesystem::exists(deps_path / folder);
+  }
+
+  std::optional<PackageIndex::Package> get_package_data(const std::string& name, const std::string& version) {
+    if (!index.is_open()) {
+      load_package_index();
+    }
+    return index.find(name);
+  }
+
+  void install(const std::string& name, const std::string& version) {
+    install(prepare_install(name, version));
+    manifest.save();
+  }
+
+  InstallJob prepare_install(const std::string& name, const std::string& version) {
+    auto package_data = get_package_data(name, version);
+    if (!package_data.has_value() && index_refresh.joinable()) {
+      // It might have been published after our (stale) copy of the index
+      wait_for_index_refresh();
+      return prepare_install(name, version);
+    }
+    if (!package_data.has_value()) {
+      error(fmt::format("Package '{}' not found in the package index", name));
+    }
+    bool has_version = package_data->has_version(version);
+    if (!has_version && index_refresh.joinable()) {
+      wait_for_index_refresh();
+      return prepare_install(name, version);
+    }
+    if (!has_version) {
+      error(fmt::format("Version '{}' not found for package '{}'", version, name));
+    }
+    auto deps_path = get_deps_path();
+    auto package_path = deps_path / get_dep_folder(name);
+    return InstallJob{name, version, get_download_url(package_data.value(), version), package_path,
+                      get_paths(name, package_data.value())};
+  }
+
+  // Archive urls usually point to a specific release, the
+  // index can use "{version}" as a placeholder for it.
+  static std::string get_download_url(const PackageIndex::Package& package, const std::string& version) {
+    std::string url(package.get_download_url());
+    std::string placeholder = "{version}";
+    for (auto pos = url.find(placeholder); pos != std::string::npos; pos = url.find(placeholder, pos)) {
+      url.replace(pos, placeholder.size(), version);
+      pos += version.size();
+    }
+    return url;
+  }
+
+  // Packages are downloaded once into the global store and then
+  // linked into the workspace, other workspaces reuse the same copy.
+  bool install(const InstallJob& job) {
+    TraceSpan span("install", job.name);
+    auto paths_key = get_paths_key(job.paths);
+    auto folder = get_dep_folder(job.name);
+    // Another build of this workspace may be installing it right now:
+    // wait for it, and if it installed the same thing we're done
+    auto lock = wait_for_lock(get_deps_path() / REKY_LOCKS_DIR / (folder + ".lock"), job.name);
+    // Builds only save the manifest once all their installs are done,
+    // the last install of this folder is in its lock file right away
+    auto last = DepsManifest::parse_line(lock.read());
+    if (last.has_value() && last->first == folder) {
+      manifest.set(folder, std::move(last->second));
+    }
+    if (is_installed(job.name, job.version, paths_key)) {
+      Tracer::get().count("install_reused", 1);
+      notify_ready(job.name, job.version);
+      return true;
+    }
+    auto entry = store.find(job.name, get_store_version(job.version, paths_key));
+    if (entry.has_value()) {
+      Tracer::get().count("store_hits", 1);
+    } else {
+      entry = download_to_store(job);
+      if (!entry.has_value()) {
+        return false;
+      }
+    }
+    auto previous = manifest.get(folder);
+    installed_count++;
+    if (std::filesystem::exists(job.package_path) || !materialize(job, entry.value())) {
+      upgrade(job, previous, entry.value());
+    }
+    ManifestEntry installed{job.name, job.version, PackageStore::get_commit(entry.value()), paths_key};
+    // Read by whoever takes the lock next, see above
+    lock.write(DepsManifest::format_line(folder, installed));
+    manifest.set(folder, std::move(installed));
+    notify_ready(job.name, job.version);
+    return true;
+  }
+
+  // Linked next to its final place and renamed in, so a build reading
+  // Deps never sees a package half there. False if something else
+  // created the folder in the meantime.
+  bool materialize(const InstallJob& job, const std::filesystem::path& entry) {
+    auto staging = job.package_path.parent_path()
+      / fmt::format(".{}.staging-{}", job.package_path.filename().string(), getpid());
+    std::error_code ec;
+    std::filesystem::remove_all(staging, ec);
+    PackageStore::materialize(entry, staging);
+    std::filesystem::rename(staging, job.package_path, ec);
+    if (ec) {
+      std::filesystem::remove_all(staging, ec);
+      return false;
+    }
+    return true;
+  }
+
+  // Waiting on another process shows up in traces as a span of its own
+  static FileLock wait_for_lock(const std::filesystem::path& path, std::string_view detail) {
+    FileLock lock;
+    if (!lock.try_lock(path)) {
+      TraceSpan span("lock_wait", detail);
+      Tracer::get().count("lock_waits", 1);
+      lock.lock(path);
+    }
+    return lock;
+  }
+
+  // A different version is already in the workspace: diff it against
+  // the stored tree it came from and only touch the files that changed.
+  void upgrade(const InstallJob& job, const std::optional<ManifestEntry>& previous, const std::filesystem::path& entry) {
+    std::filesystem::path base;
+    std::string from = "unknown";
+    if (previous.has_value()) {
+      from = previous->version;
+      base = store.find(job.name, get_store_version(previous->version, previous->paths), previous->commit)
+        .value_or(std::filesystem::path());
+    }
+    upgraded_count++;
+    auto stats = PackageStore::update(base, entry, job.package_path);
+    upgrade_written += stats.written;
+    upgrade_removed += stats.removed;
+    upgrade_kept += stats.kept;
+    status("Upgrading", fmt::format("{} {} -> {} ({} written, {} removed, {} unchanged)",
+      job.name, from, job.version, stats.written, stats.removed, stats.kept));
+  }
+
+  // Downloads are shared by every manager in the process: a daemon
+  // asked for the same package by two workspaces fetches it once.
+  // Across processes the store lock does the same.
+  std::optional<std::filesystem::path> download_to_store(const InstallJob& job) {
+    static InFlight<std::optional<std::filesystem::path>> downloads;
+    auto version = get_store_version(job.version, get_paths_key(job.paths));
+    return downloads.run(store.get_entry(job.name, version, "").string(), [&] {
+      // It may have landed between the caller's lookup and now
+      auto entry = store.find(job.name, version);
+      if (entry.has_value()) {
+        return entry;
+      }
+      // Another process may be downloading it, wait and use its copy
+      auto lock = wait_for_lock(store.get_lock_path(job.name, version), job.name);
+      entry = store.find(job.name, version);
+      if (entry.has_value()) {
+        Tracer::get().count("store_hits", 1);
+        return entry;
+      }
+      return download_to_store_now(job);
+    });
+  }
+
+  std::optional<std::filesystem::path> download_to_store_now(const InstallJob& job) {
+    TraceSpan span("download", job.name);
+    status("Download", fmt::format("{}@{}", job.name, job.version));
+    auto staging = store.get_staging();
+    auto commit = Archive::is_archive(job.download_url)
+      ? download_archive(job, staging)
+      : download_git(job, staging);
+    if (!commit.has_value()) {
+      std::error_code ec;
+      std::filesystem::remove_all(staging, ec);
+      return std::nullopt;
+    }
+    downloaded_count++;
+    auto written = PackageStore::get_size(staging);
+    written_bytes += written;
+    Tracer::get().count("bytes_written", written);
+    return store.add(staging, job.name, get_store_version(job.version, get_paths_key(job.paths)), commit.value());
+  }
+
+  // Returns the commit the version resolved to. The tree is exported
+  // from the package's mirror, so there's never a .git to clean up.
+  std::optional<std::string> download_git(const InstallJob& job, const std::filesystem::path& staging) {
+    auto lock = mirrors.lock(job.download_url);
+    auto mirror = mirrors.get_path(job.download_url);
+    // Whatever the mirror grows by, blobs a partial mirror
+    // fetches lazily while exporting included
+    auto size = std::filesystem::exists(mirror) ? PackageStore::get_size(mirror) : 0;
+    auto commit = update_mirror(job);
+    bool exported = commit.has_value() && (job.paths.empty()
+      ? export_tree(job, commit.value(), "", staging)
+      : export_paths(job, commit.value(), staging));
+    auto grown = PackageStore::get_size(mirror);
+    auto downloaded = grown > size ? grown - size : 0;
+    downloaded_bytes += downloaded;
+    Tracer::get().count("bytes_downloaded", downloaded);
+    if (!exported) {
+      return std::nullopt;
+    }
+    return commit;
+  }
+
+  // Extract `path` of the commit (all of it if empty) into the staging
+  // folder. Archiving a subtree instead of using a pathspec matters:
+  // git would fetch every missing blob of the commit for the latter.
+  bool export_tree(const InstallJob& job, const std::string& commit, const std::string& path,
+                   const std::filesystem::path& staging) {
+    TraceSpan span("export", job.name);
+    auto git_dir = mirrors.get_path(job.download_url).string();
+    std::vector<std::string> args = {"--git-dir", git_dir, "archive", "--format=tar"};
+    if (path.empty()) {
+      args.push_back(commit);
+    } else {
+      args.push_back(fmt::format("--prefix={}/", path));
+      args.push_back(fmt::format("{}:{}", commit, path));
+    }
+    auto results = Archive::extract_from(get_git_args(args, false), staging);
+    bool failed = results.empty();
+    for (auto& result : results) {
+      processes.record({"export", job.download_url, commit, path}, result);
+      failed |= !result.ok();
+    }
+    return !failed;
+  }
+
+  // Only the declared subpaths, plus the sn.reky so the package's own
+  // dependencies can still be read. Paths the commit doesn't have are
+  // skipped, ls-tree only lists the ones that exist.
+  bool export_paths(const InstallJob& job, const std::string& commit, const std::filesystem::path& staging) {
+    auto git_dir = mirrors.get_path(job.download_url).string();
+    std::vector<std::string> args = {"--git-dir", git_dir, "ls-tree", "-z", commit, "--", REKY_DEFAULT_FILE};
+    args.insert(args.end(), job.paths.begin(), job.paths.end());
+    auto listing = run_process(get_git_args(args, false), true);
+    if (!listing.ok()) {
+      return false;
+    }
+    std::filesystem::create_directories(staging);
+    std::string_view rest = listing.out;
+    while (!rest.empty()) {
+      auto end = rest.find('\0');
+      auto line = rest.substr(0, end);
+      rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+      // <mode> <type> <object>\t<path>
+      auto tab = line.find('\t');
+      if (tab == std::string_view::npos) {
+        continue;
+      }
+      auto mode = line.substr(0, line.find(' '));
+      std::string path(line.substr(tab + 1));
+      if (mode == "040000") {
+        if (!export_tree(job, commit, path, staging)) {
+          return false;
+        }
+      } else if (mode == "100644" || mode == "100755" || mode == "120000") {
+        auto blob = run_process(get_git_args({"--git-dir", git_dir, "cat-file", "blob",
+          fmt::format("{}:{}", commit, path)}, false), true);
+        if (!blob.ok()) {
+          return false;
+        }
+        auto target = staging / path;
+        std::filesystem::create_directories(target.parent_path());
+        std::error_code ec;
+        if (mode == "120000") {
+          std::filesystem::create_symlink(blob.out, target, ec);
+        } else {
+          std::ofstream(target, std::ios::binary | std::ios::trunc) << blob.out;
+          if (mode == "100755") {
+            std::filesystem::permissions(target, std::filesystem::perms::owner_exec | std::filesystem::perms::group_exec
+              | std::filesystem::perms::others_exec, std::filesystem::perm_options::add, ec);
+          }
+        }
+      }
+      // Submodules (160000) aren't part of the commit's tree
+    }
+    return true;
+  }
+
+  // Make sure the mirror has the version and return its commit. Tags
+  // already in the mirror don't touch the network, anything else
+  // (a new tag, a branch) is an incremental fetch of what's missing.
+  std::optional<std::string> update_mirror(const InstallJob& job) {
+    auto mirror = mirrors.get_path(job.download_url);
+    auto git_dir = mirror.string();
+    if (!std::filesystem::exists(mirror)) {
+      TraceSpan span("mirror_clone", job.name);
+      auto staging = mirrors.get_staging();
+      std::vector<std::string> args = {"clone", "--bare", job.download_url, staging.string()};
+      if (!job.paths.empty()) {
+        // Blobs are fetched when a subpath is exported, only for that subpath
+        args.push_back("--filter=blob:none");
+      }
+      if (run_git(args)) {
+        std::error_code ec;
+        std::filesystem::remove_all(staging, ec);
+        return std::nullopt;
+      }
+      std::error_code ec;
+      std::filesystem::rename(staging, mirror, ec);
+      if (ec) {
+        // Another process cloned it first
+        std::filesystem::remove_all(staging, ec);
+      }
+    } else if (auto tag = get_git_output({"--git-dir", git_dir, "rev-parse", "--verify", "-q",
+        fmt::format("refs/tags/{}^{{commit}}", job.version)})) {
+      Tracer::get().count("mirror_hits", 1);
+      return tag;
+    } else {
+      TraceSpan span("mirror_fetch", job.name);
+      // From the remote rather than the url, so a partial mirror keeps its filter
+      if (run_git({"--git-dir", git_dir, "fetch", "--prune", "origin",
+          "+refs/heads/*:refs/heads/*", "+refs/tags/*:refs/tags/*"})) {
+        return std::nullopt;
+      }
+    }
+    return get_git_output({"--git-dir", git_dir, "rev-parse", "--verify", "-q",
+      fmt::format("{}^{{commit}}", job.version)});
+  }
+
+  // Archives are streamed straight into the staging folder, there is
+  // no commit to key them by so the url is used instead.
+  std::optional<std::string> download_archive(const InstallJob& job, const std::filesystem::path& staging) {
+    auto results = Archive::extract(job.download_url, job.version, staging);
+    bool failed = results.empty();
+    for (auto& result : results) {
+      processes.record({"extract", job.download_url}, result);
+      failed |= !result.ok();
+    }
+    if (failed) {
+      return std::nullopt;
+    }
+    // Streamed, so only the extracted size is known
+    auto downloaded = PackageStore::get_size(staging);
+    downloaded_bytes += downloaded;
+    Tracer::get().count("bytes_downloaded", downloaded);
+    return fmt::format("archive-{}", utils::hash::hashString(job.download_url));
+  }
+
+  // What the last fetch_dependencies cost, see RunStats
+  RunStats get_stats() {
+    RunStats stats;
+    stats.start = started;
+    stats.end = ResourceUsage::now();
+    stats.mode = restored_from_daemon ? "daemon"
+      : restored_from_bundle ? "bundle"
+      : restored_from_lock ? "lock"
+      : refreshed ? "refresh" : "solve";
+    stats.packages = cache.packages.size();
+    stats.installed = installed_count;
+    stats.upgraded = upgraded_count;
+    stats.downloaded = downloaded_count;
+    stats.bytes_downloaded = downloaded_bytes;
+    stats.bytes_written = written_bytes;
+    stats.files_written = upgrade_written;
+    stats.files_removed = upgrade_removed;
+    stats.files_kept = upgrade_kept;
+    for (auto& timing : processes.get_timings()) {
+      stats.processes++;
+      stats.process_time += std::chrono::duration<double>(timing.elapsed).count();
+    }
+    stats.decisions = solver_decisions;
+    stats.conflicts = solver_conflicts;
+    return stats;
+  }
+
+  const DepsGraph& get_graph() const {
+    return graph;
+  }
+
+  // Which dependencies can be compiled at the same time, see DepsGraph::levelize
+  GraphSchedule get_build_schedule(const std::vector<uint64_t>* weights = nullptr) const {
+    return graph.levelize(weights);
+  }
+
+  // Same as above, with names instead of ids
+  std::vector<std::vector<std::string>> get_build_levels() const {
+    auto schedule = get_build_schedule();
+    std::vector<std::vector<std::string>> levels;
+    levels.reserve(schedule.levels.size());
+    for (auto& level : schedule.levels) {
+      auto& names_level = levels.emplace_back();
+      for (auto id : level) {
+        names_level.push_back(names->get_name(id));
+      }
+    }
+    return levels;
+  }
+
+  void export_dot(std::ofstream& file) {
+    file << "digraph G {" << std::endl;
+    file << "  label = \"Reky Dependencies\";" << std::endl;
+    for (auto& [name, deps] : graph.graph) {
+      for (auto& dep : deps) {
+        file << fmt::format("  \"{}\" -> \"{}\" [arrowhead = diamond];", name, dep) << std::endl;
+      }
+    }
+    file << "}" << std::endl;
+    file.close();
+  }
+};
+
+struct FetchResult final {
+  std::unique_ptr<RekyManager> manager;
+  // The roots followed by the folder of every dependency
+  std::vector<std::filesystem::path> allowed_paths;
+};
+
+// A fetch running on its own thread. Packages are handed out as they
+// land, so the compiler can parse the main crate and every dependency
+// that is ready while the rest are still being downloaded.
+class FetchHandle final {
+  std::shared_ptr<Channel<PackageReady>> ready;
+  std::future<FetchResult> result;
+public:
+  FetchHandle(std::shared_ptr<Channel<PackageReady>> ready, std::future<FetchResult> result)
+    : ready(std::move(ready)), result(std::move(result)) {}
+
+  // Blocks until the next package is ready, nullopt once all of them were
+  std::optional<PackageReady> next() {
+    return ready->pop();
+  }
+
+  std::optional<PackageReady> try_next() {
+    return ready->try_pop();
+  }
+
+  bool is_done() const {
+    return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
+
+  // Waits for the whole fetch (and the cache and lock to be saved)
+  FetchResult get() {
+    return result.get();
+  }
+};
+
+// Everything a fetch leaves behind besides Deps itself
+void save_fetch(RekyManager* manager, ReckyCache& cache) {
+  cache.save_cache(manager->get_reky_path());
+  manager->save_lock();
+  if (auto stats_path = getenv(REKY_STATS_ENV)) {
+    manager->get_stats().append_to(stats_path);
+  }
+  manager->write_trace();
+}
+
+std::filesystem::path get_daemon_socket() {
+  return get_reky_home() / REKY_DAEMON_SOCKET;
+}
+
+// Runs in the daemon: keeps the result of the last fetch of every
+// workspace in memory and answers with it as long as none of the
+// sn.reky files it came from (nor Deps) changed. Requests for a
+// workspace that is being fetched wait for that fetch to finish and
+// then get its result, instead of starting the same fetch again.
+// Each workspace keeps its manager, so a change only refreshes what
+// it touched (see RekyManager::refresh_dependencies), with the index
+// and catalogs already loaded.
+class RekyService final {
+  struct Workspace final {
+    std::mutex mutex;
+    std::optional<nlohmann::json> result;
+    std::map<std::string, std::string> fingerprints;
+    // Null before the first fetch and after one that failed
+    std::unique_ptr<RekyManager> manager;
+    // Replaced once its index is as old as REKY_INDEX_TTL, it's
+    // never pulled again otherwise
+    std::chrono::steady_clock::time_point created;
+  };
+
+  const Ctx& ctx;
+  std::mutex mutex;
+  std::unordered_map<std::string, std::unique_ptr<Workspace>> workspaces;
+  std::atomic<size_t> requests = 0;
+  std::atomic<size_t> memory_hits = 0;
+  std::atomic<size_t> refreshes = 0;
+public:
+  explicit RekyService(const Ctx& ctx) : ctx(ctx) {}
+
+  nlohmann::json handle(const nlohmann::json& request) {
+    requests++;
+    if (request.value("op", "") == "status") {
+      return {{"ok", true}, {"requests", requests.load()}, {"memory_hits", memory_hits.load()},
+              {"refreshes", refreshes.load()}, {"workspaces", get_workspace_count()}};
+    }
+    if (request.value("op", "") != "fetch" || !request.contains("roots") || !request.contains("deps")) {
+      return {{"ok", false}, {"error", "Unknown request"}};
+    }
+    std::filesystem::path deps_path = request.value("deps", "");
+    std::filesystem::path reky_path = request.value("reky", "");
+    std::vector<std::filesystem::path> roots;
+    std::string key = deps_path.string();
+    for (auto& root : request["roots"]) {
+      roots.emplace_back(root.get<std::string>());
+      key += "\n" + root.get<std::string>();
+    }
+    auto& workspace = get_workspace(key);
+    std::lock_guard<std::mutex> lock(workspace.mutex);
+    if (workspace.result.has_value() && is_fresh(workspace)) {
+      memory_hits++;
+      return workspace.result.value();
+    }
+    error_capture = ErrorCapture{true, ""};
+    try {
+      auto allowed_paths = roots;
+      if (workspace.manager && std::chrono::steady_clock::now() - workspace.created < std::chrono::seconds(REKY_INDEX_TTL)
+          && workspace.manager->refresh_dependencies(allowed_paths, get_changed(workspace))) {
+        refreshes++;
+      } else {
+        allowed_paths = roots;
+        workspace.manager = std::make_unique<RekyManager>(ctx);
+        workspace.created = std::chrono::steady_clock::now();
+        workspace.manager->set_workspace(deps_path, reky_path);
+        workspace.manager->fetch_dependencies(allowed_paths);
+      }
+      auto& manager = *workspace.manager;
+      auto& cache = manager.get_cache();
+      save_fetch(&manager, cache);
+      error_capture = ErrorCapture{};
+      nlohmann::json packages = nlohmann::json::object();
+      for (auto& [name, version] : cache.cache) {
+        packages[name] = version;
+      }
+      std::vector<std::string> dependencies;
+      for (size_t i = roots.size(); i < allowed_paths.size(); i++) {
+        dependencies.push_back(allowed_paths[i].string());
+      }
+      workspace.result = nlohmann::json{
+        {"ok", true},
+        {"packages", std::move(packages)},
+        {"dependencies", std::move(dependencies)},
+        {"graph", std::map<std::string, std::vector<std::string>>(manager.get_graph().graph)}
+      };
+      workspace.fingerprints = manager.get_fingerprints();
+      return workspace.result.value();
+    } catch (const std::exception& e) {
+      error_capture = ErrorCapture{};
+      workspace.result.reset();
+      // Half way through a fetch, the next request starts over
+      workspace.manager.reset();
+      return {{"ok", false}, {"error", e.what()}};
+    }
+  }
+private:
+  Workspace& get_workspace(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& workspace = workspaces[key];
+    if (!workspace) {
+      workspace = std::make_unique<Workspace>();
+    }
+    return *workspace;
+  }
+
+  size_t get_workspace_count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return workspaces.size();
+  }
+
+  // Folders whose sn.reky changed since the last fetch, as the
+  // manager knows them. The manifest isn't one, a change there
+  // (e.g. a deleted Deps folder) only needs the installs checked.
+  static std::vector<std::filesystem::path> get_changed(const Workspace& workspace) {
+    std::vector<std::filesystem::path> changed;
+    for (auto& [path, fingerprint] : workspace.fingerprints) {
+      std::filesystem::path file(path);
+      if (file.filename() == REKY_DEFAULT_FILE && Lockfile::get_fingerprint(path) != fingerprint) {
+        changed.push_back(file.parent_path());
+      }
+    }
+    return changed;
+  }
+
+  static bool is_fresh(const Workspace& workspace) {
+    for (auto& [path, fingerprint] : workspace.fingerprints) {
+      if (Lockfile::get_fingerprint(path) != fingerprint) {
+        return false;
+      }
+    }
+    for (auto& path : workspace.result.value()["dependencies"]) {
+      if (!std::filesystem::exists(path.get<std::string>())) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// `reky daemon`: answer fetch_dependencies for every compiler process on
+// the machine until the process is stopped
+void run_daemon(const Ctx& ctx) {
+  RekyService service(ctx);
+  DaemonServer server;
+  auto socket = get_daemon_socket();
+  if (!server.listen(socket)) {
+    error(fmt::format("Could not listen on '{}', is a daemon already running?", socket.string()));
+  }
+  utils::Logger::status("Listening", socket.string());
+  server.serve([&](const nlohmann::json& request) { return service.handle(request); });
+}
+
+// Let the daemon do the fetch if one is running. nullopt means the
+// caller has to do it in-process, which is also how errors (e.g. an
+// invalid sn.reky) are reported: the same way as without a daemon.
+std::optional<nlohmann::json> fetch_from_daemon(RekyManager* manager, const std::vector<std::filesystem::path>& allowed_paths) {
+  auto enabled = getenv(REKY_DAEMON_ENV);
+  if ((enabled && std::string(enabled) == "0") || manager->uses_vendor_bundle()) {
+    return std::nullopt;
+  }
+  auto socket = get_daemon_socket();
+  if (!std::filesystem::exists(socket)) {
+    return std::nullopt;
+  }
+  std::vector<std::string> roots;
+  for (auto& path : allowed_paths) {
+    roots.push_back(std::filesystem::absolute(path).string());
+  }
+  auto response = DaemonClient::request(socket, {
+    {"op", "fetch"},
+    {"deps", std::filesystem::absolute(manager->get_deps_path()).string()},
+    {"reky", std::filesystem::absolute(manager->get_reky_path()).string()},
+    {"roots", roots}
+  });
+  if (!response.has_value() || !response->value("ok", false)) {
+    return std::nullopt;
+  }
+  return response;
+}
+
+// Processes that fetch more than once (a language server,
+// `snowball watch`) should keep a RekySession instead.
+std::unique_ptr<RekyManager> fetch_dependencies_owned(const Ctx& ctx, std::vector<std::filesystem::path>& allowed_paths,
+                                                      std::function<void(const PackageReady&)> on_ready = nullptr) {
+  auto manager = std::make_unique<RekyManager>(ctx);
+  manager->set_ready_handler(std::move(on_ready));
+  if (auto response = fetch_from_daemon(manager.get(), allowed_paths)) {
+    manager->restore_from_daemon(response.value(), allowed_paths);
+    manager->set_ready_handler(nullptr);
+    return manager;
+  }
+  auto& cache = manager->fetch_dependencies(allowed_paths);
+  manager->set_ready_handler(nullptr);
+  save_fetch(manager.get(), cache);
+  return manager;
+}
+
+// Same as fetch_dependencies_owned, the caller has to delete the manager
+RekyManager* fetch_dependencies(const Ctx& ctx, std::vector<std::filesystem::path>& allowed_paths,
+                                std::function<void(const PackageReady&)> on_ready = nullptr) {
+  return fetch_dependencies_owned(ctx, allowed_paths, std::move(on_ready)).release();
+}
+
+// `reky vendor`: fetch everything and pack it into `output`, which
+// REKY_VENDOR (or set_vendor_bundle) can then serve dependencies from
+std::unique_ptr<RekyManager> vendor_dependencies_owned(const Ctx& ctx, std::vector<std::filesystem::path>& allowed_paths,
+                                                       const std::filesystem::path& output, bool compress = true) {
+  auto manager = fetch_dependencies_owned(ctx, allowed_paths);
+  if (!manager->vendor(output, compress)) {
+    error(fmt::format("Could not write the vendor bundle '{}'", output.string()));
+  }
+  return manager;
+}
+
+// Same as vendor_dependencies_owned, the caller has to delete the manager
+RekyManager* vendor_dependencies(const Ctx& ctx, std::vector<std::filesystem::path>& allowed_paths,
+                                 const std::filesystem::path& output, bool compress = true) {
+  return vendor_dependencies_owned(ctx, allowed_paths, output, compress).release();
+}
+
+// `ctx` has to outlive the fetch. Errors are thrown from get() as a
+// RekyError instead of exiting.
+FetchHandle fetch_dependencies_async(const Ctx& ctx, std::vector<std::filesystem::path> allowed_paths) {
+  auto ready = std::make_shared<Channel<PackageReady>>();
+  auto result = std::async(std::launch::async, [&ctx, ready, allowed_paths = std::move(allowed_paths)]() mutable {
+    // error() would exit the whole process from here, it has to
+    // reach get() as a RekyError instead
+    error_capture = ErrorCapture{true, ""};
+    try {
+      auto manager = fetch_dependencies_owned(ctx, allowed_paths, [ready](const PackageReady& package) {
+        ready->push(package);
+      });
+      ready->close();
+      error_capture = ErrorCapture{};
+      return FetchResult{std::move(manager), std::move(allowed_paths)};
+    } catch (...) {
+      // Nobody waiting on next() should be left hanging
+      ready->close();
+      error_capture = ErrorCapture{};
+      throw;
+    }
+  });
+  return FetchHandle(std::move(ready), std::move(result));
+}
+
+// How allowed_paths moved in a RekySession::update
+struct PathsDelta final {
+  std::vector<std::filesystem::path> added;
+  std::vector<std::filesystem::path> removed;
+  // Still allowed, but a different version (or commit) is in there now
+  std::vector<std::filesystem::path> changed;
+  // Set if the update failed, allowed_paths stays as it was
+  std::string error;
+
+  bool empty() const {
+    return added.empty() && removed.empty() && changed.empty() && error.empty();
+  }
+};
+
+// A fetch kept around between the rebuilds of a language server or
+// `snowball watch`. The manager, and everything it has loaded (the index,
+// version catalogs, the graph), stays alive, and every sn.reky that took
+// part in the resolution is watched along with Deps. update() does no
+// work until one of them changes, and then only re-resolves what the
+// change affects (see RekyManager::refresh_dependencies). Errors are
+// handed back instead of exiting: the last good result is kept and the
+// next change starts over from a full fetch.
+class RekySession final {
+  struct Config final {
+    std::string fingerprint;
+    // Root or Deps folder the sn.reky is in, as the manager knows it
+    std::filesystem::path folder;
+  };
+
+  const Ctx& ctx;
+  std::vector<std::filesystem::path> roots;
+  std::unique_ptr<RekyManager> manager;
+  std::vector<std::filesystem::path> allowed_paths;
+  FileWatcher watcher;
+  // Keyed by absolute path. Events for saves that didn't change the
+  // content, our own installs included, are ignored.
+  std::map<std::string, Config> configs;
+  // Deps folder -> "<version>@<commit>" installed in it
+  std::map<std::filesystem::path, std::string> installed;
+  std::filesystem::path deps_path;
+  bool started = false;
+public:
+  // `ctx` has to outlive the session. Without inotify, every update()
+  // compares every sn.reky instead of waiting for events.
+  RekySession(const Ctx& ctx, std::vector<std::filesystem::path> roots)
+    : ctx(ctx), roots(std::move(roots)) {
+    watcher.open();
+  }
+
+  // The first call fetches everything, every path comes back as added.
+  // After that it waits up to `timeout` milliseconds for a change.
+  PathsDelta update(int timeout = 0) {
+    std::vector<std::filesystem::path> changed;
+    if (started && !collect_changes(timeout, changed)) {
+      return {};
+    }
+    TraceSpan span("session_update");
+    PathsDelta delta;
+    auto previous = allowed_paths;
+    auto previous_installed = installed;
+    error_capture = ErrorCapture{true, ""};
+    try {
+      auto paths = roots;
+      if (!manager || !manager->refresh_dependencies(paths, changed)) {
+        paths = roots;
+        manager = std::make_unique<RekyManager>(ctx);
+        manager->fetch_dependencies(paths);
+      }
+      save_fetch(manager.get(), manager->get_cache());
+      allowed_paths = std::move(paths);
+      track();
+    } catch (const std::exception& e) {
+      manager.reset();
+      delta.error = e.what();
+      // The roots have to stay watched for a fix to be noticed
+      for (auto& root : roots) {
+        track(root);
+      }
+    }
+    error_capture = ErrorCapture{};
+    started = true;
+    get_delta(previous, previous_installed, delta);
+    return delta;
+  }
+
+  const std::vector<std::filesystem::path>& get_allowed_paths() const {
+    return allowed_paths;
+  }
+
+  // Null until the first update(), and after one that failed
+  RekyManager* get_manager() const {
+    return manager.get();
+  }
+
+  // To wait for changes in the caller's own poll() loop, -1 without inotify
+  int get_fd() const {
+    return watcher.get_fd();
+  }
+private:
+  // Folders whose sn.reky content changed. False if none did and
+  // nothing was removed from Deps either.
+  bool collect_changes(int timeout, std::vector<std::filesystem::path>& changed) {
+    std::vector<std::filesystem::path> files;
+    bool deps_touched = false;
+    if (watcher.is_open()) {
+      for (auto& path : watcher.read(timeout)) {
+        if (path.filename() == REKY_DEFAULT_FILE) {
+          files.push_back(path);
+        } else if (path.parent_path() == deps_path && path.filename().string()[0] != '.') {
+          // A package folder came or went (the manifest, locks and
+          // staging folders start with a dot)
+          deps_touched = true;
+        }
+      }
+    } else {
+      for (auto& [file, config] : configs) {
+        files.push_back(file);
+      }
+      deps_touched = true;
+    }
+    for (auto& file : files) {
+      auto config = configs.find(file.string());
+      if (config == configs.end()) {
+        continue;
+      }
+      if (file.parent_path().parent_path() == deps_path && !std::filesystem::exists(file)) {
+        // The package went away with its folder, it gets installed again
+        deps_touched = true;
+        continue;
+      }
+      auto fingerprint = Lockfile::get_fingerprint(file);
+      if (fingerprint == config->second.fingerprint) {
+        continue;
+      }
+      // Not looked at again until it changes once more, even if it
+      // turns out to be broken
+      config->second.fingerprint = fingerprint;
+      if (std::find(changed.begin(), changed.end(), config->second.folder) == changed.end()) {
+        changed.push_back(config->second.folder);
+      }
+    }
+    if (!changed.empty() || !deps_touched) {
+      return !changed.empty();
+    }
+    for (size_t i = roots.size(); i < allowed_paths.size(); i++) {
+      if (!std::filesystem::exists(allowed_paths[i])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void track() {
+    deps_path = std::filesystem::absolute(manager->get_deps_path()).lexically_normal();
+    watcher.watch(deps_path);
+    auto previous = std::move(configs);
+    configs.clear();
+    installed.clear();
+    for (auto& folder : allowed_paths) {
+      track(folder);
+      if (std::filesystem::absolute(folder).lexically_normal().parent_path() != deps_path) {
+        continue;
+      }
+      auto entry = manager->get_manifest().get(folder.filename().string());
+      if (entry.has_value()) {
+        installed[folder] = entry->version + "@" + entry->commit;
+      }
+    }
+    // Packages that dropped out of the graph
+    for (auto& [file, config] : previous) {
+      if (!configs.count(file)) {
+        watcher.unwatch(std::filesystem::path(file).parent_path());
+      }
+    }
+  }
+
+  void track(const std::filesystem::path& folder) {
+    auto absolute = std::filesystem::absolute(folder).lexically_normal();
+    if (!absolute.has_filename()) {
+      absolute = absolute.parent_path();
+    }
+    watcher.watch(absolute);
+    auto file = absolute / REKY_DEFAULT_FILE;
+    configs[file.string()] = Config{Lockfile::get_fingerprint(file), folder};
+  }
+
+  void get_delta(const std::vector<std::filesystem::path>& previous,
+                 const std::map<std::filesystem::path, std::string>& previous_installed, PathsDelta& delta) const {
+    std::set<std::filesystem::path> before(previous.begin(), previous.end());
+    std::set<std::filesystem::path> after(allowed_paths.begin(), allowed_paths.end());
+    for (auto& path : allowed_paths) {
+      if (!before.count(path)) {
+        delta.added.push_back(path);
+        continue;
+      }
+      // Deps folders are named after the package, not the version
+      auto was = previous_installed.find(path);
+      auto is = installed.find(path);
+      if (was != previous_installed.end() && is != installed.end() && was->second != is->second) {
+        delta.changed.push_back(path);
+      }
+    }
+    for (auto& path : previous) {
+      if (!after.count(path)) {
+        delta.removed.push_back(path);
+      }
+    }
+  }
+};
 
 }
 }
@@ -0,0 +1,127 @@
+
+#ifndef __REKY_ARCHIVE_H__
+#define __REKY_ARCHIVE_H__
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+
+#include "reky/process.hpp"
+
+#ifndef REKY_TAR_CMD
+#define REKY_TAR_CMD "tar"
+#endif
+
+#ifndef REKY_CURL_CMD
+#define REKY_CURL_CMD "curl"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// Packages published as tarballs instead of git repositories. Archives
+// are streamed straight into the destination: remote ones are piped
+// from curl into tar, local (file://) ones are read by tar directly.
+struct Archive final {
+  static bool ends_with(const std::string& str, const std::string& suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  // The tar flag needed to decompress the archive, or nothing
+  // if the url doesn't point to an archive (e.g. a git repo).
+  static std::optional<std::string> get_tar_flag(const std::string& url) {
+    if (ends_with(url, ".tar.gz") || ends_with(url, ".tgz")) {
+      return "-z";
+    } else if (ends_with(url, ".tar.zst") || ends_with(url, ".tzst")) {
+      return "--zstd";
+    } else if (ends_with(url, ".tar.xz") || ends_with(url, ".txz")) {
+      return "-J";
+    } else if (ends_with(url, ".tar.bz2") || ends_with(url, ".tbz2")) {
+      return "-j";
+    } else if (ends_with(url, ".tar")) {
+      return "";
+    }
+    return std::nullopt;
+  }
+
+  static bool is_archive(const std::string& url) {
+    return get_tar_flag(url).has_value();
+  }
+
+  // Returns every process that was started, the extraction
+  // succeeded if all of them exited successfully.
+  static std::vector<ProcessResult> extract(const std::string& url, const std::string& version, const std::filesystem::path& destination) {
+    std::filesystem::create_directories(destination);
+    std::vector<std::string> tar = {REKY_TAR_CMD, "-x", "-C", destination.string()};
+    auto flag = get_tar_flag(url).value_or("");
+    if (!flag.empty()) {
+      tar.push_back(flag);
+    }
+    std::vector<ProcessResult> results;
+    std::string local_prefix = "file://";
+    if (url.compare(0, local_prefix.size(), local_prefix) == 0) {
+      tar.push_back("-f");
+      tar.push_back(url.substr(local_prefix.size()));
+      results.push_back(std::move(Process::spawn(tar, true).wait()));
+    } else {
+      std::vector<std::string> curl = {REKY_CURL_CMD, "-fsSL", url};
+      auto pipeline = Process::spawn_pipeline({curl, tar});
+      for (auto& process : pipeline) {
+        results.push_back(std::move(process.wait()));
+      }
+    }
+    hoist_release_directory(destination, version);
+    return results;
+  }
+
+  // Unpack the tar stream `producer` writes to its stdout, e.g. a
+  // `git archive` of a commit, into the destination.
+  static std::vector<ProcessResult> extract_from(const std::vector<std::string>& producer, const std::filesystem::path& destination) {
+    std::filesystem::create_directories(destination);
+    std::vector<std::string> tar = {REKY_TAR_CMD, "-x", "-C", destination.string()};
+    std::vector<ProcessResult> results;
+    for (auto& process : Process::spawn_pipeline({producer, tar})) {
+      results.push_back(std::move(process.wait()));
+    }
+    return results;
+  }
+
+  // Release tarballs usually wrap everything in a "<name>-<version>/"
+  // folder. Move its contents one level up so the package root matches
+  // a git checkout.
+  static void hoist_release_directory(const std::filesystem::path& destination, std::string version) {
+    std::error_code ec;
+    std::filesystem::path only;
+    size_t count = 0;
+    for (auto& entry : std::filesystem::directory_iterator(destination, ec)) {
+      only = entry.path();
+      count++;
+    }
+    if (count != 1 || !std::filesystem::is_directory(only, ec) || std::filesystem::is_symlink(only, ec)) {
+      return;
+    }
+    // GitHub drops the leading "v" of tags in archive folder names
+    if (!version.empty() && version[0] == 'v') {
+      version = version.substr(1);
+    }
+    auto name = only.filename().string();
+    if (!ends_with(name, "-" + version)) {
+      return;
+    }
+    auto wrapper = destination / ".reky_unwrap";
+    std::filesystem::rename(only, wrapper, ec);
+    if (ec) {
+      return;
+    }
+    for (auto& entry : std::filesystem::directory_iterator(wrapper, ec)) {
+      std::filesystem::rename(entry.path(), destination / entry.path().filename(), ec);
+    }
+    std::filesystem::remove(wrapper, ec);
+  }
+};
+
+}
+}
+
+#endif // __REKY_ARCHIVE_H__
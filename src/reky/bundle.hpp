@@ -0,0 +1,413 @@
+
+#ifndef __REKY_BUNDLE_H__
+#define __REKY_BUNDLE_H__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#include <fmt/format.h>
+
+#include "reky/file.hpp"
+#include "reky/lock.hpp"
+
+#ifndef REKY_VENDOR_ENV
+// Path of a vendor bundle to serve dependencies from instead of Deps
+#define REKY_VENDOR_ENV "REKY_VENDOR"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// A resolved dependency closure packed into a single file, so it can be
+// copied between machines as one file instead of thousands and read in
+// place from an mmap:
+//
+//   header | file data | packages | nodes | dependencies | files | strings
+//
+// Packages are sorted by name and the files of every package by path,
+// so both are found with a binary search. Files can be stored zlib
+// compressed, they are only inflated (once) when read.
+class VendorBundle final {
+public:
+  static constexpr char MAGIC[8] = {'R', 'E', 'K', 'Y', 'V', 'N', 'D', '\0'};
+  static constexpr uint32_t FORMAT_VERSION = 1;
+  static constexpr uint32_t FILE_COMPRESSED = 1;
+
+  struct StringRef {
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  struct Header {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t package_count;
+    uint32_t node_count;
+    uint32_t dependency_count;
+    uint32_t file_count;
+    uint32_t reserved;
+    // Everything after the file data, relative to the start of the file
+    uint64_t tables_offset;
+    uint64_t strings_size;
+  };
+
+  struct Package {
+    StringRef name;
+    StringRef version;
+    StringRef commit;
+    // Lockfile::get_tree_digest of the tree that was packed
+    StringRef digest;
+    uint32_t files_offset;
+    uint32_t files_count;
+  };
+
+  // An entry of the dependency graph, roots included
+  struct Node {
+    StringRef name;
+    uint32_t dependencies_offset;
+    uint32_t dependencies_count;
+  };
+
+  struct File {
+    // Relative to the package root
+    StringRef path;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t stored_size;
+  };
+
+  // What to pack for every package
+  struct Source {
+    std::string name;
+    std::string version;
+    std::string commit;
+    std::string digest;
+    std::filesystem::path root;
+  };
+private:
+  void* data = MAP_FAILED;
+  size_t size = 0;
+  const Header* header = nullptr;
+  const Package* packages = nullptr;
+  const Node* nodes = nullptr;
+  const StringRef* dependencies = nullptr;
+  const File* files = nullptr;
+  const char* strings = nullptr;
+  // Compressed files, inflated the first time they're read
+  std::mutex inflated_mutex;
+  std::unordered_map<const File*, std::string> inflated;
+public:
+  VendorBundle() = default;
+  VendorBundle(const VendorBundle&) = delete;
+  VendorBundle& operator=(const VendorBundle&) = delete;
+
+  ~VendorBundle() {
+    close();
+  }
+
+  bool is_open() const {
+    return header != nullptr;
+  }
+
+  bool open(const std::filesystem::path& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+      ::close(fd);
+      return false;
+    }
+    size = st.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    auto base = static_cast<const char*>(data);
+    auto h = reinterpret_cast<const Header*>(base);
+    if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->format_version != FORMAT_VERSION) {
+      close();
+      return false;
+    }
+    size_t expected = h->tables_offset
+      + h->package_count * sizeof(Package)
+      + h->node_count * sizeof(Node)
+      + h->dependency_count * sizeof(StringRef)
+      + h->file_count * sizeof(File)
+      + h->strings_size;
+    if (h->tables_offset < sizeof(Header) || expected != size) {
+      close();
+      return false;
+    }
+    header = h;
+    packages = reinterpret_cast<const Package*>(base + h->tables_offset);
+    nodes = reinterpret_cast<const Node*>(packages + h->package_count);
+    dependencies = reinterpret_cast<const StringRef*>(nodes + h->node_count);
+    files = reinterpret_cast<const File*>(dependencies + h->dependency_count);
+    strings = reinterpret_cast<const char*>(files + h->file_count);
+    return true;
+  }
+
+  void close() {
+    if (data != MAP_FAILED) {
+      munmap(data, size);
+    }
+    data = MAP_FAILED;
+    size = 0;
+    header = nullptr;
+    std::lock_guard<std::mutex> lock(inflated_mutex);
+    inflated.clear();
+  }
+
+  size_t get_package_count() const {
+    return header ? header->package_count : 0;
+  }
+
+  const Package& get_package(size_t i) const {
+    return packages[i];
+  }
+
+  const Package* find(std::string_view name) const {
+    if (!header) {
+      return nullptr;
+    }
+    auto end = packages + header->package_count;
+    auto it = std::lower_bound(packages, end, name, [this](const Package& package, std::string_view name) {
+      return get_string(package.name) < name;
+    });
+    if (it == end || get_string(it->name) != name) {
+      return nullptr;
+    }
+    return it;
+  }
+
+  std::map<std::string, std::vector<std::string>> get_graph() const {
+    std::map<std::string, std::vector<std::string>> graph;
+    for (uint32_t i = 0; header && i < header->node_count; i++) {
+      auto& deps = graph[std::string(get_string(nodes[i].name))];
+      for (uint32_t j = 0; j < nodes[i].dependencies_count; j++) {
+        deps.emplace_back(get_string(dependencies[nodes[i].dependencies_offset + j]));
+      }
+    }
+    return graph;
+  }
+
+  // Contents of a file of the package, straight from the mapping if it
+  // was stored as is. Valid until the bundle is closed.
+  std::optional<std::string_view> read(const Package& package, std::string_view path) {
+    auto begin = files + package.files_offset;
+    auto end = begin + package.files_count;
+    auto it = std::lower_bound(begin, end, path, [this](const File& file, std::string_view path) {
+      return get_string(file.path) < path;
+    });
+    if (it == end || get_string(it->path) != path) {
+      return std::nullopt;
+    }
+    return read(*it);
+  }
+
+  std::optional<std::string_view> read(const File& file) {
+    auto stored = std::string_view(static_cast<const char*>(data) + file.offset, file.stored_size);
+    if (!(file.flags & FILE_COMPRESSED)) {
+      return stored;
+    }
+    std::lock_guard<std::mutex> lock(inflated_mutex);
+    auto it = inflated.find(&file);
+    if (it == inflated.end()) {
+      std::string content(file.size, '\0');
+      uLongf content_size = file.size;
+      if (uncompress(reinterpret_cast<Bytef*>(content.data()), &content_size,
+                     reinterpret_cast<const Bytef*>(stored.data()), stored.size()) != Z_OK || content_size != file.size) {
+        return std::nullopt;
+      }
+      it = inflated.emplace(&file, std::move(content)).first;
+    }
+    return std::string_view(it->second);
+  }
+
+  std::vector<std::string_view> list(const Package& package) const {
+    std::vector<std::string_view> paths;
+    paths.reserve(package.files_count);
+    for (uint32_t i = 0; i < package.files_count; i++) {
+      paths.push_back(get_string(files[package.files_offset + i].path));
+    }
+    return paths;
+  }
+
+  // Hash the packed files the way Lockfile::get_tree_digest hashes a
+  // directory and compare it with the digest recorded when packing.
+  bool verify(const Package& package) {
+    std::vector<const File*> sorted;
+    for (uint32_t i = 0; i < package.files_count; i++) {
+      sorted.push_back(files + package.files_offset + i);
+    }
+    // get_tree_digest orders paths component by component
+    std::sort(sorted.begin(), sorted.end(), [this](const File* a, const File* b) {
+      return std::filesystem::path(std::string(get_string(a->path))) < std::filesystem::path(std::string(get_string(b->path)));
+    });
+    uint64_t digest = Lockfile::hash("");
+    for (auto file : sorted) {
+      auto content = read(*file);
+      if (!content.has_value()) {
+        return false;
+      }
+      digest = Lockfile::hash(get_string(file->path), digest);
+      digest = Lockfile::hash(content.value(), digest);
+    }
+    return fmt::format("{:016x}", digest) == get_string(package.digest);
+  }
+
+  std::string_view get_string(const StringRef& ref) const {
+    return std::string_view(strings + ref.offset, ref.size);
+  }
+
+  // Pack every source into `output`. File data is streamed out first,
+  // the tables follow once every offset is known. Written next to the
+  // destination and renamed, so readers never see it half done.
+  static bool write(const std::filesystem::path& output, std::vector<Source> sources,
+                    const std::map<std::string, std::vector<std::string>>& graph, bool compress) {
+    std::sort(sources.begin(), sources.end(), [](const Source& a, const Source& b) {
+      return a.name < b.name;
+    });
+    std::string string_table;
+    auto add_string = [&](std::string_view str) {
+      StringRef ref{(uint32_t)string_table.size(), (uint32_t)str.size()};
+      string_table += str;
+      return ref;
+    };
+    std::vector<Package> package_table;
+    std::vector<Node> node_table;
+    std::vector<StringRef> dependency_table;
+    std::vector<File> file_table;
+
+    auto tmp = output.string() + ".tmp";
+    // Gone on every way out but the rename: a source that can't be
+    // read, a failed write or an exception half way through
+    struct RemoveTmp final {
+      std::string path;
+      bool renamed = false;
+      ~RemoveTmp() {
+        if (!renamed) {
+          std::error_code ec;
+          std::filesystem::remove(path, ec);
+        }
+      }
+    } remove_tmp{tmp};
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    Header header;
+    memset(&header, 0, sizeof(header));
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t offset = sizeof(header);
+    std::string compressed;
+    for (auto& source : sources) {
+      Package package;
+      package.name = add_string(source.name);
+      package.version = add_string(source.version);
+      package.commit = add_string(source.commit);
+      package.digest = add_string(source.digest);
+      package.files_offset = file_table.size();
+      std::vector<std::string> paths;
+      std::error_code ec;
+      for (auto& entry : std::filesystem::recursive_directory_iterator(source.root, ec)) {
+        if (entry.is_regular_file(ec)) {
+          paths.push_back(std::filesystem::relative(entry.path(), source.root, ec).generic_string());
+        }
+      }
+      std::sort(paths.begin(), paths.end());
+      for (auto& path : paths) {
+        auto content = AtomicFile::read(source.root / path);
+        if (!content.has_value()) {
+          return false;
+        }
+        File file;
+        memset(&file, 0, sizeof(file));
+        file.path = add_string(path);
+        file.offset = offset;
+        file.size = content->size();
+        std::string_view stored = content.value();
+        if (compress && !content->empty()) {
+          uLongf compressed_size = compressBound(content->size());
+          compressed.resize(compressed_size);
+          if (compress2(reinterpret_cast<Bytef*>(compressed.data()), &compressed_size,
+                        reinterpret_cast<const Bytef*>(content->data()), content->size(), Z_BEST_COMPRESSION) == Z_OK
+              && compressed_size < content->size()) {
+            // Only kept if it actually saves something
+            stored = std::string_view(compressed.data(), compressed_size);
+            file.flags |= FILE_COMPRESSED;
+          }
+        }
+        file.stored_size = stored.size();
+        out.write(stored.data(), stored.size());
+        offset += stored.size();
+        file_table.push_back(file);
+      }
+      package.files_count = file_table.size() - package.files_offset;
+      package_table.push_back(package);
+    }
+    for (auto& [name, deps] : graph) {
+      Node node;
+      node.name = add_string(name);
+      node.dependencies_offset = dependency_table.size();
+      node.dependencies_count = deps.size();
+      for (auto& dep : deps) {
+        dependency_table.push_back(add_string(dep));
+      }
+      node_table.push_back(node);
+    }
+    // Keep the tables aligned for the mapping
+    while (offset % alignof(uint64_t) != 0) {
+      out.put('\0');
+      offset++;
+    }
+    out.write(reinterpret_cast<const char*>(package_table.data()), package_table.size() * sizeof(Package));
+    out.write(reinterpret_cast<const char*>(node_table.data()), node_table.size() * sizeof(Node));
+    out.write(reinterpret_cast<const char*>(dependency_table.data()), dependency_table.size() * sizeof(StringRef));
+    out.write(reinterpret_cast<const char*>(file_table.data()), file_table.size() * sizeof(File));
+    out.write(string_table.data(), string_table.size());
+
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.format_version = FORMAT_VERSION;
+    header.package_count = package_table.size();
+    header.node_count = node_table.size();
+    header.dependency_count = dependency_table.size();
+    header.file_count = file_table.size();
+    header.tables_offset = offset;
+    header.strings_size = string_table.size();
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+    if (!out) {
+      return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, output, ec);
+    remove_tmp.renamed = !ec;
+    return !ec;
+  }
+};
+
+}
+}
+
+#endif // __REKY_BUNDLE_H__
@@ -0,0 +1,66 @@
+
+#ifndef __REKY_CHANNEL_H__
+#define __REKY_CHANNEL_H__
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <condition_variable>
+
+namespace snowball {
+namespace reky {
+
+// Unbounded queue handing values from one thread to another. The
+// producer closes it when it's done, after which pop() drains
+// what's left and then returns nullopt.
+template <typename T>
+class Channel final {
+  std::deque<T> values;
+  std::mutex mutex;
+  std::condition_variable available;
+  bool closed = false;
+public:
+  void push(T value) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      values.push_back(std::move(value));
+    }
+    available.notify_one();
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    available.notify_all();
+  }
+
+  // Blocks until there is a value or the channel is closed
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    available.wait(lock, [this] { return !values.empty() || closed; });
+    if (values.empty()) {
+      return std::nullopt;
+    }
+    auto value = std::move(values.front());
+    values.pop_front();
+    return value;
+  }
+
+  // Doesn't block, nullopt if nothing is queued right now
+  std::optional<T> try_pop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (values.empty()) {
+      return std::nullopt;
+    }
+    auto value = std::move(values.front());
+    values.pop_front();
+    return value;
+  }
+};
+
+}
+}
+
+#endif // __REKY_CHANNEL_H__
@@ -0,0 +1,182 @@
+
+#ifndef __REKY_CONFIG_H__
+#define __REKY_CONFIG_H__
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <functional>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+
+#include "reky/file.hpp"
+
+namespace snowball {
+namespace reky {
+
+// A single "name==version" line. All views point into the
+// buffer of the arena the config was loaded with.
+struct ConfigEntry final {
+  std::string_view name;
+  std::string_view version;
+  unsigned int line;
+  // Comma separated subpaths from "; paths=...", empty for everything
+  std::string_view paths;
+};
+
+using RekyConfig = std::vector<ConfigEntry>;
+
+// Owns the contents of every config read during a resolve,
+// so parsed entries can be plain views into them.
+class ConfigArena final {
+  std::deque<std::string> buffers;
+public:
+  // Read the whole file with a single read, nullopt if it doesn't exist
+  std::optional<std::string_view> load(const std::filesystem::path& path) {
+    auto content = AtomicFile::read(path);
+    if (!content.has_value()) {
+      return std::nullopt;
+    }
+    buffers.push_back(std::move(content.value()));
+    return std::string_view(buffers.back());
+  }
+
+  void clear() {
+    buffers.clear();
+  }
+
+  size_t size() const {
+    return buffers.size();
+  }
+};
+
+struct ConfigParser final {
+  using ErrorHandler = std::function<void(const std::string& message, unsigned int line)>;
+
+  static std::string_view trim(std::string_view str) {
+    size_t start = 0;
+    size_t end = str.size();
+    while (start < end && is_space(str[start])) {
+      start++;
+    }
+    while (end > start && is_space(str[end - 1])) {
+      end--;
+    }
+    return str.substr(start, end - start);
+  }
+
+  // Classic requirements.txt like format. Lines and separators are found
+  // with memchr, which libc implements with vector instructions, and no
+  // string is copied: entries are views into `content`. If a name appears
+  // more than once the last entry wins. Options follow a ';':
+  //   name==version; paths=src,include
+  static bool parse(std::string_view content, RekyConfig& config, const ErrorHandler& on_error) {
+    bool has_error = false;
+    unsigned int line_number = 0;
+    std::unordered_map<std::string_view, size_t> seen;
+    const char* cursor = content.data();
+    const char* end = cursor + content.size();
+    while (cursor < end) {
+      line_number++;
+      auto newline = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+      auto line_end = newline ? newline : end;
+      auto line = trim(std::string_view(cursor, line_end - cursor));
+      cursor = line_end + 1;
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      auto pos = find_separator(line);
+      if (pos == std::string_view::npos) {
+        on_error("Invalid package format. Must be 'name==version'", line_number);
+        has_error = true;
+        continue;
+      }
+      auto name = trim(line.substr(0, pos));
+      auto version = line.substr(pos + 2);
+      std::string_view paths;
+      auto options = version.find(';');
+      if (options != std::string_view::npos) {
+        auto option = trim(version.substr(options + 1));
+        version = version.substr(0, options);
+        std::string_view key = "paths=";
+        if (option.compare(0, key.size(), key) != 0) {
+          on_error("Unknown option. Only 'paths=' is supported", line_number);
+          has_error = true;
+          continue;
+        }
+        paths = trim(option.substr(key.size()));
+      }
+      version = trim(version);
+      if (version.empty()) {
+        on_error("Invalid version format. Must be 'name==version'", line_number);
+        has_error = true;
+        continue;
+      } else if (name.empty()) {
+        on_error("Invalid name format. Must be 'name==version'", line_number);
+        has_error = true;
+        continue;
+      }
+      auto [it, inserted] = seen.emplace(name, config.size());
+      if (inserted) {
+        config.push_back({name, version, line_number, paths});
+      } else {
+        config[it->second] = {name, version, line_number, paths};
+      }
+    }
+    return !has_error;
+  }
+
+  // Split a "src, include/" paths option into clean relative paths
+  static std::vector<std::string> split_paths(std::string_view paths) {
+    std::vector<std::string> result;
+    while (!paths.empty()) {
+      auto comma = paths.find(',');
+      auto path = normalize_path(paths.substr(0, comma));
+      paths = comma == std::string_view::npos ? std::string_view() : paths.substr(comma + 1);
+      if (!path.empty()) {
+        result.emplace_back(path);
+      }
+    }
+    return result;
+  }
+
+  // "./src/" -> "src", empty for the root itself
+  static std::string_view normalize_path(std::string_view path) {
+    path = trim(path);
+    while (path.size() >= 2 && path.compare(0, 2, "./") == 0) {
+      path.remove_prefix(2);
+    }
+    while (!path.empty() && path.back() == '/') {
+      path.remove_suffix(1);
+    }
+    return path == "." ? std::string_view() : path;
+  }
+
+  // Position of the first "==" in the line
+  static size_t find_separator(std::string_view line) {
+    const char* start = line.data();
+    const char* end = start + line.size();
+    while (start < end) {
+      auto eq = static_cast<const char*>(memchr(start, '=', end - start));
+      if (!eq || eq + 1 >= end) {
+        return std::string_view::npos;
+      }
+      if (eq[1] == '=') {
+        return eq - line.data();
+      }
+      start = eq + 1;
+    }
+    return std::string_view::npos;
+  }
+private:
+  static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+};
+
+}
+}
+
+#endif // __REKY_CONFIG_H__
@@ -0,0 +1,238 @@
+
+#ifndef __REKY_DAEMON_H__
+#define __REKY_DAEMON_H__
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <cstring>
+#include <optional>
+#include <functional>
+#include <filesystem>
+#include <condition_variable>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include <nlohmann/json.hpp>
+
+#ifndef REKY_DAEMON_SOCKET
+// Under the snowball home
+#define REKY_DAEMON_SOCKET "reky.sock"
+#endif
+
+#ifndef REKY_DAEMON_ENV
+// Set to "0" to never ask the daemon, even if it's running
+#define REKY_DAEMON_ENV "REKY_DAEMON"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// Local connections to the daemon. Every connection carries a single
+// request and its response, each one line of JSON.
+struct DaemonSocket final {
+  static bool make_address(const std::filesystem::path& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    auto native = path.string();
+    if (native.size() >= sizeof(address.sun_path)) {
+      return false;
+    }
+    memcpy(address.sun_path, native.c_str(), native.size() + 1);
+    return true;
+  }
+
+  // -1 if nothing is listening there
+  static int connect_to(const std::filesystem::path& path) {
+    sockaddr_un address;
+    if (!make_address(path, address)) {
+      return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static bool send_line(int fd, const std::string& line) {
+    auto data = line + "\n";
+    size_t sent = 0;
+    while (sent < data.size()) {
+      auto n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+
+  static std::optional<std::string> receive_line(int fd) {
+    std::string line;
+    char buffer[4096];
+    while (true) {
+      auto n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        // The other side went away before finishing the line
+        return std::nullopt;
+      }
+      line.append(buffer, n);
+      auto newline = line.find('\n');
+      if (newline != std::string::npos) {
+        line.resize(newline);
+        return line;
+      }
+    }
+  }
+};
+
+struct DaemonClient final {
+  // nullopt if the daemon isn't running or died while answering,
+  // the caller should then do the work itself
+  static std::optional<nlohmann::json> request(const std::filesystem::path& socket_path, const nlohmann::json& request) {
+    int fd = DaemonSocket::connect_to(socket_path);
+    if (fd < 0) {
+      return std::nullopt;
+    }
+    std::optional<std::string> line;
+    if (DaemonSocket::send_line(fd, request.dump())) {
+      line = DaemonSocket::receive_line(fd);
+    }
+    close(fd);
+    if (!line.has_value()) {
+      return std::nullopt;
+    }
+    auto response = nlohmann::json::parse(line.value(), nullptr, false);
+    if (response.is_discarded() || !response.is_object()) {
+      return std::nullopt;
+    }
+    return response;
+  }
+};
+
+// Accepts connections on a Unix socket and answers every request on its
+// own thread, so a long fetch for one workspace doesn't hold up others.
+class DaemonServer final {
+public:
+  using Handler = std::function<nlohmann::json(const nlohmann::json&)>;
+private:
+  std::filesystem::path socket_path;
+  int fd = -1;
+  std::atomic<bool> stopping = false;
+  std::mutex mutex;
+  std::condition_variable idle;
+  size_t active = 0;
+public:
+  DaemonServer() = default;
+  DaemonServer(const DaemonServer&) = delete;
+  DaemonServer& operator=(const DaemonServer&) = delete;
+
+  ~DaemonServer() {
+    stop();
+  }
+
+  // False if another daemon is already listening, or the socket
+  // can't be created. A socket left behind by a dead one is replaced.
+  bool listen(const std::filesystem::path& path) {
+    int existing = DaemonSocket::connect_to(path);
+    if (existing >= 0) {
+      close(existing);
+      return false;
+    }
+    sockaddr_un address;
+    if (!DaemonSocket::make_address(path, address)) {
+      return false;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    unlink(path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return false;
+    }
+    // Only the user the daemon runs as can talk to it
+    auto mask = umask(0077);
+    auto bound = bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || ::listen(fd, SOMAXCONN) != 0) {
+      close(fd);
+      fd = -1;
+      return false;
+    }
+    socket_path = path;
+    return true;
+  }
+
+  // Blocks until stop() is called
+  void serve(const Handler& handler) {
+    while (!stopping) {
+      int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        break;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        active++;
+      }
+      std::thread([this, client, &handler] {
+        answer(client, handler);
+        close(client);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--active == 0) {
+          idle.notify_all();
+        }
+      }).detach();
+    }
+    // Let the requests being answered finish
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return active == 0; });
+  }
+
+  void stop() {
+    if (stopping.exchange(true) || fd < 0) {
+      return;
+    }
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    unlink(socket_path.c_str());
+  }
+private:
+  static void answer(int client, const Handler& handler) {
+    auto line = DaemonSocket::receive_line(client);
+    if (!line.has_value()) {
+      return;
+    }
+    auto request = nlohmann::json::parse(line.value(), nullptr, false);
+    nlohmann::json response;
+    if (request.is_discarded() || !request.is_object()) {
+      response = {{"ok", false}, {"error", "Invalid request"}};
+    } else {
+      response = handler(request);
+    }
+    DaemonSocket::send_line(client, response.dump());
+  }
+};
+
+}
+}
+
+#endif // __REKY_DAEMON_H__
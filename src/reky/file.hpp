@@ -0,0 +1,188 @@
+
+#ifndef __REKY_FILE_H__
+#define __REKY_FILE_H__
+
+#include <string>
+#include <utility>
+#include <optional>
+#include <filesystem>
+#include <string_view>
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#ifndef REKY_LOCKS_DIR
+// Next to whatever the locks protect (store, mirrors, Deps)
+#define REKY_LOCKS_DIR ".locks"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// Whole-file helpers for the small state files reky keeps around
+// (cache, lockfile, manifest). Writes are atomic: readers either see
+// the old content or the new one, never a torn mix of both.
+struct AtomicFile final {
+  static std::optional<std::string> read(const std::filesystem::path& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return std::nullopt;
+    }
+    std::string content;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      content.reserve(st.st_size);
+    }
+    char buffer[16384];
+    ssize_t n;
+    while ((n = ::read(fd, buffer, sizeof(buffer))) != 0) {
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        close(fd);
+        return std::nullopt;
+      }
+      content.append(buffer, n);
+    }
+    close(fd);
+    return content;
+  }
+
+  // Write to a temporary file next to `path`, fsync it and rename it
+  // over the destination.
+  static bool write(const std::filesystem::path& path, const std::string& content) {
+    auto tmp = path.string() + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    size_t written = 0;
+    while (written < content.size()) {
+      auto n = ::write(fd, content.data() + written, content.size() - written);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+      }
+      written += n;
+    }
+    bool ok = fsync(fd) == 0;
+    ok &= close(fd) == 0;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // Skips the write (and the fsync) when nothing changed.
+  // Returns whether the file was written.
+  static bool write_if_changed(const std::filesystem::path& path, const std::string& content) {
+    auto current = read(path);
+    if (current.has_value() && current.value() == content) {
+      return false;
+    }
+    return write(path, content);
+  }
+};
+
+// Advisory lock (flock) shared with every other reky process, held
+// until the object goes away. Each one opens its own descriptor, so
+// threads of the same process exclude each other too. The kernel drops
+// it when the process dies: a killed build never leaves anything locked.
+class FileLock final {
+  int fd = -1;
+public:
+  FileLock() = default;
+  FileLock(const FileLock&) = delete;
+  FileLock& operator=(const FileLock&) = delete;
+
+  FileLock(FileLock&& other) noexcept : fd(std::exchange(other.fd, -1)) {}
+
+  FileLock& operator=(FileLock&& other) noexcept {
+    if (this != &other) {
+      unlock();
+      fd = std::exchange(other.fd, -1);
+    }
+    return *this;
+  }
+
+  ~FileLock() {
+    unlock();
+  }
+
+  // Blocks until nobody else holds it. False if the lock file can't be
+  // created (e.g. a read-only home), callers then go on unlocked.
+  bool lock(const std::filesystem::path& path) {
+    return acquire(path, LOCK_EX);
+  }
+
+  // False right away if someone else holds it
+  bool try_lock(const std::filesystem::path& path) {
+    return acquire(path, LOCK_EX | LOCK_NB);
+  }
+
+  bool is_locked() const {
+    return fd >= 0;
+  }
+
+  // The holder can leave a short note in the lock file for whoever
+  // takes it next. Not synced, it only has to outlive the process.
+  bool write(std::string_view content) {
+    if (fd < 0 || ftruncate(fd, 0) != 0) {
+      return false;
+    }
+    return pwrite(fd, content.data(), content.size(), 0) == static_cast<ssize_t>(content.size());
+  }
+
+  std::string read() const {
+    std::string content;
+    if (fd < 0) {
+      return content;
+    }
+    char buffer[4096];
+    ssize_t n;
+    while ((n = pread(fd, buffer, sizeof(buffer), content.size())) > 0) {
+      content.append(buffer, n);
+    }
+    return content;
+  }
+
+  void unlock() {
+    if (fd >= 0) {
+      // Closing the descriptor releases the lock
+      close(fd);
+      fd = -1;
+    }
+  }
+private:
+  bool acquire(const std::filesystem::path& path, int operation) {
+    unlock();
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    while (flock(fd, operation) != 0) {
+      if (errno != EINTR) {
+        unlock();
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+}
+}
+
+#endif // __REKY_FILE_H__
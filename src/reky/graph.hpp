@@ -0,0 +1,460 @@
+
+#ifndef __REKY_GRAPH_H__
+#define __REKY_GRAPH_H__
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+namespace snowball {
+namespace reky {
+
+using PackageId = uint32_t;
+
+// Gives every package (or crate) name a dense integer id, so the
+// graph and the cache can use plain arrays instead of string maps.
+// Names are stored once and never move.
+class NameTable final {
+  std::deque<std::string> names;
+  std::unordered_map<std::string_view, PackageId> ids;
+public:
+  PackageId intern(std::string_view name) {
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    PackageId id = names.size();
+    names.emplace_back(name);
+    ids.emplace(names.back(), id);
+    return id;
+  }
+
+  std::optional<PackageId> find(std::string_view name) const {
+    auto it = ids.find(name);
+    if (it == ids.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  const std::string& get_name(PackageId id) const {
+    return names[id];
+  }
+
+  size_t size() const {
+    return names.size();
+  }
+};
+
+// Iterates over a list of ids, yielding their names
+class NameRange final {
+  const NameTable* names;
+  const PackageId* first;
+  const PackageId* last;
+public:
+  class iterator final {
+    const NameTable* names;
+    const PackageId* current;
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::string;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const std::string*;
+    using reference = const std::string&;
+
+    iterator(const NameTable* names, const PackageId* current) : names(names), current(current) {}
+    const std::string& operator*() const { return names->get_name(*current); }
+    iterator& operator++() { ++current; return *this; }
+    bool operator!=(const iterator& other) const { return current != other.current; }
+    bool operator==(const iterator& other) const { return current == other.current; }
+  };
+
+  NameRange(const NameTable* names, const PackageId* first, const PackageId* last)
+    : names(names), first(first), last(last) {}
+
+  iterator begin() const { return iterator(names, first); }
+  iterator end() const { return iterator(names, last); }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+
+  operator std::vector<std::string>() const {
+    return std::vector<std::string>(begin(), end());
+  }
+};
+
+// Result of levelizing a dependency graph. Every package only depends on
+// packages in earlier levels, so everything inside one level can be
+// compiled in parallel. Packages that depend on each other in a cycle
+// are placed together in the same level and reported in `cycles`.
+struct GraphSchedule final {
+  // levels[0] has no dependencies. Inside a level, packages
+  // are sorted by critical path, longest first.
+  std::vector<std::vector<PackageId>> levels;
+  // Strongly connected components with more than one
+  // package, or a single package that depends on itself.
+  std::vector<std::vector<PackageId>> cycles;
+  // Indexed by id: total weight of the longest chain of packages
+  // that can't start until this one is done, including itself.
+  std::vector<uint64_t> critical_path;
+  // Number of levels, and size of the largest one
+  size_t height = 0;
+  size_t width = 0;
+
+  bool has_cycles() const {
+    return !cycles.empty();
+  }
+
+  // Weight of the longest chain in the whole graph
+  uint64_t get_critical_path_length() const {
+    uint64_t length = 0;
+    for (auto weight : critical_path) {
+      length = std::max(length, weight);
+    }
+    return length;
+  }
+};
+
+class DepsGraph;
+
+// Read-only view of a DepsGraph that looks like the
+// std::map<name, std::vector<name>> it used to be.
+class GraphView final {
+  const DepsGraph* deps_graph;
+public:
+  using value_type = std::pair<const std::string&, NameRange>;
+
+  class iterator final {
+    const DepsGraph* deps_graph;
+    PackageId current;
+    mutable std::optional<value_type> value;
+  public:
+    iterator(const DepsGraph* deps_graph, PackageId current) : deps_graph(deps_graph), current(current) {
+      skip_missing();
+    }
+    const value_type& operator*() const;
+    const value_type* operator->() const { return &**this; }
+    iterator& operator++() { current++; skip_missing(); return *this; }
+    bool operator!=(const iterator& other) const { return current != other.current; }
+    bool operator==(const iterator& other) const { return current == other.current; }
+  private:
+    void skip_missing();
+  };
+
+  explicit GraphView(const DepsGraph* deps_graph) : deps_graph(deps_graph) {}
+
+  iterator begin() const;
+  iterator end() const;
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+  size_t count(const std::string& name) const;
+  NameRange at(const std::string& name) const;
+  NameRange operator[](const std::string& name) const { return at(name); }
+  operator std::map<std::string, std::vector<std::string>>() const;
+};
+
+// Dependency graph in compressed sparse row form: the edges of every
+// node live in one flat array and each node only stores where its
+// slice starts and how long it is. Replacing a node's edges appends a
+// new slice, compact() drops the ones that are no longer referenced.
+class DepsGraph final {
+  struct Node {
+    uint32_t offset = 0;
+    uint32_t count = 0;
+    bool present = false;
+  };
+
+  std::shared_ptr<NameTable> names;
+  std::vector<Node> nodes;
+  std::vector<PackageId> edges;
+  size_t node_count = 0;
+public:
+  // Kept for code that still reads the graph as a map of names
+  GraphView graph{this};
+
+  explicit DepsGraph(std::shared_ptr<NameTable> names = std::make_shared<NameTable>())
+    : names(std::move(names)) {}
+
+  DepsGraph(const DepsGraph& other)
+    : names(other.names), nodes(other.nodes), edges(other.edges), node_count(other.node_count) {}
+
+  DepsGraph& operator=(const DepsGraph& other) {
+    names = other.names;
+    nodes = other.nodes;
+    edges = other.edges;
+    node_count = other.node_count;
+    return *this;
+  }
+
+  const std::shared_ptr<NameTable>& get_names() const {
+    return names;
+  }
+
+  // Number of ids the graph has room for (not all of them are nodes)
+  size_t get_capacity() const {
+    return nodes.size();
+  }
+
+  size_t get_node_count() const {
+    return node_count;
+  }
+
+  size_t get_edge_count() const {
+    size_t count = 0;
+    for (auto& node : nodes) {
+      count += node.count;
+    }
+    return count;
+  }
+
+  bool has_node(PackageId id) const {
+    return id < nodes.size() && nodes[id].present;
+  }
+
+  void set_edges(PackageId id, const std::vector<PackageId>& deps) {
+    if (id >= nodes.size()) {
+      nodes.resize(id + 1);
+    }
+    auto& node = nodes[id];
+    if (!node.present) {
+      node.present = true;
+      node_count++;
+    }
+    node.offset = edges.size();
+    node.count = deps.size();
+    edges.insert(edges.end(), deps.begin(), deps.end());
+  }
+
+  void remove_node(PackageId id) {
+    if (has_node(id)) {
+      nodes[id] = Node();
+      node_count--;
+    }
+  }
+
+  const PackageId* edges_begin(PackageId id) const {
+    return edges.data() + (has_node(id) ? nodes[id].offset : 0);
+  }
+
+  const PackageId* edges_end(PackageId id) const {
+    return has_node(id) ? edges_begin(id) + nodes[id].count : edges.data();
+  }
+
+  NameRange get_edges(PackageId id) const {
+    return NameRange(names.get(), edges_begin(id), edges_end(id));
+  }
+
+  void compact() {
+    std::vector<PackageId> packed;
+    packed.reserve(get_edge_count());
+    for (auto& node : nodes) {
+      auto offset = packed.size();
+      packed.insert(packed.end(), edges.begin() + node.offset, edges.begin() + node.offset + node.count);
+      node.offset = offset;
+    }
+    edges = std::move(packed);
+  }
+
+  void clear() {
+    nodes.clear();
+    edges.clear();
+    node_count = 0;
+  }
+
+  // Linear time levelization (Tarjan's SCC algorithm, then a longest
+  // path pass over the condensed DAG). `weights` is indexed by id and
+  // estimates how long each package takes to build, 1 if not given.
+  GraphSchedule levelize(const std::vector<uint64_t>* weights = nullptr) const {
+    constexpr uint32_t UNVISITED = UINT32_MAX;
+    size_t size = nodes.size();
+    for (auto dep : edges) {
+      size = std::max<size_t>(size, dep + 1);
+    }
+    std::vector<char> is_vertex(size, false);
+    for (PackageId id = 0; id < nodes.size(); id++) {
+      if (has_node(id)) {
+        is_vertex[id] = true;
+        for (auto dep = edges_begin(id); dep != edges_end(id); ++dep) {
+          is_vertex[*dep] = true;
+        }
+      }
+    }
+    auto get_weight = [&](PackageId id) -> uint64_t {
+      return weights && id < weights->size() ? (*weights)[id] : 1;
+    };
+
+    // Tarjan emits components dependencies first
+    std::vector<uint32_t> index(size, UNVISITED);
+    std::vector<uint32_t> low(size, 0);
+    std::vector<uint32_t> component(size, UNVISITED);
+    std::vector<char> on_stack(size, false);
+    std::vector<PackageId> stack;
+    std::vector<std::vector<PackageId>> components;
+    std::vector<std::pair<PackageId, const PackageId*>> calls;
+    uint32_t counter = 0;
+    for (PackageId root = 0; root < size; root++) {
+      if (!is_vertex[root] || index[root] != UNVISITED) {
+        continue;
+      }
+      calls.emplace_back(root, edges_begin(root));
+      index[root] = low[root] = counter++;
+      stack.push_back(root);
+      on_stack[root] = true;
+      while (!calls.empty()) {
+        auto& [node, next] = calls.back();
+        if (next != edges_end(node)) {
+          auto dep = *next++;
+          if (index[dep] == UNVISITED) {
+            index[dep] = low[dep] = counter++;
+            stack.push_back(dep);
+            on_stack[dep] = true;
+            calls.emplace_back(dep, edges_begin(dep));
+          } else if (on_stack[dep]) {
+            low[node] = std::min(low[node], index[dep]);
+          }
+          continue;
+        }
+        auto finished = node;
+        calls.pop_back();
+        if (!calls.empty()) {
+          auto parent = calls.back().first;
+          low[parent] = std::min(low[parent], low[finished]);
+        }
+        if (low[finished] == index[finished]) {
+          std::vector<PackageId> members;
+          PackageId member;
+          do {
+            member = stack.back();
+            stack.pop_back();
+            on_stack[member] = false;
+            component[member] = components.size();
+            members.push_back(member);
+          } while (member != finished);
+          components.push_back(std::move(members));
+        }
+      }
+    }
+
+    GraphSchedule schedule;
+    schedule.critical_path.assign(size, 0);
+    std::vector<size_t> component_level(components.size(), 0);
+    std::vector<uint64_t> component_weight(components.size(), 0);
+    std::vector<uint64_t> component_path(components.size(), 0);
+    for (size_t c = 0; c < components.size(); c++) {
+      bool self_loop = false;
+      for (auto id : components[c]) {
+        component_weight[c] += get_weight(id);
+        for (auto dep = edges_begin(id); dep != edges_end(id); ++dep) {
+          if (component[*dep] == c) {
+            self_loop = true;
+          } else {
+            // Already emitted, so its level is final
+            component_level[c] = std::max(component_level[c], component_level[component[*dep]] + 1);
+          }
+        }
+      }
+      if (components[c].size() > 1 || self_loop) {
+        schedule.cycles.push_back(components[c]);
+      }
+      component_path[c] = component_weight[c];
+    }
+    // Walk dependents first to push the longest chain down to dependencies
+    for (size_t c = components.size(); c-- > 0;) {
+      for (auto id : components[c]) {
+        for (auto dep = edges_begin(id); dep != edges_end(id); ++dep) {
+          auto d = component[*dep];
+          if (d != c) {
+            component_path[d] = std::max(component_path[d], component_path[c] + component_weight[d]);
+          }
+        }
+      }
+    }
+    for (size_t c = 0; c < components.size(); c++) {
+      auto level = component_level[c];
+      if (level >= schedule.levels.size()) {
+        schedule.levels.resize(level + 1);
+      }
+      for (auto id : components[c]) {
+        schedule.critical_path[id] = component_path[c];
+        schedule.levels[level].push_back(id);
+      }
+    }
+    for (auto& level : schedule.levels) {
+      std::stable_sort(level.begin(), level.end(), [&](PackageId a, PackageId b) {
+        return schedule.critical_path[a] > schedule.critical_path[b];
+      });
+      schedule.width = std::max(schedule.width, level.size());
+    }
+    schedule.height = schedule.levels.size();
+    return schedule;
+  }
+
+  void assign(const std::map<std::string, std::vector<std::string>>& graph) {
+    clear();
+    std::vector<PackageId> deps;
+    for (auto& [name, dep_names] : graph) {
+      deps.clear();
+      for (auto& dep : dep_names) {
+        deps.push_back(names->intern(dep));
+      }
+      set_edges(names->intern(name), deps);
+    }
+  }
+};
+
+inline const GraphView::value_type& GraphView::iterator::operator*() const {
+  value.emplace(deps_graph->get_names()->get_name(current), deps_graph->get_edges(current));
+  return *value;
+}
+
+inline void GraphView::iterator::skip_missing() {
+  while (current < deps_graph->get_capacity() && !deps_graph->has_node(current)) {
+    current++;
+  }
+}
+
+inline GraphView::iterator GraphView::begin() const {
+  return iterator(deps_graph, 0);
+}
+
+inline GraphView::iterator GraphView::end() const {
+  return iterator(deps_graph, deps_graph->get_capacity());
+}
+
+inline size_t GraphView::size() const {
+  return deps_graph->get_node_count();
+}
+
+inline size_t GraphView::count(const std::string& name) const {
+  auto id = deps_graph->get_names()->find(name);
+  return id.has_value() && deps_graph->has_node(id.value()) ? 1 : 0;
+}
+
+inline NameRange GraphView::at(const std::string& name) const {
+  auto id = deps_graph->get_names()->find(name);
+  if (!id.has_value()) {
+    return NameRange(deps_graph->get_names().get(), nullptr, nullptr);
+  }
+  return deps_graph->get_edges(id.value());
+}
+
+inline GraphView::operator std::map<std::string, std::vector<std::string>>() const {
+  std::map<std::string, std::vector<std::string>> map;
+  for (auto& [name, deps] : *this) {
+    map.emplace(name, deps);
+  }
+  return map;
+}
+
+}
+}
+
+#endif // __REKY_GRAPH_H__
@@ -0,0 +1,389 @@
+
+#ifndef __REKY_INDEX_H__
+#define __REKY_INDEX_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <nlohmann/json.hpp>
+
+#include "reky/semver.hpp"
+
+#ifndef REKY_COMPILED_INDEX
+#define REKY_COMPILED_INDEX "reky_index"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// The package index (pkgs/*.json) compiled into a single sorted
+// binary file that can be searched straight from an mmap:
+//
+//   header | bloom filter | entries (sorted by name) | versions | strings
+//
+// All offsets are relative to the start of the string table.
+class PackageIndex final {
+public:
+  static constexpr char MAGIC[8] = {'R', 'E', 'K', 'Y', 'I', 'D', 'X', '\0'};
+  // 2: versions are sorted by precedence
+  // 3: entries have the subpaths the package needs
+  static constexpr uint32_t FORMAT_VERSION = 3;
+  static constexpr uint32_t BLOOM_HASHES = 3;
+
+  struct Header {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t entry_count;
+    uint32_t version_count;
+    uint32_t bloom_words;
+    uint64_t strings_size;
+    // Commit of the index checkout this was compiled from
+    char source_commit[64];
+  };
+
+  struct StringRef {
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  struct Entry {
+    StringRef name;
+    StringRef download_url;
+    // Newline separated, empty if the whole tree is needed
+    StringRef paths;
+    uint32_t versions_offset;
+    uint32_t versions_count;
+  };
+
+  // A package as seen through the mapped index, only valid
+  // as long as the index it came from stays open.
+  class Package final {
+    const PackageIndex* index;
+    const Entry* entry;
+  public:
+    Package(const PackageIndex* index, const Entry* entry) : index(index), entry(entry) {}
+
+    std::string_view get_name() const {
+      return index->get_string(entry->name);
+    }
+
+    std::string_view get_download_url() const {
+      return index->get_string(entry->download_url);
+    }
+
+    // The only parts of the tree the compiler needs, e.g. when the
+    // repository also ships docs or assets. Empty means everything.
+    std::vector<std::string> get_paths() const {
+      std::vector<std::string> paths;
+      auto rest = index->get_string(entry->paths);
+      while (!rest.empty()) {
+        auto newline = rest.find('\n');
+        paths.emplace_back(rest.substr(0, newline));
+        rest = newline == std::string_view::npos ? std::string_view() : rest.substr(newline + 1);
+      }
+      return paths;
+    }
+
+    size_t get_version_count() const {
+      return entry->versions_count;
+    }
+
+    std::string_view get_version(size_t i) const {
+      return index->get_string(index->versions[entry->versions_offset + i]);
+    }
+
+    // Versions are stored in catalog order, see VersionCatalog::precedes
+    bool has_version(std::string_view version) const {
+      size_t low = 0;
+      size_t high = get_version_count();
+      while (low < high) {
+        auto middle = low + (high - low) / 2;
+        if (VersionCatalog::precedes(get_version(middle), version)) {
+          low = middle + 1;
+        } else {
+          high = middle;
+        }
+      }
+      return low < get_version_count() && get_version(low) == version;
+    }
+
+    std::vector<std::string> get_versions() const {
+      std::vector<std::string> result;
+      result.reserve(get_version_count());
+      for (size_t i = 0; i < get_version_count(); i++) {
+        result.emplace_back(get_version(i));
+      }
+      return result;
+    }
+  };
+private:
+  void* data = MAP_FAILED;
+  size_t size = 0;
+  const Header* header = nullptr;
+  const uint64_t* bloom = nullptr;
+  const Entry* entries = nullptr;
+  const StringRef* versions = nullptr;
+  const char* strings = nullptr;
+public:
+  PackageIndex() = default;
+  PackageIndex(const PackageIndex&) = delete;
+  PackageIndex& operator=(const PackageIndex&) = delete;
+
+  ~PackageIndex() {
+    close();
+  }
+
+  bool is_open() const {
+    return header != nullptr;
+  }
+
+  std::string_view get_source_commit() const {
+    return header ? std::string_view(header->source_commit) : std::string_view();
+  }
+
+  bool open(const std::filesystem::path& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+      ::close(fd);
+      return false;
+    }
+    size = st.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    auto base = static_cast<const char*>(data);
+    auto h = reinterpret_cast<const Header*>(base);
+    if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->format_version != FORMAT_VERSION) {
+      close();
+      return false;
+    }
+    size_t expected = sizeof(Header)
+      + h->bloom_words * sizeof(uint64_t)
+      + h->entry_count * sizeof(Entry)
+      + h->version_count * sizeof(StringRef)
+      + h->strings_size;
+    if (expected != size) {
+      close();
+      return false;
+    }
+    header = h;
+    bloom = reinterpret_cast<const uint64_t*>(base + sizeof(Header));
+    entries = reinterpret_cast<const Entry*>(bloom + h->bloom_words);
+    versions = reinterpret_cast<const StringRef*>(entries + h->entry_count);
+    strings = reinterpret_cast<const char*>(versions + h->version_count);
+    return true;
+  }
+
+  void close() {
+    if (data != MAP_FAILED) {
+      munmap(data, size);
+    }
+    data = MAP_FAILED;
+    size = 0;
+    header = nullptr;
+  }
+
+  // O(log n) lookup, unknown names are usually
+  // rejected by the bloom filter without a search.
+  std::optional<Package> find(std::string_view name) const {
+    if (!header || !may_contain(bloom, header->bloom_words, name)) {
+      return std::nullopt;
+    }
+    auto end = entries + header->entry_count;
+    auto it = std::lower_bound(entries, end, name, [this](const Entry& entry, std::string_view name) {
+      return get_string(entry.name) < name;
+    });
+    if (it == end || get_string(it->name) != name) {
+      return std::nullopt;
+    }
+    return Package(this, it);
+  }
+
+  std::string_view get_string(const StringRef& ref) const {
+    return std::string_view(strings + ref.offset, ref.size);
+  }
+
+  // Compile every pkgs/<name>.json into a single file. It is written
+  // next to the destination and renamed, so readers never see it half done.
+  static bool compile(const std::filesystem::path& pkgs_path, const std::filesystem::path& output, const std::string& commit) {
+    struct Source {
+      std::string name;
+      std::string download_url;
+      std::string paths;
+      std::vector<std::string> versions;
+    };
+    std::vector<Source> packages;
+    std::error_code ec;
+    for (auto& file : std::filesystem::directory_iterator(pkgs_path, ec)) {
+      if (file.path().extension() != ".json") {
+        continue;
+      }
+      std::ifstream f(file.path());
+      auto data = nlohmann::json::parse(f, nullptr, false);
+      if (data.is_discarded() || !data.is_object()) {
+        continue;
+      }
+      Source package;
+      package.name = file.path().stem().string();
+      package.download_url = data.value("download_url", "");
+      if (data.contains("versions") && data["versions"].is_array()) {
+        for (auto& version : data["versions"]) {
+          if (version.is_string()) {
+            package.versions.push_back(version.get<std::string>());
+          }
+        }
+        VersionCatalog::sort(package.versions);
+      }
+      if (data.contains("paths") && data["paths"].is_array()) {
+        for (auto& path : data["paths"]) {
+          if (path.is_string() && !path.get<std::string>().empty()) {
+            package.paths += (package.paths.empty() ? "" : "\n") + path.get<std::string>();
+          }
+        }
+      }
+      packages.push_back(std::move(package));
+    }
+    std::sort(packages.begin(), packages.end(), [](const Source& a, const Source& b) {
+      return a.name < b.name;
+    });
+
+    std::string string_table;
+    auto add_string = [&](const std::string& str) {
+      StringRef ref{(uint32_t)string_table.size(), (uint32_t)str.size()};
+      string_table += str;
+      return ref;
+    };
+    std::vector<Entry> entry_table;
+    std::vector<StringRef> version_table;
+    // ~10 bits per entry keeps false positives around 1%
+    uint32_t bloom_words = std::max<uint32_t>(1, (packages.size() * 10 + 63) / 64);
+    std::vector<uint64_t> bloom_table(bloom_words, 0);
+    for (auto& package : packages) {
+      Entry entry;
+      entry.name = add_string(package.name);
+      entry.download_url = add_string(package.download_url);
+      entry.paths = add_string(package.paths);
+      entry.versions_offset = version_table.size();
+      entry.versions_count = package.versions.size();
+      for (auto& version : package.versions) {
+        version_table.push_back(add_string(version));
+      }
+      entry_table.push_back(entry);
+      add_to_bloom(bloom_table.data(), bloom_words, package.name);
+    }
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.format_version = FORMAT_VERSION;
+    header.entry_count = entry_table.size();
+    header.version_count = version_table.size();
+    header.bloom_words = bloom_words;
+    header.strings_size = string_table.size();
+    strncpy(header.source_commit, commit.c_str(), sizeof(header.source_commit) - 1);
+
+    auto tmp = output.string() + ".tmp." + std::to_string(getpid());
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(bloom_table.data()), bloom_table.size() * sizeof(uint64_t));
+      out.write(reinterpret_cast<const char*>(entry_table.data()), entry_table.size() * sizeof(Entry));
+      out.write(reinterpret_cast<const char*>(version_table.data()), version_table.size() * sizeof(StringRef));
+      out.write(string_table.data(), string_table.size());
+      if (!out) {
+        return false;
+      }
+    }
+    std::filesystem::rename(tmp, output, ec);
+    return !ec;
+  }
+
+  // Commit currently checked out in a git repository, read straight
+  // from .git so checking if the compiled index is stale is cheap.
+  static std::string get_checkout_commit(const std::filesystem::path& repo) {
+    auto git_dir = repo / ".git";
+    auto head = read_line(git_dir / "HEAD");
+    if (head.compare(0, 5, "ref: ") != 0) {
+      return head;
+    }
+    auto ref = head.substr(5);
+    auto commit = read_line(git_dir / ref);
+    if (!commit.empty()) {
+      return commit;
+    }
+    std::ifstream packed(git_dir / "packed-refs");
+    std::string line;
+    while (std::getline(packed, line)) {
+      auto pos = line.find(' ');
+      if (pos != std::string::npos && line.compare(pos + 1, std::string::npos, ref) == 0) {
+        return line.substr(0, pos);
+      }
+    }
+    return "";
+  }
+private:
+  static std::string read_line(const std::filesystem::path& path) {
+    std::ifstream f(path);
+    std::string line;
+    std::getline(f, line);
+    while (!line.empty() && isspace((unsigned char)line.back())) {
+      line.pop_back();
+    }
+    return line;
+  }
+
+  static uint64_t hash(std::string_view str) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (auto c : str) {
+      h ^= (unsigned char)c;
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+
+  static void add_to_bloom(uint64_t* bloom, uint32_t words, std::string_view name) {
+    auto h = hash(name);
+    uint64_t bits = (uint64_t)words * 64;
+    for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+      auto bit = (h + i * ((h >> 32) | 1)) % bits;
+      bloom[bit / 64] |= 1ull << (bit % 64);
+    }
+  }
+
+  static bool may_contain(const uint64_t* bloom, uint32_t words, std::string_view name) {
+    auto h = hash(name);
+    uint64_t bits = (uint64_t)words * 64;
+    for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+      auto bit = (h + i * ((h >> 32) | 1)) % bits;
+      if (!(bloom[bit / 64] & (1ull << (bit % 64)))) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+}
+}
+
+#endif // __REKY_INDEX_H__
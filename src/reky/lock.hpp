@@ -0,0 +1,141 @@
+
+#ifndef __REKY_LOCK_H__
+#define __REKY_LOCK_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+
+#ifndef REKY_LOCK_FILE
+#define REKY_LOCK_FILE "reky.lock"
+#endif
+
+namespace snowball {
+namespace reky {
+
+struct LockedPackage final {
+  std::string version;
+  // Commit the version resolved to when it was installed
+  std::string commit;
+  // Digest of the installed sources
+  std::string digest;
+};
+
+// Everything needed to rebuild a resolution without resolving again:
+// the packages with their resolved commits, the dependency edges and a
+// fingerprint of every sn.reky file that took part in the resolution.
+struct Lockfile final {
+  static constexpr int FORMAT_VERSION = 1;
+
+  std::vector<std::string> roots;
+  // Ordered maps, so the file doesn't change between runs for no reason
+  std::map<std::string, LockedPackage> packages;
+  std::map<std::string, std::vector<std::string>> graph;
+  std::map<std::string, std::string> fingerprints;
+
+  static std::optional<Lockfile> load(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+      return std::nullopt;
+    }
+    auto data = nlohmann::json::parse(file, nullptr, false);
+    if (data.is_discarded() || !data.is_object() || data.value("version", 0) != FORMAT_VERSION) {
+      return std::nullopt;
+    }
+    Lockfile lock;
+    lock.roots = data.value("roots", std::vector<std::string>());
+    lock.graph = data.value("graph", std::map<std::string, std::vector<std::string>>());
+    lock.fingerprints = data.value("fingerprints", std::map<std::string, std::string>());
+    auto packages_data = data.value("packages", nlohmann::json::object());
+    for (auto& [name, package] : packages_data.items()) {
+      lock.packages[name] = LockedPackage{
+        package.value("version", ""),
+        package.value("commit", ""),
+        package.value("digest", "")
+      };
+    }
+    return lock;
+  }
+
+  std::string dump() const {
+    nlohmann::json data;
+    data["version"] = FORMAT_VERSION;
+    data["roots"] = roots;
+    data["graph"] = graph;
+    data["fingerprints"] = fingerprints;
+    auto& packages_data = data["packages"] = nlohmann::json::object();
+    for (auto& [name, package] : packages) {
+      packages_data[name] = {
+        {"version", package.version},
+        {"commit", package.commit},
+        {"digest", package.digest}
+      };
+    }
+    return data.dump(2) + "\n";
+  }
+
+  // Every sn.reky that contributed to the resolution still has
+  // the content it had when the lock was written.
+  bool is_fresh() const {
+    for (auto& [path, fingerprint] : fingerprints) {
+      if (get_fingerprint(path) != fingerprint) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static std::string get_fingerprint(const std::filesystem::path& file) {
+    std::ifstream f(file, std::ios::binary);
+    if (!f.is_open()) {
+      return "";
+    }
+    std::string content((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    return fmt::format("{:016x}", hash(content));
+  }
+
+  // Digest of a source tree, stable across machines: every file
+  // is hashed together with its path, in sorted order.
+  static std::string get_tree_digest(const std::filesystem::path& root) {
+    std::vector<std::filesystem::path> files;
+    std::error_code ec;
+    for (auto& entry : std::filesystem::recursive_directory_iterator(root, ec)) {
+      if (entry.is_regular_file(ec)) {
+        files.push_back(entry.path());
+      }
+    }
+    std::sort(files.begin(), files.end());
+    uint64_t digest = hash("");
+    for (auto& file : files) {
+      auto relative = std::filesystem::relative(file, root, ec).generic_string();
+      std::ifstream f(file, std::ios::binary);
+      std::string content((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+      digest = hash(relative, digest);
+      digest = hash(content, digest);
+    }
+    return fmt::format("{:016x}", digest);
+  }
+
+  static uint64_t hash(std::string_view data, uint64_t h = 14695981039346656037ull) {
+    // FNV-1a
+    for (auto c : data) {
+      h ^= (unsigned char)c;
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+};
+
+}
+}
+
+#endif // __REKY_LOCK_H__
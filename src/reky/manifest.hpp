@@ -0,0 +1,172 @@
+
+#ifndef __REKY_MANIFEST_H__
+#define __REKY_MANIFEST_H__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <optional>
+#include <filesystem>
+#include <string_view>
+
+#include "reky/file.hpp"
+
+#ifndef REKY_MANIFEST_FILE
+#define REKY_MANIFEST_FILE ".reky_manifest"
+#endif
+
+namespace snowball {
+namespace reky {
+
+struct ManifestEntry final {
+  std::string name;
+  std::string version;
+  std::string commit;
+  // Key of the subpaths installed, empty if it's the whole tree
+  std::string paths;
+};
+
+// What is installed in the Deps workspace, keyed by the folder (hash)
+// each package lives in. It's read once, updated in memory by every
+// install and written back atomically:
+//   <hash>\t<name>\t<version>\t<commit>\t<paths key>
+// Other builds of the same workspace may save it too, so only the
+// entries this process changed are written over what's on disk.
+class DepsManifest final {
+  std::filesystem::path path;
+  // Ordered, so saving an unchanged manifest produces the same bytes
+  std::map<std::string, ManifestEntry> entries;
+  // Not saved yet, nullopt for removed entries
+  std::map<std::string, std::optional<ManifestEntry>> changes;
+  mutable std::mutex mutex;
+public:
+  void load(const std::filesystem::path& file) {
+    std::lock_guard<std::mutex> lock(mutex);
+    path = file;
+    changes.clear();
+    read_entries();
+  }
+
+  // Pick up what other processes saved since, keeping our own changes
+  void refresh() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (path.empty()) {
+      return;
+    }
+    read_entries();
+    apply_changes();
+  }
+
+  std::optional<ManifestEntry> get(const std::string& hash) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(hash);
+    if (it == entries.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  void set(const std::string& hash, ManifestEntry entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[hash] = entry;
+    changes[hash] = std::move(entry);
+  }
+
+  void remove(const std::string& hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.erase(hash) > 0) {
+      changes[hash] = std::nullopt;
+    }
+  }
+
+  bool save() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (changes.empty() || path.empty()) {
+      return false;
+    }
+    // Read, merge and write with nobody else doing the same
+    FileLock file_lock;
+    file_lock.lock(path.string() + ".lock");
+    read_entries();
+    apply_changes();
+    changes.clear();
+    std::string buffer;
+    for (auto& [hash, entry] : entries) {
+      buffer += format_line(hash, entry);
+    }
+    return AtomicFile::write(path, buffer);
+  }
+
+  static std::string format_line(const std::string& hash, const ManifestEntry& entry) {
+    std::string line = hash;
+    line += '\t';
+    line += entry.name;
+    line += '\t';
+    line += entry.version;
+    line += '\t';
+    line += entry.commit;
+    if (!entry.paths.empty()) {
+      line += '\t';
+      line += entry.paths;
+    }
+    line += '\n';
+    return line;
+  }
+
+  // Nothing if the line is empty or broken
+  static std::optional<std::pair<std::string, ManifestEntry>> parse_line(std::string_view line) {
+    if (!line.empty() && line.back() == '\n') {
+      line.remove_suffix(1);
+    }
+    std::string_view fields[5];
+    size_t count = 0;
+    while (count < 5) {
+      auto tab = line.find('\t');
+      fields[count++] = line.substr(0, tab);
+      if (tab == std::string_view::npos) {
+        break;
+      }
+      line = line.substr(tab + 1);
+    }
+    if (count < 2 || fields[0].empty()) {
+      return std::nullopt;
+    }
+    return std::make_pair(std::string(fields[0]), ManifestEntry{
+      std::string(fields[1]), std::string(fields[2]), std::string(fields[3]), std::string(fields[4])
+    });
+  }
+private:
+  void apply_changes() {
+    for (auto& [hash, entry] : changes) {
+      if (entry.has_value()) {
+        entries[hash] = entry.value();
+      } else {
+        entries.erase(hash);
+      }
+    }
+  }
+
+  void read_entries() {
+    entries.clear();
+    auto content = AtomicFile::read(path);
+    if (!content.has_value()) {
+      return;
+    }
+    std::string_view rest = content.value();
+    while (!rest.empty()) {
+      auto newline = rest.find('\n');
+      auto line = rest.substr(0, newline);
+      rest = newline == std::string_view::npos ? std::string_view() : rest.substr(newline + 1);
+      auto parsed = parse_line(line);
+      if (parsed.has_value()) {
+        entries[std::move(parsed->first)] = std::move(parsed->second);
+      }
+    }
+  }
+};
+
+}
+}
+
+#endif // __REKY_MANIFEST_H__
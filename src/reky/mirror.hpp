@@ -0,0 +1,84 @@
+
+#ifndef __REKY_MIRROR_H__
+#define __REKY_MIRROR_H__
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <filesystem>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "compiler/utils/hash.h"
+
+#include "reky/file.hpp"
+
+#ifndef REKY_MIRRORS_DIR
+#define REKY_MIRRORS_DIR "mirrors"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// A bare mirror of every upstream git repository packages come from:
+//   <home>/mirrors/<url hash>.git
+// Cloned once, after that a new version only fetches the objects
+// the mirror doesn't have yet.
+class MirrorCache final {
+  std::filesystem::path root;
+public:
+  // Threads of this process queue on the mutex, so only one of
+  // them at a time waits on the file lock other processes hold
+  struct Lock final {
+    std::unique_lock<std::mutex> thread;
+    FileLock process;
+  };
+
+  explicit MirrorCache(const std::filesystem::path& root) : root(root) {}
+
+  std::filesystem::path get_path(const std::string& url) const {
+    return root / (utils::hash::hashString(url) + ".git");
+  }
+
+  // git can't update the refs of a repository from two processes at
+  // once, so every operation on a mirror holds its lock. Shared by
+  // every manager in the process (the daemon runs one per request)
+  // and by other processes using the same home.
+  Lock lock(const std::string& url) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<std::mutex>> locks;
+    std::unique_lock<std::mutex> guard(mutex);
+    auto& lock = locks[url];
+    if (!lock) {
+      lock = std::make_unique<std::mutex>();
+    }
+    auto& mirror_mutex = *lock;
+    guard.unlock();
+    Lock result{std::unique_lock<std::mutex>(mirror_mutex), FileLock()};
+    result.process.lock(get_lock_path(url));
+    return result;
+  }
+
+  std::filesystem::path get_lock_path(const std::string& url) const {
+    return root / REKY_LOCKS_DIR / (utils::hash::hashString(url) + ".lock");
+  }
+
+  // New mirrors are cloned here and renamed into place once complete
+  std::filesystem::path get_staging() const {
+    static std::atomic<unsigned int> counter = 0;
+    auto staging = root / ".staging";
+    std::filesystem::create_directories(staging);
+    auto thread_id = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return staging / fmt::format("{}-{}-{}", getpid(), thread_id, counter++);
+  }
+};
+
+}
+}
+
+#endif // __REKY_MIRROR_H__
@@ -0,0 +1,184 @@
+
+#ifndef __REKY_POOL_H__
+#define __REKY_POOL_H__
+
+#include <queue>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <future>
+#include <string>
+#include <utility>
+#include <exception>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#ifndef REKY_DEFAULT_JOBS
+// 0 means "use as many jobs as hardware threads"
+#define REKY_DEFAULT_JOBS 0
+#endif
+
+namespace snowball {
+namespace reky {
+
+// Fixed size pool of workers used to run independent
+// jobs (e.g. package installs) at the same time. A job that throws
+// doesn't take the process down: the first exception is rethrown
+// by wait(), on the caller's thread.
+class WorkerPool final {
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable job_available;
+  std::condition_variable jobs_done;
+  size_t running = 0;
+  bool stopping = false;
+  bool cancelled = false;
+  std::exception_ptr failure;
+public:
+  explicit WorkerPool(unsigned int size) {
+    size = std::max(1u, size);
+    workers.reserve(size);
+    for (unsigned int i = 0; i < size; i++) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    job_available.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Ignored once the pool was cancelled
+  void submit(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (cancelled) {
+        return;
+      }
+      jobs.push(std::move(job));
+    }
+    job_available.notify_one();
+  }
+
+  // Drop every job that hasn't started yet, returns how many. Jobs
+  // that are running can't queue new ones anymore.
+  size_t cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+    auto dropped = jobs.size();
+    jobs = {};
+    if (running == 0) {
+      jobs_done.notify_all();
+    }
+    return dropped;
+  }
+
+  // Block until every submitted job has finished, then rethrow
+  // the first exception one of them threw, if any
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobs_done.wait(lock, [this] { return jobs.empty() && running == 0; });
+    if (failure) {
+      std::rethrow_exception(std::exchange(failure, nullptr));
+    }
+  }
+
+  size_t size() const {
+    return workers.size();
+  }
+
+  static unsigned int resolve_jobs(unsigned int jobs) {
+    if (jobs != 0) {
+      return jobs;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+private:
+  void work() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_available.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty()) {
+          return;
+        }
+        job = std::move(jobs.front());
+        jobs.pop();
+        running++;
+      }
+      std::exception_ptr error;
+      try {
+        job();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error && !failure) {
+          failure = error;
+        }
+        running--;
+        if (jobs.empty() && running == 0) {
+          jobs_done.notify_all();
+        }
+      }
+    }
+  }
+};
+
+// Work that is running right now, by key. Whoever asks for a key that
+// is already being worked on waits for that result instead of doing
+// the same work again, e.g. two workspaces installing the same package.
+template <typename T>
+class InFlight final {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_future<T>> running;
+public:
+  template <typename F>
+  T run(const std::string& key, F&& work) {
+    std::promise<T> promise;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto it = running.find(key);
+      if (it != running.end()) {
+        auto result = it->second;
+        lock.unlock();
+        return result.get();
+      }
+      running.emplace(key, promise.get_future().share());
+    }
+    try {
+      auto result = work();
+      promise.set_value(result);
+      finish(key);
+      return result;
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+      finish(key);
+      throw;
+    }
+  }
+private:
+  void finish(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    running.erase(key);
+  }
+};
+
+}
+}
+
+#endif // __REKY_POOL_H__
@@ -0,0 +1,331 @@
+
+#ifndef __REKY_PROCESS_H__
+#define __REKY_PROCESS_H__
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <optional>
+#include <algorithm>
+
+#include <cerrno>
+
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace snowball {
+namespace reky {
+
+struct ProcessResult final {
+  // -1 if the process couldn't be started or was killed by a signal
+  int exit_code = -1;
+  std::string out;
+  std::string err;
+  std::chrono::nanoseconds elapsed = std::chrono::nanoseconds(0);
+
+  bool ok() const {
+    return exit_code == 0;
+  }
+};
+
+// A child process started without going through a shell. Output
+// is either captured through pipes or sent to /dev/null.
+class Process final {
+  pid_t pid = -1;
+  int out_fd = -1;
+  int err_fd = -1;
+  bool finished = false;
+  std::chrono::steady_clock::time_point started;
+  ProcessResult result;
+public:
+  Process() = default;
+  Process(const Process&) = delete;
+  Process& operator=(const Process&) = delete;
+
+  Process(Process&& other) noexcept {
+    *this = std::move(other);
+  }
+
+  Process& operator=(Process&& other) noexcept {
+    std::swap(pid, other.pid);
+    std::swap(out_fd, other.out_fd);
+    std::swap(err_fd, other.err_fd);
+    std::swap(finished, other.finished);
+    std::swap(started, other.started);
+    std::swap(result, other.result);
+    return *this;
+  }
+
+  // Not waiting for the child means nobody wants its result: it's
+  // killed and reaped here, instead of staying around as a zombie
+  // until we exit (forever, in the daemon).
+  ~Process() {
+    close_fd(out_fd);
+    close_fd(err_fd);
+    if (is_running()) {
+      ::kill(pid, SIGKILL);
+      int status;
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    }
+  }
+
+  bool is_running() const {
+    return pid > 0 && !finished;
+  }
+
+  pid_t get_pid() const {
+    return pid;
+  }
+
+  static Process spawn(const std::vector<std::string>& args, bool capture = false) {
+    return spawn(args, capture, -1, -1);
+  }
+
+  // Same as above, but stdin and/or stdout can be connected to
+  // existing file descriptors (-1 keeps the default behaviour).
+  static Process spawn(const std::vector<std::string>& args, bool capture, int stdin_fd, int stdout_fd) {
+    Process process;
+    process.started = std::chrono::steady_clock::now();
+    if (args.empty()) {
+      process.finished = true;
+      return process;
+    }
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
+    if (capture && pipe2(err_pipe, O_CLOEXEC) != 0) {
+      capture = false;
+    }
+    if (capture && stdout_fd < 0 && pipe2(out_pipe, O_CLOEXEC) != 0) {
+      close_fd(err_pipe[0]);
+      close_fd(err_pipe[1]);
+      capture = false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_fd >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    } else {
+      posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    if (stdout_fd >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+    } else if (capture) {
+      posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    } else {
+      posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+    if (capture) {
+      posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+    } else {
+      posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (auto& arg : args) {
+      argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    int status = posix_spawnp(&process.pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close_fd(out_pipe[1]);
+    close_fd(err_pipe[1]);
+    process.out_fd = out_pipe[0];
+    process.err_fd = err_pipe[0];
+    for (int fd : {process.out_fd, process.err_fd}) {
+      if (fd >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+      }
+    }
+    if (status != 0) {
+      process.pid = -1;
+      process.finished = true;
+      close_fd(process.out_fd);
+      close_fd(process.err_fd);
+    }
+    return process;
+  }
+
+  // Connect the stdout of every command to the stdin of the next
+  // one, like a shell pipeline. Only stderr is captured.
+  static std::vector<Process> spawn_pipeline(const std::vector<std::vector<std::string>>& commands) {
+    std::vector<Process> processes;
+    int input = -1;
+    for (size_t i = 0; i < commands.size(); i++) {
+      int fds[2] = {-1, -1};
+      if (i + 1 < commands.size() && pipe2(fds, O_CLOEXEC) != 0) {
+        close_fd(input);
+        break;
+      }
+      processes.push_back(spawn(commands[i], true, input, fds[1]));
+      close_fd(input);
+      close_fd(fds[1]);
+      input = fds[0];
+    }
+    close_fd(input);
+    return processes;
+  }
+
+  // Non-blocking: collect whatever output is available and
+  // check if the process has exited.
+  bool try_wait() {
+    if (finished || pid <= 0) {
+      return true;
+    }
+    read_available();
+    int status;
+    auto waited = waitpid(pid, &status, WNOHANG);
+    if (waited == 0) {
+      return false;
+    }
+    finish(waited == pid ? status : -1);
+    return true;
+  }
+
+  ProcessResult& wait() {
+    while (!finished && pid > 0 && (out_fd >= 0 || err_fd >= 0)) {
+      struct pollfd fds[2];
+      int count = get_poll_fds(fds);
+      if (poll(fds, count, -1) < 0 && errno != EINTR) {
+        break;
+      }
+      read_available();
+    }
+    if (!finished && pid > 0) {
+      int status;
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+      finish(status);
+    }
+    return result;
+  }
+
+  ProcessResult& get_result() {
+    return result;
+  }
+
+  // File descriptors that will have data to read. Used to
+  // wait for many processes at the same time.
+  int get_poll_fds(struct pollfd* fds) const {
+    int count = 0;
+    for (int fd : {out_fd, err_fd}) {
+      if (fd >= 0) {
+        fds[count++] = {fd, POLLIN, 0};
+      }
+    }
+    return count;
+  }
+
+  // Run every command with at most `max_parallel` of them alive at a time.
+  // Results are returned in the same order as the commands.
+  static std::vector<ProcessResult> run_all(const std::vector<std::vector<std::string>>& commands,
+                                            size_t max_parallel, bool capture = false) {
+    std::vector<ProcessResult> results(commands.size());
+    std::vector<std::pair<size_t, Process>> running;
+    size_t next = 0;
+    max_parallel = std::max<size_t>(1, max_parallel);
+    while (next < commands.size() || !running.empty()) {
+      while (next < commands.size() && running.size() < max_parallel) {
+        running.emplace_back(next, spawn(commands[next], capture));
+        next++;
+      }
+      std::vector<struct pollfd> fds;
+      for (auto& [i, process] : running) {
+        struct pollfd process_fds[2];
+        int count = process.get_poll_fds(process_fds);
+        fds.insert(fds.end(), process_fds, process_fds + count);
+      }
+      // Without pipes to wake us up there's nothing better than a short sleep
+      poll(fds.data(), fds.size(), fds.empty() ? 5 : 50);
+      for (auto it = running.begin(); it != running.end();) {
+        if (it->second.try_wait()) {
+          results[it->first] = std::move(it->second.get_result());
+          it = running.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    return results;
+  }
+private:
+  static void close_fd(int& fd) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    fd = -1;
+  }
+
+  void read_available() {
+    read_fd(out_fd, result.out);
+    read_fd(err_fd, result.err);
+  }
+
+  static void read_fd(int& fd, std::string& output) {
+    if (fd < 0) {
+      return;
+    }
+    char buffer[4096];
+    while (true) {
+      auto n = read(fd, buffer, sizeof(buffer));
+      if (n > 0) {
+        output.append(buffer, n);
+      } else if (n == 0) {
+        close_fd(fd);
+        return;
+      } else if (errno == EINTR) {
+        continue;
+      } else {
+        // EAGAIN: nothing more for now
+        return;
+      }
+    }
+  }
+
+  void finish(int status) {
+    // The child is gone, so whatever is left in the pipes is all there is
+    for (int* fd : {&out_fd, &err_fd}) {
+      if (*fd >= 0) {
+        fcntl(*fd, F_SETFL, 0);
+      }
+    }
+    read_available();
+    close_fd(out_fd);
+    close_fd(err_fd);
+    finished = true;
+    result.exit_code = (status >= 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+    result.elapsed = std::chrono::steady_clock::now() - started;
+  }
+};
+
+// Timing of every process started by a manager
+struct ProcessTiming final {
+  std::vector<std::string> args;
+  int exit_code;
+  std::chrono::nanoseconds elapsed;
+};
+
+class ProcessLog final {
+  std::mutex mutex;
+  std::vector<ProcessTiming> timings;
+public:
+  void record(const std::vector<std::string>& args, const ProcessResult& result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    timings.push_back({args, result.exit_code, result.elapsed});
+  }
+
+  std::vector<ProcessTiming> get_timings() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return timings;
+  }
+};
+
+}
+}
+
+#endif // __REKY_PROCESS_H__
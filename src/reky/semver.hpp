@@ -0,0 +1,578 @@
+
+#ifndef __REKY_SEMVER_H__
+#define __REKY_SEMVER_H__
+
+#include <cctype>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <string_view>
+
+#include <fmt/format.h>
+
+namespace snowball {
+namespace reky {
+
+// A semantic version (https://semver.org). Build metadata is
+// accepted but ignored, it doesn't take part in precedence.
+struct Version final {
+  uint64_t major = 0;
+  uint64_t minor = 0;
+  uint64_t patch = 0;
+  std::vector<std::string> prerelease;
+
+  // Accepts "1.2.3", "v1.2.3", "1.2" and "1" (missing parts are 0) with
+  // an optional "-pre.release" and "+build". `parts` is set to how many
+  // numbers were actually written, ranges like "^1.2" depend on it.
+  static std::optional<Version> parse(std::string_view text, size_t* parts = nullptr) {
+    if (!text.empty() && (text[0] == 'v' || text[0] == 'V')) {
+      text.remove_prefix(1);
+    }
+    Version version;
+    uint64_t* numbers[3] = {&version.major, &version.minor, &version.patch};
+    size_t count = 0;
+    size_t pos = 0;
+    while (count < 3) {
+      size_t start = pos;
+      uint64_t value = 0;
+      while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9' && pos - start < 18) {
+        value = value * 10 + (text[pos] - '0');
+        pos++;
+      }
+      if (pos == start || (pos - start > 1 && text[start] == '0')) {
+        return std::nullopt;
+      }
+      *numbers[count++] = value;
+      if (pos < text.size() && text[pos] == '.' && count < 3) {
+        pos++;
+        continue;
+      }
+      break;
+    }
+    if (pos < text.size() && text[pos] == '-') {
+      auto end = text.find('+', pos);
+      auto pre = text.substr(pos + 1, end == std::string_view::npos ? std::string_view::npos : end - pos - 1);
+      if (!split_identifiers(pre, version.prerelease)) {
+        return std::nullopt;
+      }
+      pos += pre.size() + 1;
+    }
+    if (pos < text.size() && text[pos] == '+') {
+      std::vector<std::string> build;
+      if (!split_identifiers(text.substr(pos + 1), build)) {
+        return std::nullopt;
+      }
+      pos = text.size();
+    }
+    if (pos != text.size()) {
+      return std::nullopt;
+    }
+    if (parts) {
+      *parts = count;
+    }
+    return version;
+  }
+
+  static int compare(const Version& a, const Version& b) {
+    if (a.major != b.major) {
+      return a.major < b.major ? -1 : 1;
+    }
+    if (a.minor != b.minor) {
+      return a.minor < b.minor ? -1 : 1;
+    }
+    if (a.patch != b.patch) {
+      return a.patch < b.patch ? -1 : 1;
+    }
+    // A pre-release comes before the release it belongs to
+    if (a.prerelease.empty() || b.prerelease.empty()) {
+      return (int)a.prerelease.empty() - (int)b.prerelease.empty();
+    }
+    for (size_t i = 0; i < a.prerelease.size() && i < b.prerelease.size(); i++) {
+      auto result = compare_identifier(a.prerelease[i], b.prerelease[i]);
+      if (result != 0) {
+        return result;
+      }
+    }
+    if (a.prerelease.size() == b.prerelease.size()) {
+      return 0;
+    }
+    return a.prerelease.size() < b.prerelease.size() ? -1 : 1;
+  }
+
+  bool operator<(const Version& other) const {
+    return compare(*this, other) < 0;
+  }
+
+  bool operator==(const Version& other) const {
+    return compare(*this, other) == 0;
+  }
+
+  bool is_prerelease() const {
+    return !prerelease.empty();
+  }
+
+  std::string to_string() const {
+    auto result = fmt::format("{}.{}.{}", major, minor, patch);
+    for (size_t i = 0; i < prerelease.size(); i++) {
+      result += (i == 0 ? '-' : '.');
+      result += prerelease[i];
+    }
+    return result;
+  }
+private:
+  static bool split_identifiers(std::string_view text, std::vector<std::string>& out) {
+    while (true) {
+      auto dot = text.find('.');
+      auto identifier = text.substr(0, dot);
+      if (identifier.empty()) {
+        return false;
+      }
+      for (auto c : identifier) {
+        if (!isalnum((unsigned char)c) && c != '-') {
+          return false;
+        }
+      }
+      out.emplace_back(identifier);
+      if (dot == std::string_view::npos) {
+        return true;
+      }
+      text.remove_prefix(dot + 1);
+    }
+  }
+
+  static bool is_numeric(const std::string& str) {
+    return std::all_of(str.begin(), str.end(), [](char c) { return c >= '0' && c <= '9'; });
+  }
+
+  // Numeric identifiers compare as numbers and sort before alphanumeric ones
+  static int compare_identifier(const std::string& a, const std::string& b) {
+    bool a_numeric = is_numeric(a);
+    bool b_numeric = is_numeric(b);
+    if (a_numeric && b_numeric && a.size() != b.size()) {
+      return a.size() < b.size() ? -1 : 1;
+    }
+    if (a_numeric != b_numeric) {
+      return a_numeric ? -1 : 1;
+    }
+    return a.compare(b) < 0 ? -1 : (a == b ? 0 : 1);
+  }
+};
+
+// What a sn.reky entry asks for:
+//   1.2.3, =1.2.3    exactly that version
+//   ^1.2.3           compatible updates, >=1.2.3 <2.0.0 (<0.3.0 on 0.x)
+//   ~1.2.3           patch updates, >=1.2.3 <1.3.0
+//   >=1.0 <2.0       comparators, separated by spaces or commas, all have to match
+//   *                any version
+// Pre-releases only match if one of the comparators names a pre-release.
+// Versions that aren't semver (a branch, a custom tag) can only be asked
+// for exactly.
+class Requirement final {
+  std::optional<Version> lower;
+  bool lower_inclusive = true;
+  std::optional<Version> upper;
+  bool upper_inclusive = false;
+  bool allow_prerelease = false;
+  std::optional<std::string> exact;
+  std::string text;
+public:
+  static std::optional<Requirement> parse(std::string_view text) {
+    Requirement requirement;
+    requirement.text = std::string(text);
+    std::vector<std::string_view> tokens;
+    size_t pos = 0;
+    while (pos < text.size()) {
+      while (pos < text.size() && (text[pos] == ' ' || text[pos] == ',' || text[pos] == '\t')) {
+        pos++;
+      }
+      auto start = pos;
+      while (pos < text.size() && text[pos] != ' ' && text[pos] != ',' && text[pos] != '\t') {
+        pos++;
+      }
+      if (pos > start) {
+        tokens.push_back(text.substr(start, pos - start));
+      }
+    }
+    if (tokens.empty()) {
+      return std::nullopt;
+    }
+    if (tokens.size() == 1 && !is_operator_start(tokens[0][0]) && !Version::parse(tokens[0]).has_value()) {
+      // Not semver, only this exact version will do
+      requirement.exact = std::string(tokens[0]);
+      return requirement;
+    }
+    for (size_t i = 0; i < tokens.size(); i++) {
+      auto token = tokens[i];
+      auto op = token.substr(0, get_operator_size(token));
+      auto version_text = token.substr(op.size());
+      if (version_text.empty() && op != "*" && i + 1 < tokens.size()) {
+        // ">= 1.0", with a space between the operator and the version
+        version_text = tokens[++i];
+      }
+      if (op == "*") {
+        if (!version_text.empty()) {
+          return std::nullopt;
+        }
+        continue;
+      }
+      size_t parts = 0;
+      auto version = Version::parse(version_text, &parts);
+      if (!version.has_value()) {
+        return std::nullopt;
+      }
+      requirement.allow_prerelease |= version->is_prerelease();
+      if (op.empty() || op == "=") {
+        requirement.set_lower(version.value(), true);
+        requirement.set_upper(version.value(), true);
+      } else if (op == ">=" || op == ">") {
+        requirement.set_lower(version.value(), op == ">=");
+      } else if (op == "<=" || op == "<") {
+        requirement.set_upper(version.value(), op == "<=");
+      } else if (op == "^") {
+        requirement.set_lower(version.value(), true);
+        requirement.set_upper(get_caret_upper(version.value(), parts), false);
+      } else if (op == "~") {
+        requirement.set_lower(version.value(), true);
+        requirement.set_upper(get_tilde_upper(version.value(), parts), false);
+      } else {
+        return std::nullopt;
+      }
+    }
+    return requirement;
+  }
+
+  bool matches(const Version& version) const {
+    if (exact.has_value()) {
+      return false;
+    }
+    if (version.is_prerelease() && !allow_prerelease) {
+      return false;
+    }
+    if (lower.has_value()) {
+      auto result = Version::compare(version, lower.value());
+      if (result < 0 || (result == 0 && !lower_inclusive)) {
+        return false;
+      }
+    }
+    if (upper.has_value()) {
+      auto result = Version::compare(version, upper.value());
+      if (result > 0 || (result == 0 && !upper_inclusive)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const std::optional<Version>& get_lower() const { return lower; }
+  bool is_lower_inclusive() const { return lower_inclusive; }
+  const std::optional<Version>& get_upper() const { return upper; }
+  bool is_upper_inclusive() const { return upper_inclusive; }
+  bool allows_prerelease() const { return allow_prerelease; }
+  const std::optional<std::string>& get_exact() const { return exact; }
+  const std::string& get_text() const { return text; }
+private:
+  static bool is_operator_start(char c) {
+    return c == '^' || c == '~' || c == '>' || c == '<' || c == '=' || c == '*';
+  }
+
+  static size_t get_operator_size(std::string_view token) {
+    if (token.size() >= 2 && (token[0] == '>' || token[0] == '<') && token[1] == '=') {
+      return 2;
+    }
+    return is_operator_start(token[0]) ? 1 : 0;
+  }
+
+  // Keep the tightest bound, exclusive wins over inclusive on the same version
+  void set_lower(const Version& version, bool inclusive) {
+    auto result = lower.has_value() ? Version::compare(version, lower.value()) : 1;
+    if (result > 0 || (result == 0 && !inclusive)) {
+      lower = version;
+      lower_inclusive = inclusive;
+    }
+  }
+
+  void set_upper(const Version& version, bool inclusive) {
+    auto result = upper.has_value() ? Version::compare(version, upper.value()) : -1;
+    if (result < 0 || (result == 0 && !inclusive)) {
+      upper = version;
+      upper_inclusive = inclusive;
+    }
+  }
+
+  static Version get_caret_upper(const Version& version, size_t parts) {
+    if (version.major > 0 || parts == 1) {
+      return Version{version.major + 1, 0, 0, {}};
+    }
+    if (version.minor > 0 || parts == 2) {
+      return Version{0, version.minor + 1, 0, {}};
+    }
+    return Version{0, 0, version.patch + 1, {}};
+  }
+
+  static Version get_tilde_upper(const Version& version, size_t parts) {
+    if (parts == 1) {
+      return Version{version.major + 1, 0, 0, {}};
+    }
+    return Version{version.major, version.minor + 1, 0, {}};
+  }
+};
+
+// A subset of the versions of one package, as one bit per version
+// of its catalog. Sets of the same package can be combined with
+// plain word operations.
+class VersionSet final {
+  std::vector<uint64_t> words;
+  size_t bits = 0;
+public:
+  VersionSet() = default;
+
+  explicit VersionSet(size_t bits, bool full = false) : words((bits + 63) / 64, full ? ~0ull : 0), bits(bits) {
+    trim();
+  }
+
+  size_t size() const {
+    return bits;
+  }
+
+  bool test(size_t i) const {
+    return (words[i / 64] >> (i % 64)) & 1;
+  }
+
+  void set(size_t i) {
+    words[i / 64] |= 1ull << (i % 64);
+  }
+
+  void reset(size_t i) {
+    words[i / 64] &= ~(1ull << (i % 64));
+  }
+
+  // Set every bit in [from, to)
+  void set_range(size_t from, size_t to) {
+    for (; from < to && from % 64 != 0; from++) {
+      set(from);
+    }
+    for (; from + 64 <= to; from += 64) {
+      words[from / 64] = ~0ull;
+    }
+    for (; from < to; from++) {
+      set(from);
+    }
+  }
+
+  size_t count() const {
+    size_t total = 0;
+    for (auto word : words) {
+      total += __builtin_popcountll(word);
+    }
+    return total;
+  }
+
+  bool empty() const {
+    return std::all_of(words.begin(), words.end(), [](uint64_t word) { return word == 0; });
+  }
+
+  // Index of the highest bit set below `limit`, or `npos`
+  size_t highest(size_t limit = SIZE_MAX) const {
+    limit = std::min(limit, bits);
+    for (size_t i = limit; i-- > 0;) {
+      if (i % 64 == 63 && words[i / 64] == 0) {
+        i -= 63;
+        continue;
+      }
+      if (test(i)) {
+        return i;
+      }
+    }
+    return npos;
+  }
+
+  VersionSet operator&(const VersionSet& other) const {
+    VersionSet result(*this);
+    for (size_t i = 0; i < words.size(); i++) {
+      result.words[i] &= other.words[i];
+    }
+    return result;
+  }
+
+  VersionSet operator|(const VersionSet& other) const {
+    VersionSet result(*this);
+    for (size_t i = 0; i < words.size(); i++) {
+      result.words[i] |= other.words[i];
+    }
+    return result;
+  }
+
+  VersionSet operator~() const {
+    VersionSet result(*this);
+    for (auto& word : result.words) {
+      word = ~word;
+    }
+    result.trim();
+    return result;
+  }
+
+  bool operator==(const VersionSet& other) const {
+    return bits == other.bits && words == other.words;
+  }
+
+  bool is_subset_of(const VersionSet& other) const {
+    for (size_t i = 0; i < words.size(); i++) {
+      if (words[i] & ~other.words[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool intersects(const VersionSet& other) const {
+    for (size_t i = 0; i < words.size(); i++) {
+      if (words[i] & other.words[i]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static constexpr size_t npos = SIZE_MAX;
+private:
+  // Bits past the end must stay clear, or counts and compares break
+  void trim() {
+    if (bits % 64 != 0 && !words.empty()) {
+      words.back() &= (1ull << (bits % 64)) - 1;
+    }
+  }
+};
+
+// Every version of a package sorted by precedence, so a requirement
+// becomes a contiguous slice found with two binary searches. Versions
+// that aren't semver come after the sorted ones, ordered by name.
+class VersionCatalog final {
+  std::vector<std::string> names;
+  // The parsed form of the first `versions.size()` names
+  std::vector<Version> versions;
+  std::vector<size_t> prereleases;
+public:
+  VersionCatalog() = default;
+
+  explicit VersionCatalog(std::vector<std::string> list) {
+    sort(list);
+    names.reserve(list.size());
+    std::vector<std::string> others;
+    for (auto& name : list) {
+      auto version = Version::parse(name);
+      if (!version.has_value()) {
+        others.push_back(std::move(name));
+        continue;
+      }
+      // "1.0" and "1.0.0" are the same version, the first one wins
+      if (!versions.empty() && versions.back() == version.value()) {
+        continue;
+      }
+      if (version->is_prerelease()) {
+        prereleases.push_back(versions.size());
+      }
+      versions.push_back(std::move(version.value()));
+      names.push_back(std::move(name));
+    }
+    for (auto& name : others) {
+      names.push_back(std::move(name));
+    }
+  }
+
+  size_t size() const {
+    return names.size();
+  }
+
+  const std::string& get_name(size_t i) const {
+    return names[i];
+  }
+
+  std::optional<size_t> find(std::string_view name) const {
+    auto version = Version::parse(name);
+    if (version.has_value()) {
+      auto it = std::lower_bound(versions.begin(), versions.end(), version.value());
+      if (it != versions.end() && *it == version.value()) {
+        return it - versions.begin();
+      }
+      return std::nullopt;
+    }
+    auto begin = names.begin() + versions.size();
+    auto it = std::lower_bound(begin, names.end(), name, [](const std::string& a, std::string_view b) {
+      return a < b;
+    });
+    if (it != names.end() && *it == name) {
+      return it - names.begin();
+    }
+    return std::nullopt;
+  }
+
+  // The versions matching `requirement`, in a set of `bits` bits
+  // (at least size(), callers may keep extra bits of their own)
+  VersionSet query(const Requirement& requirement, size_t bits) const {
+    VersionSet set(bits);
+    if (requirement.get_exact().has_value()) {
+      auto index = find(requirement.get_exact().value());
+      if (index.has_value()) {
+        set.set(index.value());
+      }
+      return set;
+    }
+    size_t from = 0;
+    size_t to = versions.size();
+    if (requirement.get_lower().has_value()) {
+      auto& lower = requirement.get_lower().value();
+      auto it = requirement.is_lower_inclusive()
+        ? std::lower_bound(versions.begin(), versions.end(), lower)
+        : std::upper_bound(versions.begin(), versions.end(), lower);
+      from = it - versions.begin();
+    }
+    if (requirement.get_upper().has_value()) {
+      auto& upper = requirement.get_upper().value();
+      auto it = requirement.is_upper_inclusive()
+        ? std::upper_bound(versions.begin(), versions.end(), upper)
+        : std::lower_bound(versions.begin(), versions.end(), upper);
+      to = it - versions.begin();
+    }
+    if (from >= to) {
+      return set;
+    }
+    set.set_range(from, to);
+    if (!requirement.allows_prerelease()) {
+      auto it = std::lower_bound(prereleases.begin(), prereleases.end(), from);
+      for (; it != prereleases.end() && *it < to; ++it) {
+        set.reset(*it);
+      }
+    }
+    return set;
+  }
+
+  // The order catalogs keep versions in: semver by precedence
+  // first, then everything else by name
+  static bool precedes(std::string_view a, std::string_view b) {
+    auto version_a = Version::parse(a);
+    auto version_b = Version::parse(b);
+    if (version_a.has_value() != version_b.has_value()) {
+      return version_a.has_value();
+    }
+    if (version_a.has_value()) {
+      auto result = Version::compare(version_a.value(), version_b.value());
+      if (result != 0) {
+        return result < 0;
+      }
+    }
+    return a < b;
+  }
+
+  static void sort(std::vector<std::string>& list) {
+    if (!std::is_sorted(list.begin(), list.end(), precedes)) {
+      std::sort(list.begin(), list.end(), precedes);
+    }
+  }
+};
+
+}
+}
+
+#endif // __REKY_SEMVER_H__
@@ -0,0 +1,572 @@
+
+#ifndef __REKY_SOLVER_H__
+#define __REKY_SOLVER_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+#include <fmt/format.h>
+
+#include "reky/graph.hpp"
+#include "reky/semver.hpp"
+
+namespace snowball {
+namespace reky {
+
+// `id` has to be selected at one of `versions`, a set with one
+// bit per version of its catalog plus one (see Solver).
+struct Dependency final {
+  PackageId id;
+  VersionSet versions;
+  // As written in sn.reky, for error messages
+  std::string requirement;
+};
+
+// Version solving based on PubGrub (Natalie Weizenbaum, "PubGrub:
+// Next-Generation Version Solving"). Conflicts aren't fatal: each one is
+// turned into a learned incompatibility explaining its root cause, the
+// solver backjumps to the decision that caused it and never tries that
+// combination again.
+//
+// Every package gets one bit per version in its catalog plus a last bit
+// for "not selected", so terms, their negations and the partial solution
+// are all plain version sets.
+class Solver final {
+public:
+  struct Provider {
+    std::function<const std::string&(PackageId)> get_name;
+    // Number of versions in the catalog of a package
+    std::function<size_t(PackageId)> get_version_count;
+    std::function<std::string(PackageId, size_t)> get_version_name;
+    // Dependencies of a version, nullopt (with a reason) if they can't be read
+    std::function<std::optional<std::vector<Dependency>>(PackageId, size_t, std::string&)> get_dependencies;
+    // Version to try first, e.g. the one in the lockfile
+    std::function<std::optional<size_t>(PackageId)> get_preferred;
+  };
+
+  struct Result {
+    bool ok = false;
+    // Selected version of every package, root excluded, in decision order
+    std::vector<std::pair<PackageId, size_t>> packages;
+    std::unordered_map<PackageId, std::vector<Dependency>> dependencies;
+    std::string explanation;
+    size_t decisions = 0;
+    size_t conflicts = 0;
+  };
+private:
+  struct Term {
+    PackageId id;
+    // The states the term is true for
+    VersionSet set;
+  };
+
+  struct Incompatibility {
+    enum class Kind { Root, Dependency, NoVersions, Unavailable, Derived };
+    std::vector<Term> terms;
+    Kind kind;
+    std::string message;
+    // Derived: the two incompatibilities it was resolved from
+    size_t left = 0;
+    size_t right = 0;
+
+    Incompatibility(std::vector<Term> terms, Kind kind, std::string message = "", size_t left = 0, size_t right = 0)
+      : terms(std::move(terms)), kind(kind), message(std::move(message)), left(left), right(right) {}
+  };
+
+  struct Assignment {
+    PackageId id;
+    VersionSet set;
+    size_t level;
+    // Incompatibility it was derived from, npos for decisions
+    size_t cause;
+  };
+
+  enum class Relation { Satisfied, Contradicted, Inconclusive };
+
+  static constexpr size_t npos = SIZE_MAX;
+
+  const Provider& provider;
+  PackageId root;
+  std::vector<Incompatibility> incompatibilities;
+  std::vector<std::vector<size_t>> by_package;
+  std::vector<Assignment> assignments;
+  std::vector<std::vector<size_t>> package_assignments;
+  // Intersection of every assignment of a package
+  std::vector<VersionSet> allowed;
+  std::vector<char> decided;
+  std::vector<size_t> set_sizes;
+  // Every package that ever had an assignment
+  std::vector<PackageId> touched;
+  std::vector<char> is_touched;
+  std::unordered_map<uint64_t, std::optional<std::vector<Dependency>>> known_dependencies;
+  std::vector<Dependency> root_dependencies;
+  size_t level = 0;
+  size_t failure = npos;
+  Result result;
+public:
+  Solver(const Provider& provider, PackageId root, std::vector<Dependency> root_dependencies)
+    : provider(provider), root(root), root_dependencies(std::move(root_dependencies)) {}
+
+  // Bits in the sets of a package: its versions and "not selected"
+  size_t get_set_size(PackageId id) {
+    if (id >= set_sizes.size()) {
+      set_sizes.resize(id + 1, 0);
+    }
+    if (set_sizes[id] == 0) {
+      set_sizes[id] = (id == root ? 1 : provider.get_version_count(id)) + 1;
+    }
+    return set_sizes[id];
+  }
+
+  Result solve() {
+    Term not_root{root, VersionSet(get_set_size(root))};
+    not_root.set.set(get_set_size(root) - 1);
+    add_incompatibility(Incompatibility({std::move(not_root)}, Incompatibility::Kind::Root));
+    if (!propagate(root)) {
+      return finish();
+    }
+    while (true) {
+      auto next = choose_package();
+      if (!next.has_value()) {
+        break;
+      }
+      auto id = next.value();
+      auto candidates = get_allowed(id);
+      auto version = pick_version(id, candidates);
+      if (version == npos) {
+        Term term{id, candidates};
+        add_incompatibility(Incompatibility({std::move(term)}, Incompatibility::Kind::NoVersions));
+      } else {
+        add_dependencies(id, version);
+      }
+      // Dependencies that can't be met rule the version out before it's picked
+      if (!propagate(id)) {
+        return finish();
+      }
+      if (version == npos || !get_allowed(id).test(version) || decided[id]) {
+        continue;
+      }
+      VersionSet selected(get_set_size(id));
+      selected.set(version);
+      level++;
+      result.decisions++;
+      assign(id, std::move(selected), npos);
+      if (!propagate(id)) {
+        return finish();
+      }
+    }
+    result.ok = true;
+    for (auto& assignment : assignments) {
+      if (assignment.cause == npos && assignment.id != root) {
+        auto version = assignment.set.highest();
+        result.packages.emplace_back(assignment.id, version);
+        result.dependencies[assignment.id] = get_dependencies(assignment.id, version).value();
+      }
+    }
+    result.dependencies[root] = root_dependencies;
+    return finish();
+  }
+private:
+  Result finish() {
+    if (!result.ok) {
+      result.explanation = explain(failure);
+    }
+    return std::move(result);
+  }
+
+  const VersionSet& get_allowed(PackageId id) {
+    if (id >= allowed.size()) {
+      allowed.resize(id + 1);
+      decided.resize(id + 1, false);
+      is_touched.resize(id + 1, false);
+      package_assignments.resize(id + 1);
+    }
+    if (allowed[id].size() == 0) {
+      allowed[id] = VersionSet(get_set_size(id), true);
+    }
+    return allowed[id];
+  }
+
+  size_t add_incompatibility(Incompatibility incompatibility) {
+    auto index = incompatibilities.size();
+    for (auto& term : incompatibility.terms) {
+      if (term.id >= by_package.size()) {
+        by_package.resize(term.id + 1);
+      }
+      by_package[term.id].push_back(index);
+    }
+    incompatibilities.push_back(std::move(incompatibility));
+    return index;
+  }
+
+  void assign(PackageId id, VersionSet set, size_t cause) {
+    allowed[id] = get_allowed(id) & set;
+    if (!is_touched[id]) {
+      is_touched[id] = true;
+      touched.push_back(id);
+    }
+    package_assignments[id].push_back(assignments.size());
+    decided[id] |= cause == npos;
+    assignments.push_back({id, std::move(set), level, cause});
+  }
+
+  void backtrack(size_t to_level) {
+    std::vector<PackageId> changed;
+    while (!assignments.empty() && assignments.back().level > to_level) {
+      auto& assignment = assignments.back();
+      package_assignments[assignment.id].pop_back();
+      if (assignment.cause == npos) {
+        decided[assignment.id] = false;
+      }
+      changed.push_back(assignment.id);
+      assignments.pop_back();
+    }
+    for (auto id : changed) {
+      VersionSet set(get_set_size(id), true);
+      for (auto index : package_assignments[id]) {
+        set = set & assignments[index].set;
+      }
+      allowed[id] = std::move(set);
+    }
+    level = to_level;
+  }
+
+  Relation get_relation(const Term& term) {
+    auto& current = get_allowed(term.id);
+    if (current.is_subset_of(term.set)) {
+      return Relation::Satisfied;
+    }
+    return current.intersects(term.set) ? Relation::Inconclusive : Relation::Contradicted;
+  }
+
+  // Unit propagation: derive everything the incompatibilities imply
+  // from what changed. Returns false if solving failed.
+  bool propagate(PackageId start) {
+    std::vector<PackageId> changed = {start};
+    while (!changed.empty()) {
+      auto id = changed.back();
+      changed.pop_back();
+      if (id >= by_package.size()) {
+        continue;
+      }
+      // Newest first, learned incompatibilities are the most useful ones
+      for (size_t i = by_package[id].size(); i-- > 0;) {
+        auto index = by_package[id][i];
+        auto unsatisfied = npos;
+        bool skip = false;
+        for (size_t t = 0; t < incompatibilities[index].terms.size() && !skip; t++) {
+          switch (get_relation(incompatibilities[index].terms[t])) {
+            case Relation::Contradicted:
+              skip = true;
+              break;
+            case Relation::Inconclusive:
+              skip = unsatisfied != npos;
+              unsatisfied = t;
+              break;
+            case Relation::Satisfied:
+              break;
+          }
+        }
+        if (skip) {
+          continue;
+        }
+        if (unsatisfied == npos) {
+          auto cause = resolve_conflict(index);
+          if (cause == npos) {
+            return false;
+          }
+          // The learned incompatibility is now almost satisfied
+          auto& terms = incompatibilities[cause].terms;
+          for (auto& term : terms) {
+            if (get_relation(term) != Relation::Satisfied) {
+              auto derived = term.id;
+              assign(derived, ~term.set, cause);
+              changed.clear();
+              changed.push_back(derived);
+              break;
+            }
+          }
+          break;
+        }
+        auto& term = incompatibilities[index].terms[unsatisfied];
+        assign(term.id, ~term.set, index);
+        changed.push_back(term.id);
+      }
+    }
+    return true;
+  }
+
+  bool is_failure(const Incompatibility& incompatibility) {
+    auto& terms = incompatibility.terms;
+    return terms.empty() || (terms.size() == 1 && terms[0].id == root && !terms[0].set.test(get_set_size(root) - 1));
+  }
+
+  // First assignment from which on the partial solution (narrowed
+  // by `with`, if given) satisfies `term`. Only looks before `limit`.
+  size_t find_satisfier(const Term& term, size_t limit = npos, const VersionSet* with = nullptr) {
+    VersionSet current = with ? *with : VersionSet(get_set_size(term.id), true);
+    for (auto index : package_assignments[term.id]) {
+      if (index >= limit) {
+        break;
+      }
+      current = current & assignments[index].set;
+      if (current.is_subset_of(term.set)) {
+        return index;
+      }
+    }
+    return npos;
+  }
+
+  // Conflict-driven learning: resolve the satisfied incompatibility with
+  // the causes of its satisfiers until it points at a single decision to
+  // undo, then backjump there. Returns the learned incompatibility, npos
+  // if the conflict reaches the root and solving failed.
+  size_t resolve_conflict(size_t index) {
+    result.conflicts++;
+    while (!is_failure(incompatibilities[index])) {
+      auto terms = incompatibilities[index].terms;
+      size_t satisfier = 0;
+      size_t satisfied_term = 0;
+      std::vector<size_t> satisfiers(terms.size());
+      for (size_t t = 0; t < terms.size(); t++) {
+        satisfiers[t] = find_satisfier(terms[t]);
+        if (t == 0 || satisfiers[t] > satisfier) {
+          satisfier = satisfiers[t];
+          satisfied_term = t;
+        }
+      }
+      size_t previous_level = 0;
+      for (size_t t = 0; t < terms.size(); t++) {
+        if (t != satisfied_term) {
+          previous_level = std::max(previous_level, assignments[satisfiers[t]].level);
+        }
+      }
+      auto& term = terms[satisfied_term];
+      auto& assignment = assignments[satisfier];
+      auto previous = find_satisfier(term, satisfier, &assignment.set);
+      if (previous != npos) {
+        previous_level = std::max(previous_level, assignments[previous].level);
+      }
+      if (assignment.cause == npos || previous_level != assignment.level) {
+        backtrack(previous_level);
+        return index;
+      }
+      // Merge with the cause of the satisfier, dropping the package it's about
+      auto cause = assignment.cause;
+      std::vector<Term> merged;
+      auto add_term = [&](const Term& other) {
+        for (auto& existing : merged) {
+          if (existing.id == other.id) {
+            // Both have to hold for the incompatibility to apply
+            existing.set = existing.set & other.set;
+            return;
+          }
+        }
+        merged.push_back(other);
+      };
+      for (auto& other : terms) {
+        if (other.id != term.id) {
+          add_term(other);
+        }
+      }
+      for (auto& other : incompatibilities[cause].terms) {
+        if (other.id != term.id) {
+          add_term(other);
+        }
+      }
+      if (!assignment.set.is_subset_of(term.set)) {
+        add_term({term.id, ~assignment.set | term.set});
+      }
+      // Terms that are always true say nothing
+      std::vector<Term> kept;
+      for (auto& other : merged) {
+        if (other.set.count() != other.set.size()) {
+          kept.push_back(std::move(other));
+        }
+      }
+      index = add_incompatibility(Incompatibility(std::move(kept), Incompatibility::Kind::Derived, "", index, cause));
+    }
+    failure = index;
+    return npos;
+  }
+
+  // The required package with the fewest versions left, so
+  // conflicts are found as early as possible
+  std::optional<PackageId> choose_package() {
+    std::optional<PackageId> best;
+    size_t best_count = SIZE_MAX;
+    for (auto id : touched) {
+      if (decided[id] || package_assignments[id].empty()) {
+        continue;
+      }
+      auto& set = get_allowed(id);
+      if (set.test(set.size() - 1)) {
+        // Not required (yet)
+        continue;
+      }
+      auto count = set.count();
+      if (count < best_count) {
+        best = id;
+        best_count = count;
+      }
+    }
+    return best;
+  }
+
+  size_t pick_version(PackageId id, const VersionSet& candidates) {
+    if (id == root) {
+      return candidates.test(0) ? 0 : npos;
+    }
+    auto preferred = provider.get_preferred ? provider.get_preferred(id) : std::nullopt;
+    if (preferred.has_value() && preferred.value() < candidates.size() - 1 && candidates.test(preferred.value())) {
+      return preferred.value();
+    }
+    return candidates.highest(candidates.size() - 1);
+  }
+
+  std::optional<std::vector<Dependency>>& get_dependencies(PackageId id, size_t version) {
+    auto key = ((uint64_t)id << 32) | version;
+    auto it = known_dependencies.find(key);
+    if (it != known_dependencies.end()) {
+      return it->second;
+    }
+    auto& entry = known_dependencies[key];
+    std::string reason;
+    if (id == root) {
+      entry = root_dependencies;
+    } else {
+      entry = provider.get_dependencies(id, version, reason);
+    }
+    if (!entry.has_value()) {
+      VersionSet set(get_set_size(id));
+      set.set(version);
+      add_incompatibility(Incompatibility({{id, std::move(set)}}, Incompatibility::Kind::Unavailable, reason));
+    }
+    return entry;
+  }
+
+  // "id@version depends on dependency" becomes the incompatibility
+  // {id@version, not dependency}
+  void add_dependencies(PackageId id, size_t version) {
+    auto key = ((uint64_t)id << 32) | version;
+    if (known_dependencies.count(key)) {
+      return;
+    }
+    auto& dependencies = get_dependencies(id, version);
+    if (!dependencies.has_value()) {
+      return;
+    }
+    for (auto& dependency : dependencies.value()) {
+      if (dependency.id == id) {
+        continue;
+      }
+      VersionSet set(get_set_size(id));
+      set.set(version);
+      std::vector<Term> terms = {{id, std::move(set)}};
+      auto excluded = ~dependency.versions;
+      if (excluded.count() != excluded.size()) {
+        terms.push_back({dependency.id, std::move(excluded)});
+      }
+      auto message = fmt::format("{} {}", provider.get_name(dependency.id), dependency.requirement);
+      add_incompatibility(Incompatibility(std::move(terms), Incompatibility::Kind::Dependency, message));
+    }
+  }
+
+  std::string describe(PackageId id, const VersionSet& set) {
+    auto& name = provider.get_name(id);
+    auto none = set.size() - 1;
+    if (id == root) {
+      return name;
+    }
+    std::vector<size_t> selected;
+    for (size_t i = 0; i < none; i++) {
+      if (set.test(i)) {
+        selected.push_back(i);
+      }
+    }
+    if (selected.empty()) {
+      return fmt::format("{} (no version)", name);
+    }
+    if (selected.size() == none) {
+      return fmt::format("any version of {}", name);
+    }
+    if (selected.size() > 3) {
+      return fmt::format("{} {} to {} ({} versions)", name, provider.get_version_name(id, selected.front()),
+        provider.get_version_name(id, selected.back()), selected.size());
+    }
+    std::string versions;
+    for (auto i : selected) {
+      versions += (versions.empty() ? "" : ", ") + provider.get_version_name(id, i);
+    }
+    return fmt::format("{} {}", name, versions);
+  }
+
+  std::string describe_external(const Incompatibility& incompatibility) {
+    auto& terms = incompatibility.terms;
+    switch (incompatibility.kind) {
+      case Incompatibility::Kind::Root:
+        return fmt::format("{} is the package being resolved", provider.get_name(root));
+      case Incompatibility::Kind::Dependency:
+        return fmt::format("{} depends on {}", describe(terms[0].id, terms[0].set), incompatibility.message);
+      case Incompatibility::Kind::NoVersions:
+        return fmt::format("no version of {} matches what's required", provider.get_name(terms[0].id));
+      case Incompatibility::Kind::Unavailable:
+        return fmt::format("{} can't be used: {}", describe(terms[0].id, terms[0].set), incompatibility.message);
+      case Incompatibility::Kind::Derived:
+        break;
+    }
+    return "";
+  }
+
+  // Every external fact the failure was derived from. Facts shared by
+  // several versions of a package are reported once, for all of them.
+  std::string explain(size_t index) {
+    if (index == npos) {
+      return "";
+    }
+    std::vector<char> visited(incompatibilities.size(), false);
+    std::vector<size_t> stack = {index};
+    std::vector<Incompatibility> facts;
+    while (!stack.empty()) {
+      auto current = stack.back();
+      stack.pop_back();
+      if (visited[current]) {
+        continue;
+      }
+      visited[current] = true;
+      auto& incompatibility = incompatibilities[current];
+      if (incompatibility.kind == Incompatibility::Kind::Derived) {
+        stack.push_back(incompatibility.right);
+        stack.push_back(incompatibility.left);
+        continue;
+      }
+      if (incompatibility.kind == Incompatibility::Kind::Root) {
+        continue;
+      }
+      auto same = std::find_if(facts.begin(), facts.end(), [&](const Incompatibility& fact) {
+        return fact.kind == incompatibility.kind && fact.message == incompatibility.message
+          && fact.terms[0].id == incompatibility.terms[0].id;
+      });
+      if (same == facts.end()) {
+        facts.push_back(incompatibility);
+      } else {
+        same->terms[0].set = same->terms[0].set | incompatibility.terms[0].set;
+      }
+    }
+    std::string explanation;
+    for (auto& fact : facts) {
+      explanation += fmt::format("\n  because {}", describe_external(fact));
+    }
+    return explanation + fmt::format("\n  no set of versions satisfies {}", provider.get_name(root));
+  }
+};
+
+}
+}
+
+#endif // __REKY_SOLVER_H__
@@ -0,0 +1,149 @@
+
+#ifndef __REKY_STATS_H__
+#define __REKY_STATS_H__
+
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <nlohmann/json.hpp>
+
+#ifndef REKY_STATS_ENV
+// Path runs append their stats to, one JSON object per line
+#define REKY_STATS_ENV "REKY_STATS"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// What the process (and the git/tar/curl processes it waited for) has
+// used so far. Two snapshots are subtracted to get the cost of a run.
+struct ResourceUsage final {
+  std::chrono::steady_clock::time_point time;
+  // From /proc/self/io, zero where it isn't available
+  uint64_t read_syscalls = 0;
+  uint64_t write_syscalls = 0;
+  uint64_t bytes_read = 0;
+  uint64_t bytes_written = 0;
+  uint64_t disk_bytes_written = 0;
+  double user_time = 0;
+  double system_time = 0;
+  double children_user_time = 0;
+  double children_system_time = 0;
+  uint64_t children_disk_bytes_written = 0;
+
+  static ResourceUsage now() {
+    ResourceUsage usage;
+    usage.time = std::chrono::steady_clock::now();
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value) {
+      if (key == "syscr:") {
+        usage.read_syscalls = value;
+      } else if (key == "syscw:") {
+        usage.write_syscalls = value;
+      } else if (key == "rchar:") {
+        usage.bytes_read = value;
+      } else if (key == "wchar:") {
+        usage.bytes_written = value;
+      } else if (key == "write_bytes:") {
+        usage.disk_bytes_written = value;
+      }
+    }
+    struct rusage self, children;
+    if (getrusage(RUSAGE_SELF, &self) == 0) {
+      usage.user_time = to_seconds(self.ru_utime);
+      usage.system_time = to_seconds(self.ru_stime);
+    }
+    if (getrusage(RUSAGE_CHILDREN, &children) == 0) {
+      usage.children_user_time = to_seconds(children.ru_utime);
+      usage.children_system_time = to_seconds(children.ru_stime);
+      usage.children_disk_bytes_written = (uint64_t)children.ru_oublock * 512;
+    }
+    return usage;
+  }
+
+  // Usage between `start` and this snapshot
+  nlohmann::json since(const ResourceUsage& start) const {
+    return {
+      {"wall_time", std::chrono::duration<double>(time - start.time).count()},
+      {"read_syscalls", read_syscalls - start.read_syscalls},
+      {"write_syscalls", write_syscalls - start.write_syscalls},
+      {"bytes_read", bytes_read - start.bytes_read},
+      {"bytes_written", bytes_written - start.bytes_written},
+      {"disk_bytes_written", disk_bytes_written - start.disk_bytes_written},
+      {"user_time", user_time - start.user_time},
+      {"system_time", system_time - start.system_time},
+      {"children_user_time", children_user_time - start.children_user_time},
+      {"children_system_time", children_system_time - start.children_system_time},
+      {"children_disk_bytes_written", children_disk_bytes_written - start.children_disk_bytes_written}
+    };
+  }
+private:
+  static double to_seconds(const timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+};
+
+// Everything a single fetch_dependencies did, meant to be compared
+// between commits: set REKY_STATS and run cold, warm and incremental
+// fetches of the same workspace.
+struct RunStats final {
+  ResourceUsage start;
+  ResourceUsage end;
+  // "lock" if the lockfile was fresh, "bundle" if served from a
+  // vendor bundle, "refresh" if a session only relinked what
+  // changed, "solve" otherwise
+  std::string mode = "solve";
+  size_t packages = 0;
+  size_t installed = 0;
+  size_t upgraded = 0;
+  size_t downloaded = 0;
+  // Fetched from upstream, and written into the store
+  uint64_t bytes_downloaded = 0;
+  uint64_t bytes_written = 0;
+  // Files in-place upgrades rewrote, removed and left alone
+  size_t files_written = 0;
+  size_t files_removed = 0;
+  size_t files_kept = 0;
+  size_t processes = 0;
+  double process_time = 0;
+  size_t decisions = 0;
+  size_t conflicts = 0;
+
+  nlohmann::json to_json() const {
+    auto data = end.since(start);
+    data["mode"] = mode;
+    data["packages"] = packages;
+    data["installed"] = installed;
+    data["upgraded"] = upgraded;
+    data["downloaded"] = downloaded;
+    data["bytes_downloaded"] = bytes_downloaded;
+    data["bytes_written"] = bytes_written;
+    data["files_written"] = files_written;
+    data["files_removed"] = files_removed;
+    data["files_kept"] = files_kept;
+    data["processes"] = processes;
+    data["process_time"] = process_time;
+    data["decisions"] = decisions;
+    data["conflicts"] = conflicts;
+    return data;
+  }
+
+  bool append_to(const std::filesystem::path& path) const {
+    std::ofstream file(path, std::ios::app);
+    file << to_json().dump() << std::endl;
+    return (bool)file;
+  }
+};
+
+}
+}
+
+#endif // __REKY_STATS_H__
@@ -0,0 +1,336 @@
+
+#ifndef __REKY_STORE_H__
+#define __REKY_STORE_H__
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <filesystem>
+#include <functional>
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include <fmt/format.h>
+
+#include "compiler/utils/hash.h"
+
+#include "reky/file.hpp"
+
+#ifndef REKY_STORE_DIR
+#define REKY_STORE_DIR "store"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// How files are copied out of the store into a workspace, from
+// cheapest to most expensive. A hardlink is the store's own file, so
+// it's only used for files the store made read-only (see add): an
+// in-place edit in Deps then fails instead of changing the copy of
+// every other workspace. The price is that Deps is read-only too, and
+// permissions don't stop root, whose edits still go through to the
+// store. Reflinks and copies don't share anything once written.
+enum class LinkMode {
+  Reflink,
+  Hardlink,
+  Copy
+};
+
+// What an in-place upgrade had to touch
+struct UpdateStats final {
+  size_t kept = 0;
+  size_t written = 0;
+  size_t removed = 0;
+};
+
+// Packages shared between every workspace, keyed by
+// package, version and resolved commit:
+//   <home>/store/<name hash>/<version>@<commit>/
+class PackageStore final {
+  std::filesystem::path root;
+public:
+  explicit PackageStore(const std::filesystem::path& root) : root(root) {}
+
+  const std::filesystem::path& get_root() const {
+    return root;
+  }
+
+  std::filesystem::path get_package_root(const std::string& name) const {
+    return root / utils::hash::hashString(name);
+  }
+
+  std::filesystem::path get_entry(const std::string& name, const std::string& version, const std::string& commit) const {
+    return get_package_root(name) / fmt::format("{}@{}", version, commit);
+  }
+
+  // Find a stored checkout of name@version. If no commit is
+  // given, any commit the version has resolved to is accepted.
+  std::optional<std::filesystem::path> find(const std::string& name, const std::string& version, const std::string& commit = "") const {
+    std::error_code ec;
+    if (!commit.empty()) {
+      auto entry = get_entry(name, version, commit);
+      if (std::filesystem::is_directory(entry, ec)) {
+        return entry;
+      }
+      return std::nullopt;
+    }
+    auto prefix = version + "@";
+    for (auto& entry : std::filesystem::directory_iterator(get_package_root(name), ec)) {
+      auto filename = entry.path().filename().string();
+      if (filename.compare(0, prefix.size(), prefix) == 0 && entry.is_directory(ec)) {
+        return entry.path();
+      }
+    }
+    return std::nullopt;
+  }
+
+  static std::string get_commit(const std::filesystem::path& entry) {
+    auto filename = entry.filename().string();
+    auto pos = filename.rfind('@');
+    return pos == std::string::npos ? "" : filename.substr(pos + 1);
+  }
+
+  // A private directory on the same filesystem as the store, so
+  // finished downloads can be moved into place with a rename.
+  std::filesystem::path get_staging() const {
+    static std::atomic<unsigned int> counter = 0;
+    auto staging = root / ".staging";
+    std::filesystem::create_directories(staging);
+    auto thread_id = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return staging / fmt::format("{}-{}-{}", getpid(), thread_id, counter++);
+  }
+
+  // Held while name@version is downloaded, so other processes wait
+  // for that download and reuse it instead of starting their own
+  std::filesystem::path get_lock_path(const std::string& name, const std::string& version) const {
+    return root / REKY_LOCKS_DIR / fmt::format("{}-{}.lock", utils::hash::hashString(name), version);
+  }
+
+  // Move a finished checkout into the store. Whoever renames first
+  // wins, everyone else drops their copy and uses the stored one.
+  // Its files are read-only from then on, see LinkMode.
+  std::filesystem::path add(const std::filesystem::path& staging, const std::string& name,
+                            const std::string& version, const std::string& commit) const {
+    auto entry = get_entry(name, version, commit);
+    std::filesystem::create_directories(entry.parent_path());
+    std::error_code ec;
+    for (auto& file : std::filesystem::recursive_directory_iterator(staging, ec)) {
+      if (file.is_regular_file(ec) && !file.is_symlink(ec)) {
+        std::filesystem::permissions(file.path(), std::filesystem::perms::owner_write | std::filesystem::perms::group_write
+                                     | std::filesystem::perms::others_write, std::filesystem::perm_options::remove, ec);
+      }
+    }
+    std::filesystem::rename(staging, entry, ec);
+    if (ec) {
+      std::filesystem::remove_all(staging, ec);
+    }
+    return entry;
+  }
+
+  // Recreate a stored tree at `to`, sharing its data whenever the
+  // filesystem allows it. Returns the cheapest mode that worked.
+  static LinkMode materialize(const std::filesystem::path& from, const std::filesystem::path& to, LinkMode mode = LinkMode::Reflink) {
+    std::filesystem::create_directories(to);
+    for (auto& entry : std::filesystem::recursive_directory_iterator(from)) {
+      auto target = to / std::filesystem::relative(entry.path(), from);
+      if (entry.is_symlink()) {
+        std::filesystem::copy_symlink(entry.path(), target);
+      } else if (entry.is_directory()) {
+        std::filesystem::create_directories(target);
+      } else {
+        mode = link_file(entry.path(), target, mode);
+      }
+    }
+    return mode;
+  }
+
+  // Turn the tree at `to` into a copy of `from` in place. `base` is the
+  // stored tree `to` was materialized from, if it's still around: files
+  // that didn't change between `base` and `from` are left alone, only the
+  // ones that did are linked again and the ones that are gone get removed.
+  // Without a base, `from` is compared against `to` itself.
+  static UpdateStats update(const std::filesystem::path& base, const std::filesystem::path& from,
+                            const std::filesystem::path& to, LinkMode mode = LinkMode::Reflink) {
+    UpdateStats stats;
+    std::error_code ec;
+    std::filesystem::create_directories(to);
+    for (auto& entry : std::filesystem::recursive_directory_iterator(from)) {
+      auto relative = std::filesystem::relative(entry.path(), from);
+      auto target = to / relative;
+      auto target_status = std::filesystem::symlink_status(target, ec);
+      if (entry.is_symlink()) {
+        if (std::filesystem::is_symlink(target_status)
+            && std::filesystem::read_symlink(target, ec) == std::filesystem::read_symlink(entry.path(), ec)) {
+          stats.kept++;
+          continue;
+        }
+        std::filesystem::remove_all(target, ec);
+        std::filesystem::copy_symlink(entry.path(), target);
+        stats.written++;
+      } else if (entry.is_directory()) {
+        if (std::filesystem::exists(target_status) && !std::filesystem::is_directory(target_status)) {
+          std::filesystem::remove(target, ec);
+        }
+        std::filesystem::create_directories(target);
+      } else if (std::filesystem::is_regular_file(target_status)
+                 && (std::filesystem::equivalent(entry.path(), target, ec)
+                     || is_unchanged(entry.path(), base.empty() ? target : base / relative, target))) {
+        stats.kept++;
+      } else {
+        // Linked next to the target and renamed over it, so the
+        // file is never missing or half written
+        auto tmp = target.string() + ".reky-tmp";
+        std::filesystem::remove(tmp, ec);
+        mode = link_file(entry.path(), tmp, mode);
+        if (std::filesystem::is_directory(target_status)) {
+          std::filesystem::remove_all(target, ec);
+        }
+        std::filesystem::rename(tmp, target);
+        stats.written++;
+      }
+    }
+    // Whatever `from` doesn't have anymore
+    std::vector<std::filesystem::path> stale;
+    auto it = std::filesystem::recursive_directory_iterator(to);
+    for (; it != std::filesystem::recursive_directory_iterator(); ++it) {
+      auto relative = std::filesystem::relative(it->path(), to);
+      if (!std::filesystem::exists(std::filesystem::symlink_status(from / relative, ec))) {
+        stale.push_back(it->path());
+        it.disable_recursion_pending();
+      }
+    }
+    for (auto& path : stale) {
+      stats.removed += std::filesystem::remove_all(path, ec);
+    }
+    return stats;
+  }
+
+  // `file` in the new tree is the same as `reference`, and `target`
+  // still looks like the copy of `reference` it was made from
+  static bool is_unchanged(const std::filesystem::path& file, const std::filesystem::path& reference,
+                           const std::filesystem::path& target) {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(file, ec);
+    if (ec || std::filesystem::file_size(reference, ec) != size || ec
+        || std::filesystem::file_size(target, ec) != size || ec) {
+      return false;
+    }
+    return std::filesystem::equivalent(file, reference, ec) || has_same_content(file, reference);
+  }
+
+  static bool has_same_content(const std::filesystem::path& a, const std::filesystem::path& b) {
+    int fa = open(a.c_str(), O_RDONLY | O_CLOEXEC);
+    int fb = open(b.c_str(), O_RDONLY | O_CLOEXEC);
+    bool same = fa >= 0 && fb >= 0;
+    char buffer_a[16384];
+    char buffer_b[16384];
+    while (same) {
+      auto n = read(fa, buffer_a, sizeof(buffer_a));
+      if (n <= 0) {
+        same = n == 0 && read(fb, buffer_b, 1) == 0;
+        break;
+      }
+      ssize_t got = 0;
+      while (got < n) {
+        auto m = read(fb, buffer_b + got, n - got);
+        if (m <= 0) {
+          break;
+        }
+        got += m;
+      }
+      same = got == n && memcmp(buffer_a, buffer_b, n) == 0;
+    }
+    if (fa >= 0) {
+      close(fa);
+    }
+    if (fb >= 0) {
+      close(fb);
+    }
+    return same;
+  }
+
+  // Bytes in every regular file under `path`
+  static uint64_t get_size(const std::filesystem::path& path) {
+    uint64_t size = 0;
+    std::error_code ec;
+    for (auto& entry : std::filesystem::recursive_directory_iterator(path, ec)) {
+      if (entry.is_regular_file(ec)) {
+        size += entry.file_size(ec);
+      }
+    }
+    return size;
+  }
+
+  static LinkMode link_file(const std::filesystem::path& from, const std::filesystem::path& to, LinkMode mode) {
+    if (mode == LinkMode::Reflink) {
+      if (reflink_file(from, to)) {
+        return mode;
+      }
+      mode = LinkMode::Hardlink;
+    }
+    if (mode == LinkMode::Hardlink) {
+      if (!is_read_only(from)) {
+        // e.g. stored before entries were made read-only, the
+        // next file may still be linked
+        std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+        return mode;
+      }
+      if (link(from.c_str(), to.c_str()) == 0) {
+        return mode;
+      }
+      mode = LinkMode::Copy;
+    }
+    std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+    return mode;
+  }
+
+  static bool is_read_only(const std::filesystem::path& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0;
+  }
+
+  static bool reflink_file(const std::filesystem::path& from, const std::filesystem::path& to) {
+#ifndef FICLONE
+    return false;
+#else
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+      return false;
+    }
+    int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (dst < 0) {
+      close(src);
+      return false;
+    }
+    bool cloned = ioctl(dst, FICLONE, src) == 0;
+    if (cloned) {
+      struct stat st;
+      if (fstat(src, &st) == 0) {
+        fchmod(dst, st.st_mode & 07777);
+      }
+    }
+    close(src);
+    close(dst);
+    if (!cloned) {
+      unlink(to.c_str());
+    }
+    return cloned;
+#endif
+  }
+};
+
+}
+}
+
+#endif // __REKY_STORE_H__
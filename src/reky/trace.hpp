@@ -0,0 +1,147 @@
+
+#ifndef __REKY_TRACE_H__
+#define __REKY_TRACE_H__
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <string_view>
+
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#ifndef REKY_TRACE_ENV
+// Path to write a Chrome trace (chrome://tracing, Perfetto) of every run to
+#define REKY_TRACE_ENV "REKY_TRACE"
+#endif
+
+namespace snowball {
+namespace reky {
+
+// Collects spans and counters as Chrome trace events. Disabled by
+// default, and then recording is a single relaxed atomic load.
+class Tracer final {
+  using Clock = std::chrono::steady_clock;
+
+  struct Event {
+    std::string name;
+    std::string detail;
+    char phase;
+    uint32_t thread;
+    int64_t start;
+    int64_t duration;
+  };
+
+  std::atomic<bool> enabled = false;
+  std::mutex mutex;
+  std::vector<Event> events;
+  std::map<std::string, int64_t> counters;
+  Clock::time_point origin = Clock::now();
+public:
+  static Tracer& get() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  void enable() {
+    enabled.store(true, std::memory_order_relaxed);
+  }
+
+  bool is_enabled() const {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  void add_span(const char* name, std::string_view detail, Clock::time_point start, Clock::time_point end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back({name, std::string(detail), 'X', get_thread_id(), to_micros(start), to_micros(end) - to_micros(start)});
+  }
+
+  // Add to a running total, drawn as a counter track
+  void count(const char* name, int64_t delta) {
+    if (!is_enabled()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto value = counters[name] += delta;
+    events.push_back({name, "", 'C', get_thread_id(), to_micros(Clock::now()), value});
+  }
+
+  nlohmann::json to_json() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto trace_events = nlohmann::json::array();
+    auto pid = getpid();
+    for (auto& event : events) {
+      nlohmann::json data = {
+        {"name", event.name},
+        {"cat", "reky"},
+        {"ph", std::string(1, event.phase)},
+        {"pid", pid},
+        {"tid", event.thread},
+        {"ts", event.start}
+      };
+      if (event.phase == 'X') {
+        data["dur"] = event.duration;
+        if (!event.detail.empty()) {
+          data["args"] = {{"detail", event.detail}};
+        }
+      } else {
+        data["args"] = {{"value", event.duration}};
+      }
+      trace_events.push_back(std::move(data));
+    }
+    return {{"traceEvents", std::move(trace_events)}, {"displayTimeUnit", "ms"}};
+  }
+
+  bool write(const std::filesystem::path& path) {
+    std::ofstream file(path, std::ios::trunc);
+    file << to_json().dump() << std::endl;
+    return (bool)file;
+  }
+
+  // Small, stable ids read better in trace viewers than pthread ids
+  static uint32_t get_thread_id() {
+    static std::atomic<uint32_t> next = 0;
+    thread_local uint32_t id = next++;
+    return id;
+  }
+private:
+  int64_t to_micros(Clock::time_point time) const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - origin).count();
+  }
+};
+
+// Times the enclosing scope. `detail` has to outlive the span.
+class TraceSpan final {
+  const char* name;
+  std::string_view detail;
+  std::chrono::steady_clock::time_point start;
+  bool active;
+public:
+  explicit TraceSpan(const char* name, std::string_view detail = {})
+    : name(name), detail(detail), active(Tracer::get().is_enabled()) {
+    if (active) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~TraceSpan() {
+    if (active) {
+      Tracer::get().add_span(name, detail, start, std::chrono::steady_clock::now());
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+}
+}
+
+#endif // __REKY_TRACE_H__
@@ -0,0 +1,159 @@
+
+#ifndef __REKY_WATCH_H__
+#define __REKY_WATCH_H__
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+namespace snowball {
+namespace reky {
+
+// inotify watches on folders. Files are watched through the folder they
+// are in: editors usually save by renaming a new file over the old one,
+// which a watch on the file itself wouldn't survive. Where inotify isn't
+// available open() fails and the caller has to poll instead.
+class FileWatcher final {
+  int fd = -1;
+  // Watch descriptor -> folder, and back
+  std::unordered_map<int, std::filesystem::path> folders;
+  std::unordered_map<std::string, int> watches;
+public:
+  FileWatcher() = default;
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  ~FileWatcher() {
+    close();
+  }
+
+  bool open() {
+#if defined(__linux__)
+    if (fd < 0) {
+      fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+#endif
+    return fd >= 0;
+  }
+
+  void close() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    folders.clear();
+    watches.clear();
+  }
+
+  bool is_open() const {
+    return fd >= 0;
+  }
+
+  // Can be added to the caller's own poll() loop
+  int get_fd() const {
+    return fd;
+  }
+
+  // Watching a folder twice is a no-op
+  bool watch(const std::filesystem::path& folder) {
+#if defined(__linux__)
+    if (fd < 0) {
+      return false;
+    }
+    if (watches.count(folder.string())) {
+      return true;
+    }
+    int wd = inotify_add_watch(fd, folder.c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                                                   | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0) {
+      return false;
+    }
+    folders[wd] = folder;
+    watches[folder.string()] = wd;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Stop watching a folder that doesn't matter anymore
+  void unwatch(const std::filesystem::path& folder) {
+    auto it = watches.find(folder.string());
+    if (it == watches.end()) {
+      return;
+    }
+#if defined(__linux__)
+    inotify_rm_watch(fd, it->second);
+#endif
+    folders.erase(it->second);
+    watches.erase(it);
+  }
+
+  size_t get_watch_count() const {
+    return folders.size();
+  }
+
+  // Paths that changed, waiting up to `timeout` milliseconds (-1 for
+  // ever) for the first one. The folder itself is reported when it was
+  // deleted or moved, its watch is gone after that.
+  std::vector<std::filesystem::path> read(int timeout) {
+    std::vector<std::filesystem::path> changed;
+#if defined(__linux__)
+    if (fd < 0) {
+      return changed;
+    }
+    pollfd pfd{fd, POLLIN, 0};
+    while (poll(&pfd, 1, timeout) < 0) {
+      if (errno != EINTR) {
+        return changed;
+      }
+    }
+    alignas(inotify_event) char buffer[16384];
+    while (true) {
+      auto n = ::read(fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        // Drained, EAGAIN
+        break;
+      }
+      for (char* p = buffer; p < buffer + n;) {
+        auto event = reinterpret_cast<inotify_event*>(p);
+        p += sizeof(inotify_event) + event->len;
+        auto folder = folders.find(event->wd);
+        if (folder == folders.end()) {
+          continue;
+        }
+        if (event->mask & IN_IGNORED) {
+          watches.erase(folder->second.string());
+          folders.erase(folder);
+        } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+          // A moved folder would still be watched wherever it went,
+          // and a new one at the same path couldn't be watched again
+          changed.push_back(folder->second);
+          inotify_rm_watch(fd, event->wd);
+          watches.erase(folder->second.string());
+          folders.erase(folder);
+        } else if (event->len > 0) {
+          changed.push_back(folder->second / event->name);
+        }
+      }
+    }
+#endif
+    return changed;
+  }
+};
+
+}
+}
+
+#endif // __REKY_WATCH_H__
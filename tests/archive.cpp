@@ -0,0 +1,65 @@
+
+#include <fstream>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include "test.hpp"
+
+#include "reky/archive.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+bool all_ok(const std::vector<ProcessResult>& results) {
+  for (auto& result : results) {
+    if (!result.ok()) {
+      return false;
+    }
+  }
+  return !results.empty();
+}
+
+}
+
+TEST(archive_detects_formats) {
+  CHECK_EQ(Archive::get_tar_flag("https://host/pkg-1.0.0.tar.gz").value(), "-z");
+  CHECK_EQ(Archive::get_tar_flag("https://host/pkg.tgz").value(), "-z");
+  CHECK_EQ(Archive::get_tar_flag("https://host/pkg.tar.zst").value(), "--zstd");
+  CHECK_EQ(Archive::get_tar_flag("https://host/pkg.tar.xz").value(), "-J");
+  CHECK_EQ(Archive::get_tar_flag("https://host/pkg.tar.bz2").value(), "-j");
+  CHECK_EQ(Archive::get_tar_flag("file:///tmp/pkg.tar").value(), "");
+  CHECK(!Archive::is_archive("https://github.com/user/pkg.git"));
+  CHECK(!Archive::is_archive("https://github.com/user/tar"));
+}
+
+// Release tarballs wrap everything in "<name>-<version>/", which
+// has to go so the package root looks like a checkout
+TEST(archive_extracts_release_tarball) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-archive-{}", getpid());
+  std::filesystem::remove_all(root);
+  auto release = root / "src" / "pkg-1.2.0";
+  std::filesystem::create_directories(release / "src");
+  std::ofstream(release / "sn.reky") << "[package]\n";
+  std::ofstream(release / "src" / "main.sn") << "func main() {}\n";
+  auto tarball = root / "pkg-1.2.0.tar.gz";
+  CHECK(Process::spawn({REKY_TAR_CMD, "-czf", tarball.string(), "-C", (root / "src").string(), "pkg-1.2.0"}).wait().ok());
+
+  auto destination = root / "out";
+  CHECK(all_ok(Archive::extract("file://" + tarball.string(), "v1.2.0", destination)));
+  CHECK(std::filesystem::exists(destination / "sn.reky"));
+  CHECK(std::filesystem::exists(destination / "src" / "main.sn"));
+  CHECK(!std::filesystem::exists(destination / "pkg-1.2.0"));
+
+  // Streamed from another process, nothing to unwrap
+  auto streamed = root / "streamed";
+  CHECK(all_ok(Archive::extract_from({REKY_TAR_CMD, "-cf", "-", "-C", release.string(), "."}, streamed)));
+  CHECK(std::filesystem::exists(streamed / "src" / "main.sn"));
+
+  // A corrupt archive fails instead of installing half a package
+  std::ofstream(root / "broken.tar.gz") << "not gzip";
+  CHECK(!all_ok(Archive::extract("file://" + (root / "broken.tar.gz").string(), "1.0.0", root / "broken")));
+  std::filesystem::remove_all(root);
+}
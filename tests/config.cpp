@@ -0,0 +1,86 @@
+
+#include <fstream>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include "test.hpp"
+
+#include "reky/config.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+// Errors as "line: message", one per line
+std::string parse(std::string_view content, RekyConfig& config) {
+  std::string errors;
+  ConfigParser::parse(content, config, [&](const std::string& message, unsigned int line) {
+    errors += fmt::format("{}: {}\n", line, message);
+  });
+  return errors;
+}
+
+}
+
+TEST(config_parses_entries) {
+  std::string content = "# deps\n"
+                        "  fmt == ^9.1 \r\n"
+                        "\n"
+                        "json==1.0.0; paths=./include/, src ,\n"
+                        "fmt==^10";
+  RekyConfig config;
+  CHECK_EQ(parse(content, config), "");
+  CHECK_EQ(config.size(), 2u);
+  // Last one wins, in the place of the first
+  CHECK_EQ(config[0].name, "fmt");
+  CHECK_EQ(config[0].version, "^10");
+  CHECK_EQ(config[0].line, 5u);
+  CHECK_EQ(config[1].name, "json");
+  CHECK_EQ(config[1].version, "1.0.0");
+  CHECK_EQ(config[1].paths, "./include/, src ,");
+  CHECK(ConfigParser::split_paths(config[1].paths) == std::vector<std::string>({"include", "src"}));
+  CHECK(ConfigParser::split_paths("./, .").empty());
+  // Views into the content, nothing was copied
+  CHECK(config[1].name.data() >= content.data() && config[1].name.data() < content.data() + content.size());
+}
+
+TEST(config_reports_errors) {
+  RekyConfig config;
+  auto errors = parse("ok==1\n"
+                      "missing separator\n"
+                      "name=1.0\n"
+                      "==1.0\n"
+                      "name==\n"
+                      "name==1; features=all\n"
+                      "a=b==2\n", config);
+  CHECK_EQ(errors, "2: Invalid package format. Must be 'name==version'\n"
+                   "3: Invalid package format. Must be 'name==version'\n"
+                   "4: Invalid name format. Must be 'name==version'\n"
+                   "5: Invalid version format. Must be 'name==version'\n"
+                   "6: Unknown option. Only 'paths=' is supported\n");
+  // Valid lines are still read
+  CHECK_EQ(config.size(), 2u);
+  CHECK_EQ(config[1].name, "a=b");
+  CHECK_EQ(config[1].version, "2");
+}
+
+TEST(config_arena_keeps_buffers) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-config-{}", getpid());
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root);
+  ConfigArena arena;
+  RekyConfig config;
+  for (int i = 0; i < 100; i++) {
+    auto path = root / fmt::format("{}.reky", i);
+    std::ofstream(path) << fmt::format("pkg{}==1.0.{}\n", i, i);
+    CHECK_EQ(parse(arena.load(path).value(), config), "");
+  }
+  CHECK(!arena.load(root / "missing.reky").has_value());
+  CHECK_EQ(arena.size(), 100u);
+  // Earlier views are still valid after more files were loaded
+  CHECK_EQ(config[0].name, "pkg0");
+  CHECK_EQ(config[99].version, "1.0.99");
+  std::filesystem::remove_all(root);
+}
@@ -0,0 +1,48 @@
+
+// Fetches need the rest of Snowball (its context, driver and logger),
+// these only build with its `src` on the include path, see README.md
+#if __has_include("compiler/ctx.h")
+
+#include <fstream>
+#include <cstdlib>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include "test.hpp"
+
+#include "reky.hpp"
+
+using namespace snowball;
+using namespace snowball::reky;
+
+// Errors end up in get(), the process has to survive them
+TEST(fetch_async_reports_errors) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-fetch-{}", getpid());
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "main");
+  std::ofstream(root / "main" / REKY_DEFAULT_FILE) << "missing==^1\n";
+  // No index to clone: every package is missing
+  setenv(REKY_HOME_ENV, (root / "home").c_str(), 1);
+  setenv(REKY_INDEX_ENV, (root / "no-index.git").c_str(), 1);
+  setenv(REKY_DAEMON_ENV, "0", 1);
+
+  Ctx ctx;
+  auto handle = fetch_dependencies_async(ctx, {root / "main"});
+  CHECK(!handle.next().has_value());
+  std::string message;
+  try {
+    handle.get();
+  } catch (const RekyError& e) {
+    message = e.what();
+  }
+  CHECK(message.find("'missing'") != std::string::npos);
+
+  unsetenv(REKY_HOME_ENV);
+  unsetenv(REKY_INDEX_ENV);
+  unsetenv(REKY_DAEMON_ENV);
+  std::filesystem::remove_all(root);
+}
+
+#endif
@@ -0,0 +1,104 @@
+
+#include "test.hpp"
+
+#include "reky/graph.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+using GraphMap = std::map<std::string, std::vector<std::string>>;
+
+// Level of every id in `schedule`
+std::vector<size_t> get_levels(const GraphSchedule& schedule, size_t size) {
+  std::vector<size_t> levels(size, SIZE_MAX);
+  for (size_t level = 0; level < schedule.levels.size(); level++) {
+    for (auto id : schedule.levels[level]) {
+      levels[id] = level;
+    }
+  }
+  return levels;
+}
+
+}
+
+TEST(graph_replaces_and_compacts_edges) {
+  DepsGraph graph;
+  auto& names = *graph.get_names();
+  auto a = names.intern("a"), b = names.intern("b"), c = names.intern("c");
+  graph.set_edges(a, {b, c});
+  graph.set_edges(b, {c});
+  graph.set_edges(c, {});
+  // Replacing leaves the old slice behind until compact()
+  graph.set_edges(a, {c});
+  CHECK_EQ(graph.get_node_count(), 3u);
+  CHECK_EQ(graph.get_edge_count(), 2u);
+  graph.compact();
+  CHECK_EQ(graph.get_edge_count(), 2u);
+  GraphMap expected = {{"a", {"c"}}, {"b", {"c"}}, {"c", {}}};
+  CHECK(GraphMap(graph.graph) == expected);
+  graph.remove_node(b);
+  CHECK_EQ(graph.graph.count("b"), 0u);
+  CHECK_EQ(graph.graph.size(), 2u);
+  CHECK(graph.graph.at("missing").empty());
+  // Copies share the names but not the edges
+  auto copy = graph;
+  copy.set_edges(a, {});
+  CHECK_EQ(graph.get_edges(a).size(), 1u);
+  CHECK(copy.get_names() == graph.get_names());
+}
+
+TEST(graph_levelizes_diamond) {
+  DepsGraph graph;
+  graph.assign({{"app", {"left", "right"}}, {"left", {"base"}}, {"right", {"base"}}, {"base", {}}});
+  auto& names = *graph.get_names();
+  auto id = [&](const char* name) { return names.find(name).value(); };
+  // Only as slow as its slowest branch
+  std::vector<uint64_t> weights(names.size(), 1);
+  weights[id("right")] = 5;
+  auto schedule = graph.levelize(&weights);
+  CHECK(!schedule.has_cycles());
+  CHECK_EQ(schedule.height, 3u);
+  CHECK_EQ(schedule.width, 2u);
+  auto levels = get_levels(schedule, names.size());
+  CHECK_EQ(levels[id("base")], 0u);
+  CHECK_EQ(levels[id("left")], 1u);
+  CHECK_EQ(levels[id("app")], 2u);
+  // The longer branch goes first
+  CHECK_EQ(schedule.levels[1][0], id("right"));
+  CHECK_EQ(schedule.critical_path[id("base")], 7u);
+  CHECK_EQ(schedule.get_critical_path_length(), 7u);
+}
+
+TEST(graph_levelizes_cycles_together) {
+  DepsGraph graph;
+  graph.assign({{"app", {"a"}}, {"a", {"b"}}, {"b", {"a", "leaf"}}, {"self", {"self"}}, {"leaf", {}}});
+  auto& names = *graph.get_names();
+  auto id = [&](const char* name) { return names.find(name).value(); };
+  auto schedule = graph.levelize();
+  CHECK_EQ(schedule.cycles.size(), 2u);
+  auto levels = get_levels(schedule, names.size());
+  CHECK_EQ(levels[id("a")], levels[id("b")]);
+  CHECK_EQ(levels[id("leaf")], 0u);
+  CHECK_EQ(levels[id("app")], levels[id("a")] + 1);
+  CHECK_EQ(levels[id("self")], 0u);
+}
+
+// Deeper than the stack would allow a recursive walk to go
+TEST(graph_levelizes_deep_chain) {
+  constexpr size_t depth = 200000;
+  DepsGraph graph;
+  auto& names = *graph.get_names();
+  for (size_t i = 0; i < depth; i++) {
+    names.intern(std::to_string(i));
+  }
+  for (PackageId i = 0; i < depth; i++) {
+    graph.set_edges(i, i + 1 < depth ? std::vector<PackageId>{i + 1} : std::vector<PackageId>{});
+  }
+  auto schedule = graph.levelize();
+  CHECK_EQ(schedule.height, depth);
+  CHECK_EQ(schedule.width, 1u);
+  CHECK_EQ(schedule.levels[0][0], depth - 1);
+  CHECK_EQ(schedule.critical_path[depth - 1], depth);
+  CHECK(!schedule.has_cycles());
+}
@@ -0,0 +1,81 @@
+
+#include <fstream>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include "test.hpp"
+
+#include "reky/lock.hpp"
+
+using namespace snowball::reky;
+
+TEST(lockfile_round_trips) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-lock-{}", getpid());
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root);
+  Lockfile lock;
+  lock.roots = {"/ws"};
+  lock.packages["fmt"] = {"9.1.0", "abc", "0123"};
+  lock.packages["json"] = {"1.0.0", "def", ""};
+  lock.graph = {{"fmt", {}}, {"json", {"fmt"}}};
+  lock.fingerprints["/ws/sn.reky"] = "ff";
+  std::ofstream(root / REKY_LOCK_FILE) << lock.dump();
+
+  auto loaded = Lockfile::load(root / REKY_LOCK_FILE).value();
+  CHECK(loaded.roots == lock.roots);
+  CHECK(loaded.graph == lock.graph);
+  CHECK(loaded.fingerprints == lock.fingerprints);
+  CHECK_EQ(loaded.packages["fmt"].commit, "abc");
+  CHECK_EQ(loaded.packages["fmt"].digest, "0123");
+  CHECK_EQ(loaded.packages["json"].version, "1.0.0");
+  // Same content, same bytes
+  CHECK_EQ(loaded.dump(), lock.dump());
+
+  // Anything unreadable means resolving again
+  CHECK(!Lockfile::load(root / "missing.lock").has_value());
+  std::ofstream(root / "broken.lock") << "{\"version\": 1, \"roots\": [";
+  CHECK(!Lockfile::load(root / "broken.lock").has_value());
+  std::ofstream(root / "old.lock") << "{\"version\": 0}";
+  CHECK(!Lockfile::load(root / "old.lock").has_value());
+  std::filesystem::remove_all(root);
+}
+
+// The fast path: the lock is used as long as no sn.reky changed
+TEST(lockfile_freshness) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-lock-fresh-{}", getpid());
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "dep");
+  std::ofstream(root / "sn.reky") << "dep==^1\n";
+  std::ofstream(root / "dep" / "sn.reky") << "";
+  Lockfile lock;
+  for (auto& path : {root / "sn.reky", root / "dep" / "sn.reky"}) {
+    lock.fingerprints[path.string()] = Lockfile::get_fingerprint(path);
+  }
+  CHECK(lock.is_fresh());
+  std::ofstream(root / "sn.reky") << "dep==^2\n";
+  CHECK(!lock.is_fresh());
+  std::ofstream(root / "sn.reky") << "dep==^1\n";
+  CHECK(lock.is_fresh());
+  // A deleted file doesn't match an empty one
+  std::filesystem::remove(root / "dep" / "sn.reky");
+  CHECK(!lock.is_fresh());
+  std::filesystem::remove_all(root);
+}
+
+TEST(lockfile_tree_digest) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-lock-digest-{}", getpid());
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "a" / "src");
+  std::ofstream(root / "a" / "src" / "main.sn") << "func main() {}\n";
+  std::ofstream(root / "a" / "sn.reky") << "";
+  // Where the tree lives doesn't matter
+  std::filesystem::copy(root / "a", root / "b", std::filesystem::copy_options::recursive);
+  auto digest = Lockfile::get_tree_digest(root / "a");
+  CHECK_EQ(Lockfile::get_tree_digest(root / "b"), digest);
+  // Renaming a file does
+  std::filesystem::rename(root / "b" / "src" / "main.sn", root / "b" / "src" / "lib.sn");
+  CHECK(Lockfile::get_tree_digest(root / "b") != digest);
+  std::filesystem::remove_all(root);
+}
@@ -0,0 +1,34 @@
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <exception>
+
+#include "test.hpp"
+
+using namespace snowball::reky;
+
+// Runs every test, or the ones whose name contains argv[1]
+int main(int argc, char** argv) {
+  size_t failed = 0;
+  size_t ran = 0;
+  for (auto& test : test::get_tests()) {
+    if (argc > 1 && !strstr(test.name, argv[1])) {
+      continue;
+    }
+    ran++;
+    test::get_failures() = 0;
+    auto start = std::chrono::steady_clock::now();
+    try {
+      test.run();
+    } catch (const std::exception& e) {
+      test::fail(__FILE__, __LINE__, std::string("uncaught exception: ") + e.what());
+    }
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    auto ok = test::get_failures() == 0;
+    failed += !ok;
+    std::cout << (ok ? "[ OK ] " : "[FAIL] ") << test.name << " (" << elapsed << " ms)" << std::endl;
+  }
+  std::cout << ran - failed << "/" << ran << " passed" << std::endl;
+  return failed == 0 ? 0 : 1;
+}
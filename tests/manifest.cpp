@@ -0,0 +1,115 @@
+
+#include <fstream>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include "test.hpp"
+
+#include "reky/manifest.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+std::filesystem::path make_root(const char* name) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-{}-{}", name, getpid());
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root);
+  return root;
+}
+
+std::string read(const std::filesystem::path& path) {
+  return AtomicFile::read(path).value_or("");
+}
+
+}
+
+TEST(manifest_round_trips) {
+  auto root = make_root("manifest");
+  auto path = root / REKY_MANIFEST_FILE;
+  DepsManifest manifest;
+  manifest.load(path);
+  CHECK(!manifest.save());
+  manifest.set("22", {"json", "1.0.0", "abc", ""});
+  manifest.set("11", {"fmt", "^9", "def", "include,src"});
+  CHECK(manifest.save());
+  // Sorted by folder, no paths field for whole trees
+  CHECK_EQ(read(path), "11\tfmt\t^9\tdef\tinclude,src\n22\tjson\t1.0.0\tabc\n");
+  // Nothing changed since, nothing to write
+  CHECK(!manifest.save());
+
+  DepsManifest loaded;
+  loaded.load(path);
+  auto fmt_entry = loaded.get("11").value();
+  CHECK_EQ(fmt_entry.name, "fmt");
+  CHECK_EQ(fmt_entry.version, "^9");
+  CHECK_EQ(fmt_entry.commit, "def");
+  CHECK_EQ(fmt_entry.paths, "include,src");
+  CHECK_EQ(loaded.get("22").value().paths, "");
+  CHECK(!loaded.get("33").has_value());
+  loaded.remove("22");
+  CHECK(loaded.save());
+  CHECK_EQ(read(path), "11\tfmt\t^9\tdef\tinclude,src\n");
+  std::filesystem::remove_all(root);
+}
+
+TEST(manifest_skips_broken_lines) {
+  auto root = make_root("manifest-broken");
+  auto path = root / REKY_MANIFEST_FILE;
+  std::ofstream(path) << "11\tfmt\t1.0\tabc\n\nonly-a-hash\n\tno-hash\t1.0\n22\tjson";
+  DepsManifest manifest;
+  manifest.load(path);
+  CHECK(manifest.get("11").has_value());
+  CHECK(!manifest.get("only-a-hash").has_value());
+  CHECK_EQ(manifest.get("22").value().name, "json");
+  CHECK_EQ(manifest.get("22").value().version, "");
+  std::filesystem::remove_all(root);
+}
+
+// Two builds of one workspace install different packages, neither
+// loses what the other saved
+TEST(manifest_merges_other_saves) {
+  auto root = make_root("manifest-merge");
+  auto path = root / REKY_MANIFEST_FILE;
+  DepsManifest first, second;
+  first.load(path);
+  second.load(path);
+  first.set("11", {"fmt", "1.0", "abc", ""});
+  first.set("22", {"json", "1.0", "abc", ""});
+  CHECK(first.save());
+  second.set("33", {"zlib", "1.0", "abc", ""});
+  second.remove("22");
+  // Only removes what it saw
+  CHECK(!second.get("11").has_value());
+  CHECK(second.save());
+  CHECK_EQ(read(path), "11\tfmt\t1.0\tabc\n22\tjson\t1.0\tabc\n33\tzlib\t1.0\tabc\n");
+  second.refresh();
+  second.remove("22");
+  CHECK(second.save());
+  first.refresh();
+  CHECK(!first.get("22").has_value());
+  CHECK_EQ(first.get("33").value().name, "zlib");
+  std::filesystem::remove_all(root);
+}
+
+// What an install leaves in its folder's lock for the next holder
+TEST(manifest_line_in_lock_file) {
+  auto root = make_root("manifest-lock");
+  ManifestEntry entry{"fmt", "^9", "def", "include"};
+  {
+    FileLock lock;
+    CHECK(lock.lock(root / "11.lock"));
+    CHECK(lock.write(DepsManifest::format_line("11", {"fmt", "^8-with-a-longer-version", "abc", ""})));
+    CHECK(lock.write(DepsManifest::format_line("11", entry)));
+  }
+  FileLock lock;
+  CHECK(lock.try_lock(root / "11.lock"));
+  auto parsed = DepsManifest::parse_line(lock.read()).value();
+  CHECK_EQ(parsed.first, "11");
+  CHECK_EQ(parsed.second.version, "^9");
+  CHECK_EQ(parsed.second.paths, "include");
+  CHECK(!DepsManifest::parse_line("").has_value());
+  std::filesystem::remove_all(root);
+}
@@ -0,0 +1,92 @@
+
+#include <atomic>
+#include <fstream>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include "test.hpp"
+
+#include "reky/pool.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+// Like install(): links a package into a Deps folder it creates first
+bool install(const std::filesystem::path& deps, const std::string& folder) {
+  std::filesystem::create_directories(deps / folder);
+  std::ofstream(deps / folder / "sn.reky") << "";
+  return true;
+}
+
+}
+
+TEST(pool_runs_every_job) {
+  std::atomic<size_t> done = 0;
+  WorkerPool pool(4);
+  for (size_t i = 0; i < 100; i++) {
+    pool.submit([&] { done++; });
+  }
+  pool.wait();
+  CHECK_EQ(done.load(), 100u);
+}
+
+// A failing install must not terminate the process (the daemon runs
+// installs for every workspace), it's rethrown to whoever waits
+TEST(pool_rethrows_from_wait) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-pool-{}", getpid());
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "deps");
+  // A file where a folder has to be created
+  std::ofstream(root / "not-a-folder") << "";
+  std::atomic<size_t> installed = 0;
+  WorkerPool pool(4);
+  for (size_t i = 0; i < 20; i++) {
+    pool.submit([&, i] {
+      auto deps = i == 7 ? root / "not-a-folder" : root / "deps";
+      installed += install(deps, std::to_string(i));
+    });
+  }
+  bool thrown = false;
+  try {
+    pool.wait();
+  } catch (const std::filesystem::filesystem_error&) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  // Everything else still ran
+  CHECK_EQ(installed.load(), 19u);
+  // Only reported once, the pool can be used again
+  pool.submit([&] { installed++; });
+  pool.wait();
+  CHECK_EQ(installed.load(), 20u);
+  std::filesystem::remove_all(root);
+}
+
+// Running prefetches queue the next depth, which has to stop once the
+// solver is done with them
+TEST(pool_cancel_stops_submits) {
+  std::atomic<size_t> done = 0;
+  std::atomic<bool> started = false;
+  std::atomic<bool> release = false;
+  WorkerPool pool(1);
+  pool.submit([&] {
+    started = true;
+    while (!release) {
+      std::this_thread::yield();
+    }
+    pool.submit([&] { done++; });
+  });
+  pool.submit([&] { done++; });
+  while (!started) {
+    std::this_thread::yield();
+  }
+  CHECK_EQ(pool.cancel(), 1u);
+  release = true;
+  pool.wait();
+  pool.submit([&] { done++; });
+  pool.wait();
+  CHECK_EQ(done.load(), 0u);
+}
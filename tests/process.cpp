@@ -0,0 +1,35 @@
+
+#include <chrono>
+#include <cerrno>
+
+#include <signal.h>
+
+#include "test.hpp"
+
+#include "reky/process.hpp"
+
+using namespace snowball::reky;
+
+TEST(process_captures_output) {
+  auto process = Process::spawn({"sh", "-c", "echo out; echo err >&2; exit 3"}, true);
+  auto& result = process.wait();
+  CHECK_EQ(result.exit_code, 3);
+  CHECK_EQ(result.out, "out\n");
+  CHECK_EQ(result.err, "err\n");
+  CHECK(!process.is_running());
+}
+
+// Dropped without wait(): killed and reaped right away, no zombie left
+TEST(process_destructor_reaps) {
+  pid_t pid;
+  auto start = std::chrono::steady_clock::now();
+  {
+    auto process = Process::spawn({"sleep", "30"});
+    pid = process.get_pid();
+    CHECK(pid > 0);
+    CHECK(process.is_running());
+  }
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(10));
+  // A zombie would still have its pid
+  CHECK(kill(pid, 0) != 0 && errno == ESRCH);
+}
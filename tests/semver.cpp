@@ -0,0 +1,77 @@
+
+#include "test.hpp"
+
+#include "reky/semver.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+// Versions of `catalog` matching `text`, as "a b c"
+std::string query(const VersionCatalog& catalog, const std::string& text) {
+  auto requirement = Requirement::parse(text);
+  if (!requirement.has_value()) {
+    return "invalid";
+  }
+  auto set = catalog.query(requirement.value(), catalog.size() + 1);
+  std::string result;
+  for (size_t i = 0; i < catalog.size(); i++) {
+    if (set.test(i)) {
+      result += (result.empty() ? "" : " ") + catalog.get_name(i);
+    }
+  }
+  return result;
+}
+
+}
+
+TEST(semver_ordering) {
+  auto parse = [](const char* text) { return Version::parse(text).value(); };
+  CHECK(parse("1.0.0") < parse("1.0.1"));
+  CHECK(parse("1.2.0") < parse("1.10.0"));
+  CHECK(parse("1.0.0-alpha") < parse("1.0.0"));
+  CHECK(parse("1.0.0-alpha") < parse("1.0.0-alpha.1"));
+  CHECK(parse("1.0.0-alpha.2") < parse("1.0.0-alpha.10"));
+  CHECK(parse("1.0.0-alpha.1") < parse("1.0.0-beta"));
+  CHECK(parse("1.0") == parse("1.0.0"));
+  CHECK(!Version::parse("one").has_value());
+  CHECK(!Requirement::parse("^").has_value());
+  CHECK(!Requirement::parse("").has_value());
+}
+
+TEST(semver_catalog_queries) {
+  VersionCatalog catalog({"2.0.0", "1.0.0", "1.2.0", "1.2.5", "0.3.1", "2.0.0-rc.1", "main"});
+  CHECK_EQ(catalog.get_name(0), "0.3.1");
+  CHECK_EQ(catalog.get_name(catalog.size() - 1), "main");
+  CHECK_EQ(query(catalog, "^1.0"), "1.0.0 1.2.0 1.2.5");
+  CHECK_EQ(query(catalog, "~1.2"), "1.2.0 1.2.5");
+  CHECK_EQ(query(catalog, "^0.3"), "0.3.1");
+  CHECK_EQ(query(catalog, ">=1.2 <2"), "1.2.0 1.2.5");
+  CHECK_EQ(query(catalog, ">= 1.2.5"), "1.2.5 2.0.0");
+  CHECK_EQ(query(catalog, "1.2"), "1.2.0");
+  CHECK_EQ(query(catalog, "*"), "0.3.1 1.0.0 1.2.0 1.2.5 2.0.0");
+  // Prereleases only when asked for
+  CHECK_EQ(query(catalog, ">=2.0.0-rc.1"), "2.0.0-rc.1 2.0.0");
+  CHECK_EQ(query(catalog, "main"), "main");
+  CHECK_EQ(query(catalog, "^3"), "");
+  CHECK(catalog.find("1.2.5").has_value());
+  CHECK(catalog.find("1.2.5.0") == std::nullopt);
+  CHECK(catalog.find("main").has_value());
+}
+
+TEST(semver_version_sets) {
+  VersionSet a(130);
+  a.set_range(3, 100);
+  VersionSet b(130);
+  b.set_range(90, 129);
+  CHECK_EQ((a & b).count(), 10u);
+  CHECK_EQ((a | b).count(), 126u);
+  CHECK_EQ((~a).count(), 130u - 97u);
+  CHECK_EQ((a & b).highest(), 99u);
+  CHECK_EQ(a.highest(50), 49u);
+  CHECK(a.intersects(b));
+  CHECK((a & b).is_subset_of(a));
+  CHECK(!a.is_subset_of(b));
+  CHECK((a & ~a).empty());
+  CHECK(!(a & ~a).intersects(a));
+}
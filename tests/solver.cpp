@@ -0,0 +1,214 @@
+
+#include <random>
+
+#include "test.hpp"
+
+#include "reky/solver.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+// A synthetic index: every package has `versions` versions, each with its
+// own requirements given as inclusive ranges of version indices
+struct Universe final {
+  struct Requirement {
+    PackageId id;
+    size_t from;
+    size_t to;
+  };
+
+  size_t versions = 0;
+  std::vector<std::string> names;
+  // [package][version]
+  std::vector<std::vector<std::vector<Requirement>>> dependencies;
+  std::vector<Requirement> root;
+
+  PackageId get_root() const {
+    return names.size() - 1;
+  }
+
+  Dependency to_dependency(const Requirement& requirement) const {
+    VersionSet set(versions + 1);
+    set.set_range(requirement.from, requirement.to + 1);
+    return {requirement.id, std::move(set), fmt::format("[{}, {}]", requirement.from + 1, requirement.to + 1)};
+  }
+
+  Solver::Provider get_provider() const {
+    Solver::Provider provider;
+    provider.get_name = [this](PackageId id) -> const std::string& { return names[id]; };
+    provider.get_version_count = [this](PackageId) { return versions; };
+    provider.get_version_name = [](PackageId, size_t version) { return std::to_string(version + 1); };
+    provider.get_dependencies = [this](PackageId id, size_t version, std::string&) {
+      std::vector<Dependency> result;
+      for (auto& requirement : dependencies[id][version]) {
+        result.push_back(to_dependency(requirement));
+      }
+      return std::optional<std::vector<Dependency>>(std::move(result));
+    };
+    return provider;
+  }
+
+  Solver::Result solve() const {
+    std::vector<Dependency> root_dependencies;
+    for (auto& requirement : root) {
+      root_dependencies.push_back(to_dependency(requirement));
+    }
+    auto provider = get_provider();
+    Solver solver(provider, get_root(), std::move(root_dependencies));
+    return solver.solve();
+  }
+
+  // `selection[id]` is a version index, or npos if the package isn't used
+  bool is_valid(const std::vector<size_t>& selection) const {
+    auto meets = [&](const std::vector<Requirement>& requirements) {
+      for (auto& requirement : requirements) {
+        auto version = selection[requirement.id];
+        if (version == SIZE_MAX || version < requirement.from || version > requirement.to) {
+          return false;
+        }
+      }
+      return true;
+    };
+    if (!meets(root)) {
+      return false;
+    }
+    for (size_t id = 0; id < dependencies.size(); id++) {
+      if (selection[id] != SIZE_MAX && !meets(dependencies[id][selection[id]])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Tries every combination
+  bool has_solution() const {
+    std::vector<size_t> selection(dependencies.size(), SIZE_MAX);
+    return search(selection, 0);
+  }
+
+  bool search(std::vector<size_t>& selection, size_t id) const {
+    if (id == dependencies.size()) {
+      return is_valid(selection);
+    }
+    selection[id] = SIZE_MAX;
+    if (search(selection, id + 1)) {
+      return true;
+    }
+    for (size_t version = 0; version < versions; version++) {
+      selection[id] = version;
+      if (search(selection, id + 1)) {
+        return true;
+      }
+    }
+    selection[id] = SIZE_MAX;
+    return false;
+  }
+
+  static Universe generate(std::mt19937& random, size_t packages, size_t versions) {
+    Universe universe;
+    universe.versions = versions;
+    for (size_t i = 0; i < packages; i++) {
+      universe.names.push_back(fmt::format("p{}", i));
+    }
+    universe.names.push_back("root");
+    auto pick = [&](size_t count) { return std::uniform_int_distribution<size_t>(0, count - 1)(random); };
+    auto requirement = [&](PackageId id) {
+      auto from = pick(versions);
+      auto to = from + pick(versions - from);
+      return Requirement{id, from, to};
+    };
+    universe.dependencies.resize(packages);
+    for (PackageId id = 0; id < packages; id++) {
+      universe.dependencies[id].resize(versions);
+      for (auto& requirements : universe.dependencies[id]) {
+        for (PackageId other = 0; other < packages; other++) {
+          if (other != id && pick(3) == 0) {
+            requirements.push_back(requirement(other));
+          }
+        }
+      }
+    }
+    for (PackageId id = 0; id < packages; id++) {
+      if (pick(2) == 0) {
+        universe.root.push_back(requirement(id));
+      }
+    }
+    return universe;
+  }
+};
+
+std::vector<size_t> get_selection(const Universe& universe, const Solver::Result& result) {
+  std::vector<size_t> selection(universe.dependencies.size(), SIZE_MAX);
+  for (auto& [id, version] : result.packages) {
+    selection[id] = version;
+  }
+  return selection;
+}
+
+}
+
+TEST(solver_picks_highest_compatible) {
+  Universe universe;
+  universe.versions = 3;
+  universe.names = {"a", "b", "root"};
+  universe.dependencies = {
+    // a@1 needs b 1, a@2 and a@3 need b 3
+    {{{1, 0, 0}}, {{1, 2, 2}}, {{1, 2, 2}}},
+    {{}, {}, {}}
+  };
+  // b can't go past 2, so a has to go back to 1
+  universe.root = {{0, 0, 2}, {1, 0, 1}};
+  auto result = universe.solve();
+  CHECK(result.ok);
+  auto selection = get_selection(universe, result);
+  CHECK_EQ(selection[0], 0u);
+  CHECK_EQ(selection[1], 0u);
+  CHECK(universe.is_valid(selection));
+  CHECK(result.conflicts > 0);
+}
+
+TEST(solver_explains_failures) {
+  Universe universe;
+  universe.versions = 2;
+  universe.names = {"a", "b", "root"};
+  universe.dependencies = {{{{1, 1, 1}}, {{1, 1, 1}}}, {{}, {}}};
+  universe.root = {{0, 0, 1}, {1, 0, 0}};
+  auto result = universe.solve();
+  CHECK(!result.ok);
+  CHECK(!result.explanation.empty());
+}
+
+// Found by comparing with brute force: merging two terms of the same
+// package in a learned incompatibility took their union instead of their
+// intersection, so the solver gave up although p0@2 needs nothing
+TEST(solver_learned_terms_intersect) {
+  Universe universe;
+  universe.versions = 4;
+  universe.names = {"p0", "p1", "p2", "root"};
+  universe.dependencies = {
+    {{{1, 3, 3}, {2, 3, 3}}, {}, {}, {{1, 0, 0}}},
+    {{{0, 0, 0}}, {}, {{0, 1, 2}, {2, 0, 1}}, {}},
+    {{}, {}, {}, {{0, 1, 1}}}
+  };
+  universe.root = {{0, 0, 3}};
+  CHECK(universe.has_solution());
+  auto result = universe.solve();
+  CHECK(result.ok);
+  CHECK(!result.ok || universe.is_valid(get_selection(universe, result)));
+}
+
+// Whatever the solver answers has to agree with trying every combination
+TEST(solver_matches_brute_force) {
+  std::mt19937 random(42);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < 20000; i++) {
+    auto universe = Universe::generate(random, 3 + i % 2, 4);
+    auto result = universe.solve();
+    auto expected = universe.has_solution();
+    if (result.ok != expected || (result.ok && !universe.is_valid(get_selection(universe, result)))) {
+      mismatches++;
+    }
+  }
+  CHECK_EQ(mismatches, 0u);
+}
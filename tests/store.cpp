@@ -0,0 +1,68 @@
+
+// The store hashes package names with Snowball's own hash, these only
+// build with its `src` on the include path, see README.md
+#if __has_include("compiler/utils/hash.h")
+
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include "test.hpp"
+
+#include "reky/store.hpp"
+
+using namespace snowball::reky;
+
+namespace {
+
+void write(const std::filesystem::path& path, const std::string& content) {
+  std::filesystem::create_directories(path.parent_path());
+  std::ofstream(path) << content;
+}
+
+std::string read(const std::filesystem::path& path) {
+  std::ostringstream content;
+  content << std::ifstream(path).rdbuf();
+  return content.str();
+}
+
+}
+
+// Only what changed between the two versions is written
+TEST(store_update_applies_the_delta) {
+  auto root = std::filesystem::temp_directory_path() / fmt::format("reky-store-{}", getpid());
+  std::filesystem::remove_all(root);
+  write(root / "base" / "same.sn", "same");
+  write(root / "base" / "changed.sn", "old");
+  write(root / "base" / "src" / "nested.sn", "nested");
+  write(root / "base" / "gone.sn", "gone");
+  write(root / "base" / "old" / "dir.sn", "dir");
+  write(root / "new" / "same.sn", "same");
+  write(root / "new" / "changed.sn", "new!");
+  write(root / "new" / "src" / "nested.sn", "nested");
+  write(root / "new" / "added.sn", "added");
+  PackageStore::materialize(root / "base", root / "deps");
+
+  auto stats = PackageStore::update(root / "base", root / "new", root / "deps");
+  CHECK_EQ(stats.written, 2u);
+  CHECK_EQ(stats.kept, 2u);
+  // gone.sn and old/ with everything in it, counted by remove_all
+  CHECK_EQ(stats.removed, 3u);
+  CHECK_EQ(read(root / "deps" / "changed.sn"), "new!");
+  CHECK_EQ(read(root / "deps" / "added.sn"), "added");
+  CHECK_EQ(read(root / "deps" / "src" / "nested.sn"), "nested");
+  CHECK(!std::filesystem::exists(root / "deps" / "gone.sn"));
+  CHECK(!std::filesystem::exists(root / "deps" / "old"));
+
+  // Without a base the tree is compared against itself: nothing to do
+  stats = PackageStore::update({}, root / "new", root / "deps");
+  CHECK_EQ(stats.written, 0u);
+  CHECK_EQ(stats.removed, 0u);
+  CHECK_EQ(stats.kept, 4u);
+  std::filesystem::remove_all(root);
+}
+
+#endif
@@ -0,0 +1,70 @@
+
+#ifndef __REKY_TEST_H__
+#define __REKY_TEST_H__
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+
+namespace snowball {
+namespace reky {
+namespace test {
+
+// Just enough of a test framework to run without a build system:
+// every TEST registers itself, main.cpp runs them (see README.md)
+struct TestCase final {
+  const char* name;
+  void (*run)();
+};
+
+inline std::vector<TestCase>& get_tests() {
+  static std::vector<TestCase> tests;
+  return tests;
+}
+
+struct Registration final {
+  Registration(const char* name, void (*run)()) {
+    get_tests().push_back({name, run});
+  }
+};
+
+// Checks failed by the test that's running
+inline size_t& get_failures() {
+  static size_t failures = 0;
+  return failures;
+}
+
+inline void fail(const char* file, int line, const std::string& message) {
+  get_failures()++;
+  std::cerr << "  " << file << ":" << line << ": " << message << std::endl;
+}
+
+template<typename A, typename B>
+void check_equal(const A& a, const B& b, const char* expression, const char* file, int line) {
+  if (!(a == b)) {
+    std::ostringstream message;
+    message << expression << ": " << a << " != " << b;
+    fail(file, line, message.str());
+  }
+}
+
+}
+}
+}
+
+#define TEST(name) \
+  static void test_##name(); \
+  static ::snowball::reky::test::Registration registration_##name(#name, test_##name); \
+  static void test_##name()
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      ::snowball::reky::test::fail(__FILE__, __LINE__, #condition); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) ::snowball::reky::test::check_equal((a), (b), #a " == " #b, __FILE__, __LINE__)
+
+#endif // __REKY_TEST_H__